@@ -0,0 +1,104 @@
+// Arduino core of the ftPwrDrive simulator
+//
+// The parts of the Arduino core for the ATmega32U4 used by the firmware.
+// Time is virtual, see simulator.h.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+typedef bool    boolean;
+typedef uint8_t byte;
+
+#define HIGH         1
+#define LOW          0
+
+#define INPUT        0
+#define OUTPUT       1
+#define INPUT_PULLUP 2
+
+#define DEFAULT      1
+#define INTERNAL     3
+
+#define DEC          10
+#define HEX          16
+
+// Leonardo pins
+#define SS           17
+#define A0           18
+#define A1           19
+#define A2           20
+#define A3           21
+#define A4           22
+#define A5           23
+
+// ADC channel of A0..A5
+static const uint8_t analog_pin_to_channel[] = { 7, 6, 5, 4, 1, 0 };
+#define analogPinToChannel( p ) ( analog_pin_to_channel[ p ] )
+
+template <typename A, typename B> inline auto min( A a, B b ) { return ( a < b ) ? a : b; }
+template <typename A, typename B> inline auto max( A a, B b ) { return ( a > b ) ? a : b; }
+#define constrain( x, low, high ) ( ( x ) < ( low ) ? ( low ) : ( ( x ) > ( high ) ? ( high ) : ( x ) ) )
+
+void pinMode( uint8_t pin, uint8_t mode );
+void digitalWrite( uint8_t pin, uint8_t value );
+int  digitalRead( uint8_t pin );
+int  analogRead( uint8_t pin );
+void analogReference( uint8_t mode );
+void analogWrite( uint8_t pin, int value );
+
+unsigned long millis( void );
+unsigned long micros( void );
+void delay( unsigned long ms );
+void delayMicroseconds( unsigned int us );
+
+#define noInterrupts() cli()
+#define interrupts()   sei()
+
+char *dtostrf( double value, signed char width, unsigned char precision, char *buffer );
+
+class String : public std::string {
+  public:
+    String( void ) {}
+    String( const char *s ) : std::string( s ) {}
+    long toInt( void ) const { return atol( c_str() ); }
+};
+
+class Serial_ {
+  // USB serial, output goes to stderr if the simulator is verbose, there is never input
+  public:
+    void begin( long baud ) {}
+    void setTimeout( long timeout ) {}
+    int  available( void ) { return 0; }
+    int  read( void ) { return -1; }
+    int  peek( void ) { return -1; }
+    operator bool( void ) { return true; }
+
+    void print( const char *s );
+    void print( const std::string &s ) { print( s.c_str() ); }
+    void print( char c );
+    void print( unsigned char b, int base = DEC ) { print( (unsigned long) b, base ); }
+    void print( int n, int base = DEC ) { print( (long) n, base ); }
+    void print( unsigned int n, int base = DEC ) { print( (unsigned long) n, base ); }
+    void print( long n, int base = DEC );
+    void print( unsigned long n, int base = DEC );
+    void print( double f, int digits = 2 );
+
+    template <typename T> void println( T v ) { print( v ); print( "\n" ); }
+    template <typename T> void println( T v, int format ) { print( v, format ); print( "\n" ); }
+    void println( void ) { print( "\n" ); }
+};
+
+extern Serial_ Serial;
+
+#endif
@@ -0,0 +1,22 @@
+// EEPROM of the ftPwrDrive simulator, initialized by simBegin
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <stdint.h>
+
+#define E2END 0x3FF
+
+class EEPROMClass {
+  public:
+    uint8_t read( int address );
+    void    write( int address, uint8_t value );
+    void    update( int address, uint8_t value ) { write( address, value ); }
+    uint16_t length( void ) { return E2END + 1; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,31 @@
+// SPI of the ftPwrDrive simulator, the 74HC595 on SS is simulated
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#include <Arduino.h>
+
+#define LSBFIRST  0
+#define MSBFIRST  1
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+class SPIClass {
+  public:
+    void     begin( void ) {}
+    void     end( void ) {}
+    void     setBitOrder( uint8_t order ) {}
+    void     setDataMode( uint8_t mode ) {}
+    void     setClockDivider( uint8_t divider ) {}
+    uint8_t  transfer( uint8_t data );
+    uint16_t transfer16( uint16_t data );
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,21 @@
+// TimerOne library of the ftPwrDrive simulator: a periodic interrupt in virtual time
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef TimerOne_h_
+#define TimerOne_h_
+
+class TimerOne {
+  public:
+    void initialize( long microseconds = 1000000 );
+    void setPeriod( long microseconds );
+    void attachInterrupt( void (*isr)( void ), long microseconds = -1 );
+    void detachInterrupt( void );
+    void start( void );
+    void stop( void );
+    void resume( void );
+};
+
+extern TimerOne Timer1;
+
+#endif
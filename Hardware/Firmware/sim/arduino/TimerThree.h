@@ -0,0 +1,21 @@
+// TimerThree library of the ftPwrDrive simulator: a periodic interrupt in virtual time
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef TimerThree_h_
+#define TimerThree_h_
+
+class TimerThree {
+  public:
+    void initialize( long microseconds = 1000000 );
+    void setPeriod( long microseconds );
+    void attachInterrupt( void (*isr)( void ), long microseconds = -1 );
+    void detachInterrupt( void );
+    void start( void );
+    void stop( void );
+    void resume( void );
+};
+
+extern TimerThree Timer3;
+
+#endif
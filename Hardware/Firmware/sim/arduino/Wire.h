@@ -0,0 +1,32 @@
+// I2C slave of the ftPwrDrive simulator
+//
+// Transfers of the I2C master are done by simTransfer, see simulator.h.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef TwoWire_h
+#define TwoWire_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUFFER_LENGTH 32
+
+class TwoWire {
+  public:
+    void   begin( void ) {}
+    void   begin( uint8_t address );
+    void   begin( int address ) { begin( (uint8_t) address ); }
+    void   setClock( uint32_t clock ) {}
+    void   onReceive( void (*handler)( int ) );
+    void   onRequest( void (*handler)( void ) );
+    int    available( void );
+    int    read( void );
+    int    peek( void );
+    size_t write( uint8_t data );
+    size_t write( const uint8_t *data, size_t quantity );
+};
+
+extern TwoWire Wire;
+
+#endif
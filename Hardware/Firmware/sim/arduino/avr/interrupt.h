@@ -0,0 +1,18 @@
+// Interrupts of the ftPwrDrive simulator
+//
+// The simulator calls the vectors at the virtual time they are due, if the
+// I flag of SREG is set, see simulator.cpp.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR( vector ) extern "C" void vector( void )
+
+#define cli() ( SREG &= ~0x80 )
+#define sei() ( SREG |= 0x80 )
+
+#endif
@@ -0,0 +1,94 @@
+// ATmega32U4 registers of the ftPwrDrive simulator
+//
+// Only the registers used by the firmware. Port, Timer1 counter and SPI data
+// registers are objects, so the simulator sees every access.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV( bit ) ( 1 << ( bit ) )
+
+class simPort {
+  // output register PORTx, writes are recorded as pin transitions
+  public:
+    explicit simPort( uint8_t port ) : port( port ) {}
+    operator uint8_t( void ) const;
+    simPort &operator=( uint8_t value );
+    simPort &operator|=( uint8_t mask ) { return *this = *this | mask; }
+    simPort &operator&=( uint8_t mask ) { return *this = *this & mask; }
+    simPort &operator^=( uint8_t mask ) { return *this = *this ^ mask; }
+  private:
+    uint8_t port;
+};
+
+class simPin {
+  // input register PINx: outputs read their PORTx bit, inputs the level set by the simulator
+  public:
+    explicit simPin( uint8_t port ) : port( port ) {}
+    operator uint8_t( void ) const;
+  private:
+    uint8_t port;
+};
+
+class simTCNT1 {
+  // Timer1 counter, derived from the virtual time
+  public:
+    operator uint16_t( void ) const;
+    simTCNT1 &operator=( uint16_t value );
+};
+
+class simSPDR {
+  // SPI data register, a write starts a transfer
+  public:
+    operator uint8_t( void ) const { return 0; }
+    simSPDR &operator=( uint8_t value );
+};
+
+extern simPort PORTB, PORTC, PORTD, PORTE, PORTF;
+extern simPin  PINB, PINC, PIND, PINE, PINF;
+extern volatile uint8_t DDRB, DDRC, DDRD, DDRE, DDRF;
+
+extern volatile uint8_t SREG;
+
+extern volatile uint8_t  TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+extern volatile uint16_t OCR1A, OCR1B, ICR1;
+extern simTCNT1 TCNT1;
+
+extern volatile uint8_t SPCR, SPSR;
+extern simSPDR SPDR;
+
+extern volatile uint8_t  ADMUX, ADCSRA, ADCSRB;
+extern volatile uint16_t ADC;
+
+// Timer1
+#define CS10   0
+#define CS11   1
+#define CS12   2
+#define WGM12  3
+#define WGM13  4
+#define OCIE1A 1
+#define ICIE1  5
+#define OCF1A  1
+#define ICF1   5
+
+// SPI
+#define SPE    6
+#define SPIE   7
+
+// ADC
+#define ADPS0  0
+#define ADPS1  1
+#define ADPS2  2
+#define ADIE   3
+#define ADATE  5
+#define ADEN   7
+#define ADTS2  2
+#define MUX5   5
+#define REFS0  6
+#define REFS1  7
+
+#endif
@@ -0,0 +1,11 @@
+// Busy waits of the ftPwrDrive simulator, they take virtual time
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef _UTIL_DELAY_H_
+#define _UTIL_DELAY_H_
+
+void _delay_us( double us );
+void _delay_ms( double ms );
+
+#endif
@@ -0,0 +1,317 @@
+// ftPwrDrive firmware simulator
+//
+// usage: ftPwrDriveSim [-p pins.csv] [-l loop µs] [-c I2C clock] [-a address] [-v] script
+//
+// Runs a script of I2C commands against the firmware in virtual time and
+// reports the recorded step pulses: step counts, rates, jitter and the
+// latency from a command to the first step. See readme.txt for the script.
+//
+// exit code: 0 ok, 1 an expect failed, 2 script or usage error
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "simulator.h"
+#include "ftPwrDriveIO.h"
+
+// steps further apart belong to different moves
+#define MOVEGAP 100000000ULL
+
+static std::vector<uint64_t> writes;     // end of all I2C writes
+
+static bool parseBytes( std::istringstream &in, std::vector<uint8_t> &bytes ) {
+  // bytes: 12, 0x0C, L<n> a long in 4 bytes, I<n> an int in 2 bytes, all little endian
+
+  std::string token;
+
+  while ( in >> token ) {
+
+    uint8_t size  = 1;
+    char    *end;
+
+    if ( ( token[0] == 'L' ) || ( token[0] == 'I' ) ) {
+      size  = ( token[0] == 'L' ) ? 4 : 2;
+      token = token.substr( 1 );
+    }
+
+    long value = strtol( token.c_str(), &end, 0 );
+    if ( token.empty() || *end ) {
+      return false;
+    }
+
+    for (uint8_t i=0; i<size; i++ ) {
+      bytes.push_back( ( value >> ( i * 8 ) ) & 0xFF );
+    }
+  }
+
+  return true;
+}
+
+static void printBytes( const char *what, const std::vector<uint8_t> &bytes ) {
+  printf( "%12.3f %s", simTime() / 1000.0, what );
+  for ( uint8_t b : bytes ) {
+    printf( " %02x", b );
+  }
+  printf( "\n" );
+}
+
+static int runScript( std::istream &script, uint8_t address ) {
+  // returns the number of failed expects, -1 on a script error
+
+  std::string          line;
+  std::vector<uint8_t> lastRead;
+  int                  lineNo   = 0;
+  int                  failures = 0;
+
+  while ( std::getline( script, line ) ) {
+
+    lineNo++;
+    line = line.substr( 0, line.find( '#' ) );
+
+    std::istringstream   in( line );
+    std::string          cmd;
+    std::vector<uint8_t> bytes;
+    long                 n = 0, v = 0;
+    bool                 ok = true;
+
+    if ( !( in >> cmd ) ) {
+      continue;
+    }
+
+    if ( cmd == "wait" ) {
+      ok = ( in >> n ) && ( n >= 0 );
+      if ( ok ) {
+        simRun( n * 1000ULL );
+      }
+
+    } else if ( ( cmd == "write" ) || ( cmd == "read" ) || ( cmd == "query" ) ) {
+      if ( cmd != "write" ) {
+        ok = ( in >> n ) && ( n > 0 ) && ( n <= 255 );
+      }
+      ok = ok && parseBytes( in, bytes ) && ( bytes.size() <= 255 ) && ( ( cmd == "read" ) == bytes.empty() );
+      if ( ok ) {
+        lastRead.assign( n, 0 );
+        if ( !simTransfer( address, bytes.data(), bytes.size(), lastRead.data(), n ) ) {
+          printf( "%12.3f address 0x%02x not acknowledged\n", simTime() / 1000.0, address );
+        } else if ( n > 0 ) {
+          printBytes( "read", lastRead );
+        }
+        if ( !bytes.empty() ) {
+          writes.push_back( simTime() );
+        }
+      }
+
+    } else if ( cmd == "expect" ) {
+      ok = parseBytes( in, bytes ) && !bytes.empty();
+      if ( ok && ( ( bytes.size() > lastRead.size() ) || !std::equal( bytes.begin(), bytes.end(), lastRead.begin() ) ) ) {
+        printf( "line %d: expect failed\n", lineNo );
+        printBytes( "expected", bytes );
+        failures++;
+      }
+
+    } else if ( cmd == "endstop" ) {
+      // pressed end stops are LOW
+      ok = ( in >> n >> v ) && ( n >= 1 ) && ( n <= MaxStepper );
+      if ( ok ) {
+        simSetInput( ES[ n - 1 ], !v );
+      }
+
+    } else if ( cmd == "ems" ) {
+      ok = (bool)( in >> v );
+      if ( ok ) {
+        simSetInput( EMS, !v );
+      }
+
+    } else if ( cmd == "address" ) {
+      ok = ( in >> n ) && ( n > 0 ) && ( n < 128 );
+      address = n;
+
+    } else if ( cmd == "print" ) {
+      std::getline( in, line );
+      printf( "%12.3f%s\n", simTime() / 1000.0, line.c_str() );
+
+    } else {
+      ok = false;
+    }
+
+    if ( !ok ) {
+      fprintf( stderr, "line %d: can't execute \"%s\"\n", lineNo, cmd.c_str() );
+      return -1;
+    }
+
+  }
+
+  return failures;
+}
+
+static void report( void ) {
+  // step & servo statistics out of the pin transitions
+
+  const std::vector<simTransition> &t = simTransitions();
+
+  printf( "\nvirtual time %.6fs, %zu pin transitions\n\n", simTime() / 1e9, t.size() );
+  printf( "motor  steps      net  first [s]   last [s]  rate [1/s]  interval min/avg/max [µs]  jitter rms/max [µs]  latency min/avg/max [µs]\n" );
+
+  for (uint8_t m=0; m<MaxStepper; m++ ) {
+
+    uint8_t stepSignal = simSignal( STEP[m] );
+    uint8_t dirSignal  = SIMSIGNAL595 + DIRECTION[m];
+
+    std::vector<uint64_t> steps;
+    std::vector<double>   intervals, latencies;
+    long                  net = 0;
+    uint8_t               dir = 0;
+    double                jitterSum = 0, jitterMax = 0;
+    size_t                jitters = 0, w = 0;
+
+    for ( const simTransition &e : t ) {
+      if ( e.signal == dirSignal ) {
+        dir = e.value;
+      } else if ( ( e.signal == stepSignal ) && e.value ) {
+        // a move starts with the first step or after a pause
+        if ( steps.empty() || ( e.time - steps.back() > MOVEGAP ) ) {
+          while ( ( w < writes.size() ) && ( writes[w] <= e.time ) ) {
+            w++;
+          }
+          if ( w > 0 ) {
+            latencies.push_back( ( e.time - writes[ w - 1 ] ) / 1000.0 );
+          }
+        } else {
+          intervals.push_back( ( e.time - steps.back() ) / 1000.0 );
+        }
+        steps.push_back( e.time );
+        net += dir ? -1 : 1;
+      }
+    }
+
+    if ( steps.empty() ) {
+      continue;
+    }
+
+    // jitter: deviation of an interval from its neighbours, a smooth ramp has none
+    for (size_t i=1; i+1<intervals.size(); i++ ) {
+      double j = fabs( intervals[i] - ( intervals[i-1] + intervals[i+1] ) / 2 );
+      jitterSum += j * j;
+      jitterMax  = std::max( jitterMax, j );
+      jitters++;
+    }
+
+    double min = 0, max = 0, avg = 0;
+    for ( double i : intervals ) {
+      min  = ( avg == 0 ) ? i : std::min( min, i );
+      max  = std::max( max, i );
+      avg += i;
+    }
+    avg /= std::max( intervals.size(), (size_t) 1 );
+
+    double lmin = 0, lmax = 0, lavg = 0;
+    for ( double l : latencies ) {
+      lmin  = ( lavg == 0 ) ? l : std::min( lmin, l );
+      lmax  = std::max( lmax, l );
+      lavg += l;
+    }
+    lavg /= std::max( latencies.size(), (size_t) 1 );
+
+    printf( "M%d   %7zu  %+7ld  %9.6f  %9.6f  %10.1f  %8.1f/%8.1f/%8.1f  %9.2f/%9.2f  %7.1f/%7.1f/%7.1f\n",
+            m + 1, steps.size(), net, steps.front() / 1e9, steps.back() / 1e9,
+            avg > 0 ? 1e6 / avg : 0.0, min, avg, max,
+            jitters ? sqrt( jitterSum / jitters ) : 0.0, jitterMax, lmin, lavg, lmax );
+  }
+
+  printf( "\nservo  pulses  width min/max [µs]\n" );
+
+  for (uint8_t s=0; s<MaxServo; s++ ) {
+
+    uint8_t  signal = simSignal( SERVO[s] );
+    uint64_t rise = 0;
+    size_t   pulses = 0;
+    double   min = 0, max = 0;
+
+    for ( const simTransition &e : t ) {
+      if ( e.signal != signal ) {
+        continue;
+      }
+      if ( e.value ) {
+        rise = e.time;
+      } else if ( rise > 0 ) {
+        double width = ( e.time - rise ) / 1000.0;
+        min = pulses ? std::min( min, width ) : width;
+        max = std::max( max, width );
+        pulses++;
+      }
+    }
+
+    if ( pulses > 0 ) {
+      printf( "S%d     %6zu  %7.1f/%7.1f\n", s + 1, pulses, min, max );
+    }
+  }
+}
+
+static void writePins( const char *path ) {
+  // all pin transitions as csv
+
+  FILE *f = fopen( path, "w" );
+
+  if ( f == NULL ) {
+    perror( path );
+    return;
+  }
+
+  fprintf( f, "time_us,signal,value\n" );
+  for ( const simTransition &e : simTransitions() ) {
+    fprintf( f, "%.3f,%s,%d\n", e.time / 1000.0, simSignalName( e.signal ), e.value );
+  }
+  fclose( f );
+}
+
+int main( int argc, char *argv[] ) {
+
+  const char *pins    = NULL;
+  uint8_t     address = 32;
+  int         opt;
+
+  while ( ( opt = getopt( argc, argv, "p:l:c:a:v" ) ) != -1 ) {
+    switch ( opt ) {
+      case 'p': pins = optarg; break;
+      case 'l': simSetLoopTime( strtoul( optarg, NULL, 0 ) * 1000 ); break;
+      case 'c': simSetI2CClock( strtoul( optarg, NULL, 0 ) ); break;
+      case 'a': address = strtoul( optarg, NULL, 0 ); break;
+      case 'v': simSetVerbose( true ); break;
+      default:
+        fprintf( stderr, "usage: %s [-p pins.csv] [-l loop µs] [-c I2C clock] [-a address] [-v] script\n", argv[0] );
+        return 2;
+    }
+  }
+
+  if ( optind != argc - 1 ) {
+    fprintf( stderr, "usage: %s [-p pins.csv] [-l loop µs] [-c I2C clock] [-a address] [-v] script\n", argv[0] );
+    return 2;
+  }
+
+  std::ifstream script( argv[optind] );
+  if ( !script ) {
+    perror( argv[optind] );
+    return 2;
+  }
+
+  simBegin( address );
+
+  int failures = runScript( script, address );
+
+  report();
+
+  if ( pins ) {
+    writePins( pins );
+  }
+
+  return ( failures < 0 ) ? 2 : ( failures > 0 ) ? 1 : 0;
+}
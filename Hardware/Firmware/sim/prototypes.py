@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+#
+# ftPwrDrive simulator
+#
+# Turns a sketch into C++ like the Arduino builder does: includes Arduino.h
+# and declares all functions in front of the first function definition.
+# Default arguments stay at the definition.
+#
+# usage: prototypes.py sketch.ino > sketch.cpp
+#
+# (C) 2022 Christian Bergschneider & Stefan Fuss
+
+import re
+import sys
+
+KEYWORDS = ( 'if', 'while', 'for', 'switch', 'return', 'else', 'ISR' )
+
+path   = sys.argv[1]
+source = open( path ).read()
+
+definition = re.compile( r'^([A-Za-z_][\w<> \*&]*?\s+\**)([A-Za-z_]\w*)\s*\(([^;{]*?)\)\s*\{', re.M )
+
+prototypes = []
+first      = None
+
+for m in definition.finditer( source ):
+    result, name, arguments = m.group( 1 ).strip(), m.group( 2 ), m.group( 3 )
+    if name in KEYWORDS or result.split()[0] in KEYWORDS or result.startswith( 'template' ):
+        continue
+    if first is None:
+        first = m.start()
+    arguments = re.sub( r'\s*=\s*[^,]+', '', ' '.join( arguments.split() ) )
+    prototypes.append( '%s %s(%s);' % ( result, name, arguments ) )
+
+line = source[:first].count( '\n' ) + 1
+
+print( '#include <Arduino.h>' )
+print( '#line 1 "%s"' % path )
+print( source[:first], end='' )
+print( '\n'.join( prototypes ) )
+print( '#line %d "%s"' % ( line, path ) )
+print( source[first:], end='' )
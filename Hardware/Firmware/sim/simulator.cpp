@@ -0,0 +1,662 @@
+// ftPwrDrive firmware simulator
+//
+// Arduino core, registers and peripherals in virtual time
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <SPI.h>
+#include <TimerOne.h>
+#include <TimerThree.h>
+#include <Wire.h>
+#include "ftPwrDriveIO.h"
+#include "simulator.h"
+
+// the firmware
+void setup( void );
+void loop( void );
+extern "C" void TIMER1_CAPT_vect( void );
+extern "C" void TIMER1_COMPA_vect( void );
+extern "C" void SPI_STC_vect( void );
+
+#define ISRLATENCY 1250        // ns from an interrupt flag to the first instruction of its ISR, ~20 cycles at 16MHz
+#define SPIBYTE    2000        // ns per SPI byte at 4MHz SPI clock
+#define NEVER      UINT64_MAX
+
+// event sources
+#define EVENT_TIMER1    0
+#define EVENT_TIMER3    1
+#define EVENT_TIMERONE  2
+#define EVENT_SPI       3
+
+// ********** virtual time **********
+
+static uint64_t now      = 0;        // virtual time in ns
+static uint64_t nextLoop = 0;        // next call of loop()
+static uint64_t loopTime = 20000;    // time one loop() takes
+static uint32_t i2cClock = 100000;
+static bool     verbose  = false;
+
+static std::vector<simTransition> transitions;
+
+// ********** registers **********
+
+simPort PORTB( IO_PORTB ), PORTC( IO_PORTC ), PORTD( IO_PORTD ), PORTE( IO_PORTE ), PORTF( IO_PORTF );
+simPin  PINB( IO_PORTB ), PINC( IO_PORTC ), PIND( IO_PORTD ), PINE( IO_PORTE ), PINF( IO_PORTF );
+volatile uint8_t DDRB, DDRC, DDRD, DDRE, DDRF;
+
+volatile uint8_t SREG = 0x80;
+
+volatile uint8_t  TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, OCR1B, ICR1;
+simTCNT1 TCNT1;
+
+volatile uint8_t SPCR, SPSR;
+simSPDR SPDR;
+
+volatile uint8_t  ADMUX, ADCSRA, ADCSRB;
+volatile uint16_t ADC;
+
+static uint8_t portValue[IO_PORTS];                                  // PORTx
+static uint8_t inputLevel[IO_PORTS] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }; // input pins, pulled up
+static volatile uint8_t *const ddr[IO_PORTS] = { &DDRB, &DDRC, &DDRD, &DDRE, &DDRF };
+static simPort *const ports[IO_PORTS] = { &PORTB, &PORTC, &PORTD, &PORTE, &PORTF };
+static simPin  *const pins[IO_PORTS]  = { &PINB, &PINC, &PIND, &PINE, &PINF };
+
+// ********** 74HC595 **********
+
+static uint8_t shift595  = 0;        // shift register, the last byte on SPI
+static uint8_t output595 = 0;        // outputs, latched on the rising edge of SS
+
+static void record( uint8_t signal, uint8_t value ) {
+  // records a pin transition
+  transitions.push_back( { now, signal, value } );
+}
+
+static void latch595( void ) {
+  // the shift register goes to the outputs
+
+  uint8_t changed = output595 ^ shift595;
+
+  output595 = shift595;
+  for (uint8_t i=0; i<8; i++ ) {
+    if ( changed & ( 1 << i ) ) {
+      record( SIMSIGNAL595 + i, ( output595 >> i ) & 1 );
+    }
+  }
+}
+
+simPort::operator uint8_t( void ) const {
+  return portValue[port];
+}
+
+simPort &simPort::operator=( uint8_t value ) {
+  // writes the port, all changed bits are recorded
+
+  uint8_t changed = portValue[port] ^ value;
+
+  portValue[port] = value;
+  for (uint8_t i=0; i<8; i++ ) {
+    if ( changed & ( 1 << i ) ) {
+      record( port * 8 + i, ( value >> i ) & 1 );
+    }
+  }
+
+  if ( ( port == ioPort( SS ) ) && ( changed & value & ioMask( SS ) ) ) {
+    latch595();
+  }
+
+  return *this;
+}
+
+simPin::operator uint8_t( void ) const {
+  // outputs read their PORTx bit, inputs their level
+  return ( portValue[port] & *ddr[port] ) | ( inputLevel[port] & ~*ddr[port] );
+}
+
+// ********** interrupts **********
+
+static void interrupt( void (*isr)( void ) ) {
+  // calls an ISR like the CPU, the I flag is cleared while it runs
+
+  SREG &= ~0x80;
+  isr();
+  SREG |= 0x80;
+}
+
+// ********** Timer1: counter, compare matches & capture interrupt at TOP in CTC mode **********
+
+static int64_t timer1Base = 0;       // time of count 0
+static int64_t timer1Done = -1;      // count, until which all matches are handled
+
+static uint16_t timer1Prescaler( void ) {
+  // 0 = stopped
+  static const uint16_t prescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  return prescaler[ TCCR1B & 7 ];
+}
+
+static uint16_t timer1Top( void ) {
+
+  uint8_t mode = ( ( TCCR1B >> 1 ) & 0x0C ) | ( TCCR1A & 3 );
+
+  switch ( mode ) {
+    case 4:  return OCR1A;
+    case 12: return ICR1;
+    default: return 0xFFFF;
+  }
+}
+
+static int64_t timer1Time( int64_t count ) {
+  // time of a count, a timer tick is prescaler * 62.5ns
+  return timer1Base + ( count * timer1Prescaler() * 125 + 1 ) / 2;
+}
+
+static int64_t timer1Count( uint64_t time ) {
+  // count at a time
+  return ( ( (int64_t) time - timer1Base ) * 2 ) / ( timer1Prescaler() * 125 );
+}
+
+static int64_t timer1Match( uint16_t value ) {
+  // next count after timer1Done, when the counter equals value
+
+  int64_t period = (int64_t) timer1Top() + 1;
+  int64_t from   = timer1Done + 1;
+  int64_t count  = from - ( from % period ) + value;
+
+  if ( value >= period ) {
+    return -1;
+  }
+  if ( count < from ) {
+    count += period;
+  }
+  return count;
+}
+
+static int64_t timer1Next( void ) {
+  // count of the next compare match or capture, -1 if there is none
+
+  if ( timer1Prescaler() == 0 ) {
+    return -1;
+  }
+
+  int64_t compa = timer1Match( OCR1A );
+  int64_t capt  = ( ( ( TCCR1B >> 1 ) & 0x0C ) == 12 ) ? timer1Match( ICR1 ) : -1;
+
+  if ( ( compa < 0 ) || ( ( capt >= 0 ) && ( capt < compa ) ) ) {
+    return capt;
+  }
+  return compa;
+}
+
+static void timer1Event( int64_t count ) {
+  // all matches of a count set their flags, the ISRs run by vector priority
+
+  bool capt  = ( ( ( TCCR1B >> 1 ) & 0x0C ) == 12 ) && ( timer1Match( ICR1 ) == count ) && ( TIMSK1 & _BV( ICIE1 ) );
+  bool compa = ( timer1Match( OCR1A ) == count ) && ( TIMSK1 & _BV( OCIE1A ) );
+
+  timer1Done = count;
+
+  if ( capt ) {
+    interrupt( TIMER1_CAPT_vect );
+  }
+  if ( compa ) {
+    interrupt( TIMER1_COMPA_vect );
+  }
+}
+
+simTCNT1::operator uint16_t( void ) const {
+
+  if ( timer1Prescaler() == 0 ) {
+    return timer1Done < 0 ? 0 : timer1Done;
+  }
+  return timer1Count( now ) % ( (int64_t) timer1Top() + 1 );
+}
+
+simTCNT1 &simTCNT1::operator=( uint16_t value ) {
+  // restarts the counter at value, a compare match at value is blocked like on the CPU
+
+  timer1Done = value;
+  timer1Base = (int64_t) now - ( (int64_t) value * timer1Prescaler() * 125 + 1 ) / 2;
+
+  return *this;
+}
+
+// ********** TimerOne & TimerThree: periodic interrupts **********
+
+struct simPeriodic {
+  uint64_t period  = 1000000000;
+  uint64_t next    = NEVER;
+  void     (*isr)( void ) = nullptr;
+};
+
+static simPeriodic timerOne, timerThree;
+
+static void periodicStart( simPeriodic &t ) {
+  t.next = now + t.period;
+}
+
+static void periodicSetPeriod( simPeriodic &t, long microseconds ) {
+  t.period = max( microseconds, 1L ) * 1000;
+  if ( t.next != NEVER ) {
+    periodicStart( t );
+  }
+}
+
+static void periodicEvent( simPeriodic &t ) {
+  // the interrupt flag stays set once, missed periods are lost
+
+  while ( t.next <= now ) {
+    t.next += t.period;
+  }
+  if ( t.isr ) {
+    interrupt( t.isr );
+  }
+}
+
+TimerOne   Timer1;
+TimerThree Timer3;
+
+void TimerOne::initialize( long microseconds )                        { periodicSetPeriod( timerOne, microseconds ); periodicStart( timerOne ); }
+void TimerOne::setPeriod( long microseconds )                         { periodicSetPeriod( timerOne, microseconds ); }
+void TimerOne::attachInterrupt( void (*isr)( void ), long microseconds ) { if ( microseconds > 0 ) setPeriod( microseconds ); timerOne.isr = isr; }
+void TimerOne::detachInterrupt( void )                                { timerOne.isr = nullptr; }
+void TimerOne::start( void )                                          { periodicStart( timerOne ); }
+void TimerOne::stop( void )                                           { timerOne.next = NEVER; }
+void TimerOne::resume( void )                                         { if ( timerOne.next == NEVER ) periodicStart( timerOne ); }
+
+void TimerThree::initialize( long microseconds )                        { periodicSetPeriod( timerThree, microseconds ); periodicStart( timerThree ); }
+void TimerThree::setPeriod( long microseconds )                         { periodicSetPeriod( timerThree, microseconds ); }
+void TimerThree::attachInterrupt( void (*isr)( void ), long microseconds ) { if ( microseconds > 0 ) setPeriod( microseconds ); timerThree.isr = isr; }
+void TimerThree::detachInterrupt( void )                                { timerThree.isr = nullptr; }
+void TimerThree::start( void )                                          { periodicStart( timerThree ); }
+void TimerThree::stop( void )                                           { timerThree.next = NEVER; }
+void TimerThree::resume( void )                                         { if ( timerThree.next == NEVER ) periodicStart( timerThree ); }
+
+// ********** SPI **********
+
+static uint64_t spiDone = NEVER;     // end of the running interrupt driven transfer
+
+SPIClass SPI;
+
+simSPDR &simSPDR::operator=( uint8_t value ) {
+  // starts a transfer, SPI_STC_vect is called at its end
+  shift595 = value;
+  if ( SPCR & _BV( SPIE ) ) {
+    spiDone = now + SPIBYTE;
+  }
+  return *this;
+}
+
+static void advance( uint64_t until, bool runLoop );
+
+uint8_t SPIClass::transfer( uint8_t data ) {
+  shift595 = data;
+  advance( now + SPIBYTE, false );
+  return 0;
+}
+
+uint16_t SPIClass::transfer16( uint16_t data ) {
+  // the last byte stays in the shift register
+  shift595 = data & 0xFF;
+  advance( now + 2 * SPIBYTE, false );
+  return 0;
+}
+
+// ********** scheduler **********
+
+static uint64_t nextEvent( uint8_t &source ) {
+  // the next interrupt
+
+  uint64_t due   = NEVER;
+  int64_t  count = timer1Next();
+
+  if ( count >= 0 ) {
+    due    = timer1Time( count );
+    source = EVENT_TIMER1;
+  }
+  if ( timerThree.next < due ) {
+    due    = timerThree.next;
+    source = EVENT_TIMER3;
+  }
+  if ( timerOne.next < due ) {
+    due    = timerOne.next;
+    source = EVENT_TIMERONE;
+  }
+  if ( spiDone < due ) {
+    due    = spiDone;
+    source = EVENT_SPI;
+  }
+
+  return due;
+}
+
+static void fire( uint8_t source, uint64_t due ) {
+  // an ISR starts ISRLATENCY after its event or later, if interrupts were disabled
+
+  int64_t count = timer1Next();
+
+  now = max( now, due + ISRLATENCY );
+
+  switch ( source ) {
+    case EVENT_TIMER1:
+      timer1Event( count );
+      break;
+    case EVENT_TIMER3:
+      periodicEvent( timerThree );
+      break;
+    case EVENT_TIMERONE:
+      periodicEvent( timerOne );
+      break;
+    case EVENT_SPI:
+      spiDone = NEVER;
+      interrupt( SPI_STC_vect );
+      break;
+  }
+}
+
+static void advance( uint64_t until, bool runLoop ) {
+  // runs the interrupts and loop() until the virtual time, while the I flag is cleared the time just passes
+
+  while ( true ) {
+
+    uint8_t  source = 0;
+    uint64_t due    = nextEvent( source );
+
+    if ( ( SREG & 0x80 ) && ( due <= until ) && ( !runLoop || ( due <= nextLoop ) ) ) {
+      fire( source, due );
+      continue;
+    }
+
+    if ( runLoop && ( nextLoop <= until ) ) {
+      now = max( now, nextLoop );
+      loop();
+      nextLoop = now + loopTime;
+      continue;
+    }
+
+    break;
+  }
+
+  now = max( now, until );
+}
+
+// ********** Arduino core **********
+
+static uint8_t eeprom[ E2END + 1 ];
+
+EEPROMClass EEPROM;
+Serial_     Serial;
+
+uint8_t EEPROMClass::read( int address ) {
+  return eeprom[ address & E2END ];
+}
+
+void EEPROMClass::write( int address, uint8_t value ) {
+  eeprom[ address & E2END ] = value;
+}
+
+void pinMode( uint8_t pin, uint8_t mode ) {
+  if ( mode == OUTPUT ) {
+    *ddr[ ioPort( pin ) ] |= ioMask( pin );
+  } else {
+    *ddr[ ioPort( pin ) ] &= ~ioMask( pin );
+  }
+}
+
+void digitalWrite( uint8_t pin, uint8_t value ) {
+  simPort &p = *ports[ ioPort( pin ) ];
+  p = value ? ( p | ioMask( pin ) ) : ( p & ~ioMask( pin ) );
+}
+
+int digitalRead( uint8_t pin ) {
+  return ( *pins[ ioPort( pin ) ] & ioMask( pin ) ) ? HIGH : LOW;
+}
+
+int analogRead( uint8_t pin ) {
+  // a V3 board pulls MREFI up
+  return 1023;
+}
+
+void analogReference( uint8_t mode ) {
+}
+
+void analogWrite( uint8_t pin, int value ) {
+  digitalWrite( pin, value >= 128 );
+}
+
+unsigned long millis( void ) {
+  return now / 1000000;
+}
+
+unsigned long micros( void ) {
+  return now / 1000;
+}
+
+void delay( unsigned long ms ) {
+  advance( now + ms * 1000000ULL, false );
+}
+
+void delayMicroseconds( unsigned int us ) {
+  advance( now + us * 1000ULL, false );
+}
+
+void _delay_us( double us ) {
+  advance( now + (uint64_t)( us * 1000 ), false );
+}
+
+void _delay_ms( double ms ) {
+  advance( now + (uint64_t)( ms * 1000000 ), false );
+}
+
+char *dtostrf( double value, signed char width, unsigned char precision, char *buffer ) {
+  sprintf( buffer, "%*.*f", width, precision, value );
+  return buffer;
+}
+
+void Serial_::print( const char *s ) {
+  if ( verbose ) {
+    fputs( s, stderr );
+  }
+}
+
+void Serial_::print( char c ) {
+  if ( verbose ) {
+    fputc( c, stderr );
+  }
+}
+
+void Serial_::print( long n, int base ) {
+  if ( verbose ) {
+    fprintf( stderr, ( base == HEX ) ? "%lX" : "%ld", n );
+  }
+}
+
+void Serial_::print( unsigned long n, int base ) {
+  if ( verbose ) {
+    fprintf( stderr, ( base == HEX ) ? "%lX" : "%lu", n );
+  }
+}
+
+void Serial_::print( double f, int digits ) {
+  if ( verbose ) {
+    fprintf( stderr, "%.*f", digits, f );
+  }
+}
+
+// ********** I2C slave **********
+
+static uint8_t slaveAddress = 0;
+static void    (*receiveHandler)( int ) = nullptr;
+static void    (*requestHandler)( void ) = nullptr;
+static uint8_t rxBuffer[ BUFFER_LENGTH ];
+static uint8_t rxBytes = 0;
+static uint8_t rxIndex = 0;
+static uint8_t txBuffer[ BUFFER_LENGTH ];
+static uint8_t txBytes = 0;
+static bool    requesting = false;
+
+TwoWire Wire;
+
+void TwoWire::begin( uint8_t address )                  { slaveAddress = address; }
+void TwoWire::onReceive( void (*handler)( int ) )       { receiveHandler = handler; }
+void TwoWire::onRequest( void (*handler)( void ) )      { requestHandler = handler; }
+int  TwoWire::available( void )                         { return rxBytes - rxIndex; }
+int  TwoWire::read( void )                              { return ( rxIndex < rxBytes ) ? rxBuffer[ rxIndex++ ] : -1; }
+int  TwoWire::peek( void )                              { return ( rxIndex < rxBytes ) ? rxBuffer[ rxIndex ] : -1; }
+
+size_t TwoWire::write( uint8_t data ) {
+  // only while the master reads
+  if ( !requesting || ( txBytes >= BUFFER_LENGTH ) ) {
+    return 0;
+  }
+  txBuffer[ txBytes++ ] = data;
+  return 1;
+}
+
+size_t TwoWire::write( const uint8_t *data, size_t quantity ) {
+  size_t n = 0;
+  while ( ( n < quantity ) && write( data[n] ) ) {
+    n++;
+  }
+  return n;
+}
+
+static void twiReceive( void ) {
+  // the TWI interrupt at the stop or repeated start after a write
+  if ( receiveHandler ) {
+    receiveHandler( rxBytes );
+  }
+}
+
+static void twiRequest( void ) {
+  // the TWI interrupt after the address of a read
+  if ( requestHandler ) {
+    requestHandler();
+  }
+}
+
+bool simTransfer( uint8_t address, const uint8_t *write, uint8_t writeBytes, uint8_t *read, uint8_t readBytes ) {
+  // a byte takes 9 clocks, the slave stretches the clock while its interrupt runs
+
+  uint64_t byteTime = 9000000000ULL / i2cClock;
+
+  if ( ( address != slaveAddress ) || ( receiveHandler == nullptr ) ) {
+    simRun( byteTime );
+    return false;
+  }
+
+  if ( ( writeBytes > 0 ) || ( readBytes == 0 ) ) {
+    simRun( byteTime * ( 1 + writeBytes ) );
+    // the TWI buffer keeps BUFFER_LENGTH bytes
+    rxBytes = min( writeBytes, (uint8_t) BUFFER_LENGTH );
+    rxIndex = 0;
+    memcpy( rxBuffer, write, rxBytes );
+    interrupt( twiReceive );
+    rxBytes = 0;
+  }
+
+  if ( readBytes > 0 ) {
+    simRun( byteTime );
+    txBytes    = 0;
+    requesting = true;
+    interrupt( twiRequest );
+    requesting = false;
+    // the bus reads 0xFF after the last byte sent
+    for (uint8_t i=0; i<readBytes; i++ ) {
+      read[i] = ( i < txBytes ) ? txBuffer[i] : 0xFF;
+    }
+    simRun( byteTime * readBytes );
+  }
+
+  return true;
+}
+
+// ********** simulator **********
+
+void simBegin( uint8_t address ) {
+  // valid EEPROM, see readEEPROM: header, version, serial number, address, current * 10, checksum
+
+  uint8_t config[7] = { 42, 1, 1, 0, address, 10, 0 };
+
+  memset( eeprom, 0xFF, sizeof( eeprom ) );
+  config[6] = ( config[0] + config[1] + config[2] + config[3] + config[4] + config[5] ) % 10;
+  memcpy( eeprom, config, sizeof( config ) );
+
+  setup();
+  nextLoop = now;
+}
+
+void simRun( uint64_t ns ) {
+  advance( now + ns, true );
+}
+
+void simSetInput( uint8_t pin, uint8_t level ) {
+  if ( level ) {
+    inputLevel[ ioPort( pin ) ] |= ioMask( pin );
+  } else {
+    inputLevel[ ioPort( pin ) ] &= ~ioMask( pin );
+  }
+}
+
+uint64_t simTime( void ) {
+  return now;
+}
+
+uint8_t simSignal( uint8_t pin ) {
+  return ioPort( pin ) * 8 + IO_PINBIT[ pin ];
+}
+
+const char *simSignalName( uint8_t signal ) {
+
+  static std::string names[ SIMSIGNALS ];
+
+  if ( names[0].empty() ) {
+    static const char port[] = "BCDEF";
+    char name[16];
+    for (uint8_t i=0; i<SIMSIGNAL595; i++ ) {
+      sprintf( name, "P%c%d", port[ i / 8 ], i % 8 );
+      names[i] = name;
+    }
+    for (uint8_t i=0; i<MaxStepper; i++ ) {
+      sprintf( name, "M%dSTEP", i + 1 );
+      names[ simSignal( STEP[i] ) ] = name;
+      sprintf( name, "M%dEN", i + 1 );
+      names[ SIMSIGNAL595 + ENABLE[i] ] = name;
+      sprintf( name, "M%dDIR", i + 1 );
+      names[ SIMSIGNAL595 + DIRECTION[i] ] = name;
+    }
+    for (uint8_t i=0; i<MaxServo; i++ ) {
+      sprintf( name, "SERVO%d", i + 1 );
+      names[ simSignal( SERVO[i] ) ] = name;
+    }
+    names[ simSignal( LED ) ]   = "LED";
+    names[ simSignal( MS1 ) ]   = "MS1";
+    names[ simSignal( MS2 ) ]   = "MS2";
+    names[ simSignal( MS3 ) ]   = "MS3";
+    names[ simSignal( SS ) ]    = "SS";
+    names[ simSignal( MREFI ) ] = "MREFI";
+  }
+
+  return ( signal < SIMSIGNALS ) ? names[ signal ].c_str() : "?";
+}
+
+const std::vector<simTransition> &simTransitions( void ) {
+  return transitions;
+}
+
+void simSetLoopTime( uint64_t ns ) {
+  loopTime = max( ns, (uint64_t) 1000 );
+}
+
+void simSetI2CClock( uint32_t hz ) {
+  i2cClock = max( hz, (uint32_t) 1000 );
+}
+
+void simSetVerbose( bool on ) {
+  verbose = on;
+}
@@ -0,0 +1,65 @@
+// ftPwrDrive firmware simulator
+//
+// Runs ftPwrDriveFW.ino on Linux in virtual time. loop() is called every
+// loop time, Timer3, Timer1 compare matches and SPI transfers call their
+// interrupts when they are due. Nothing depends on the wall clock, so every
+// run of the same script gives the same result.
+//
+// All changes of the output pins and the 74HC595 outputs are recorded with
+// their virtual time: STEP, DIR, ENABLE, servos, LED & microstep pins.
+//
+// The board is simulated as V3 board with DAC, the EEPROM is initialized.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+
+#ifndef simulator_h
+#define simulator_h
+
+#include <cstdint>
+#include <vector>
+
+// signals: port pins are port * 8 + bit (PB0 = 0 ... PF7 = 39), 74HC595 outputs QA..QH are 40..47
+#define SIMSIGNALS  48
+#define SIMSIGNAL595 40
+
+struct simTransition {
+  uint64_t time;     // virtual time in ns
+  uint8_t  signal;   // see above
+  uint8_t  value;    // new level
+};
+
+void simBegin( uint8_t address = 32 );
+  // initialize the EEPROM with address and run setup()
+
+void simRun( uint64_t ns );
+  // run the firmware for ns
+
+bool simTransfer( uint8_t address, const uint8_t *write, uint8_t writeBytes, uint8_t *read, uint8_t readBytes );
+  // I2C transfer, the read follows the write with a repeated start. writeBytes or readBytes may be 0.
+  // The firmware runs while the bytes are on the bus. Returns false, if the address isn't acknowledged.
+
+void simSetInput( uint8_t pin, uint8_t level );
+  // level of an input pin, e.g. end stops are LOW when pressed
+
+uint64_t simTime( void );
+  // virtual time in ns
+
+const char *simSignalName( uint8_t signal );
+  // name of a signal, e.g. M1STEP or M1DIR
+
+uint8_t simSignal( uint8_t pin );
+  // signal of an arduino pin
+
+const std::vector<simTransition> &simTransitions( void );
+  // all recorded pin transitions
+
+void simSetLoopTime( uint64_t ns );
+  // time one loop() takes, default 20µs
+
+void simSetI2CClock( uint32_t hz );
+  // I2C bus clock, default 100kHz
+
+void simSetVerbose( bool verbose );
+  // print the serial output of the firmware to stderr
+
+#endif
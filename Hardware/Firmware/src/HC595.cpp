@@ -1,22 +1,87 @@
 #include <Arduino.h>
 #include <SPI.h>
 #include "HC595.h"
+#include "ftPwrDriveIO.h"
 
-uint8_t Register595 = 0;
+volatile uint8_t Register595 = 0;     // data written to the device
+volatile uint8_t Shadow595   = 0;     // data to write with the next flush
+volatile uint8_t Sending595  = 0;     // data of the running transfer
+volatile boolean Busy595     = false; // transfer is running
+boolean          Async595    = false; // interrupt driven transfers
+
+void startTransfer595( void ) {
+  // start an interrupt driven transfer of the shadow register, interrupts need to be disabled
+  Busy595    = true;
+  Sending595 = Shadow595;
+  ioWrite<SS>( LOW );       // CS low
+  SPDR = Sending595;        // SPI_STC_vect is called at the end of the transfer
+}
+
+ISR( SPI_STC_vect ) {
+  // transfer finished
+  ioWrite<SS>( HIGH );      // CS low->high write data to output
+  Register595 = Sending595;
+  Busy595     = false;
+
+  // something changed while sending?
+  if ( Shadow595 != Register595 ) {
+    startTransfer595();
+  }
+}
+
+void begin595( void ) {
+  // switch to interrupt driven transfers
+  Async595 = true;
+  SPCR |= _BV( SPIE );
+}
+
+void flush595( void ) {
+  // write the shadow register to the device, if it was changed
+
+  uint8_t oldSREG = SREG;
+  noInterrupts();
+
+  if ( Async595 ) {
+    // a running transfer restarts itself, if needed
+    if ( ( !Busy595 ) && ( Shadow595 != Register595 ) ) {
+      startTransfer595();
+    }
+    
+  } else {
+    // blocking transfer, always write
+    digitalWrite( SS, LOW );  // CS low
+    SPI.transfer( Shadow595 );// write uint8_t
+    digitalWrite( SS, HIGH ); // CS low->high write b to output
+    Register595 = Shadow595;  // remember me
+  }
+
+  SREG = oldSREG;
+}
+
+boolean busy595( void ) {
+  // true, if the device isn't up to date with the shadow register
+  return Busy595 || ( Shadow595 != Register595 );
+}
 
 void write595( uint8_t b ) {
   // write 1 uint8_t via SPI
-  digitalWrite( SS, LOW );  // CS low
-  SPI.transfer( b );        // write uint8_t
-  digitalWrite( SS, HIGH ); // CS low->high write b to output
-  Register595 = b;         // remember me
-
+  Shadow595 = b;
+  flush595();
 }
 
-void write595( uint8_t bit, uint8_t value ) {
-  // Set/Reset a bit and write data to device
+void stage595( uint8_t bit, uint8_t value ) {
+  // Set/Reset a bit in the shadow register, written with the next flush595
   uint8_t  mask = 1<<bit;
   uint8_t imask = ~mask;
 
-  write595( ( Register595 & imask ) | ( ( value & 1 ) << bit ) );
+  uint8_t oldSREG = SREG;
+  noInterrupts();
+  Shadow595 = ( Shadow595 & imask ) | ( ( value & 1 ) << bit );
+  SREG = oldSREG;
+}
+
+void write595( uint8_t bit, uint8_t value ) {
+  // Set/Reset a bit and write data to device
+  stage595( bit, value );
+  flush595();
 }
@@ -3,10 +3,27 @@
 
 #include <Arduino.h>
 
+// All changes are staged in a shadow register. flush595 writes it with one
+// SPI transfer. After begin595 the transfer runs interrupt driven, so
+// flush595 doesn't wait and could be called inside of other interrupts.
+// Don't use SPI.transfer for other devices after begin595.
+
+void begin595( void );
+  // switch to interrupt driven transfers
+  
 void write595( uint8_t b );
   // write 1 uint8_t via SPI
   
 void write595( uint8_t bit, uint8_t value );
   // Set/Reset a bit and write data to device
 
+void stage595( uint8_t bit, uint8_t value );
+  // Set/Reset a bit in the shadow register, written with the next flush595
+
+void flush595( void );
+  // write the shadow register to the device, if it was changed
+
+boolean busy595( void );
+  // true, if the device isn't up to date with the shadow register
+
 #endif
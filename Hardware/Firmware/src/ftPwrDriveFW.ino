@@ -19,21 +19,68 @@
 // #0010 Optimized homing using ft switches
 //
 // #0011 bugfix change max power settings
+//
+// #0012 trapezoidal acceleration ramps using the acceleration settings
+//
+// #0013 stepper timer runs as Timer3 interrupt, optional timer statistics
+//
+// #0014 direct port I/O in stepper & servo timer
+//
+// #0015 staged, interrupt driven 74HC595 updates
+//
+// #0016 coordinated linear moves
+//
+// #0017 motion queue: linear moves run back-to-back without host round-trips
+//
+// #0018 look-ahead planner: queued moves blend at safe junction speeds
+//
+// #0019 commands are executed in loop(), the I2C interrupt only queues them
+//
+// #0020 snapshot of the whole controller state in one command
+//
+// #0021 event register & event pin for motion complete, end stop and EMS
+//
+// #0022 batches: several commands in one I2C write, executed together
+//
+// #0023 exact step rates: phase accumulator instead of integer cycle counts
+//
+// #0024 servo PWM by Timer1 compare match instead of a 40kHz timer interrupt
+//
+// #0025 servo motion profiles: speed limited or timed servo moves with easing, stepped every servo frame
+//
+// #0026 motor current supervision by a free-running ADC instead of a blocking analogRead in every loop
+//
+// #0027 electronic gearing: followers step from the leader's steps at a fractional ratio
+//
+// #0028 two-speed homing: fast seek, slow re-approach; homing of several motors in parallel
+//
+// #0029 position triggers: set a servo or a servo pin, when a motor crosses a position
+//
+// #0030 streaming: the host pushes steps per interval samples, the motors follow them continuously
+//
+// #0031 optional trace buffer: step timestamps, timer durations, command latency & missed stepper ticks
+//
+// #0032 bus statistics: commands per opcode, dropped & malformed frames, reads, stops and loop rate; empty frames are ignored
+//
+// #0033 protocol v2: frames with length, sequence number & CRC-8, replies with status byte, duplicate frames are executed once
 
 #include <Arduino.h>
 
 #include <SPI.h>
-#include <TimerOne.h>
 #include <TimerThree.h>
 #include <Wire.h>
 #include <EEPROM.h>
 #include "HC595.h"
 #include "ftPwrDriveHW.h"
+#include "ftPwrDriveIO.h"
 
 // ********* some useful definitions *********
 
 #define myVersion 0.99
 
+// optional trace buffer to profile the firmware on a real machine, costs about 180 bytes RAM
+// #define TRACEBUFFER
+
 // micro stepping modes
 #define FULLSTEP      0
 #define HALFSTEP      4
@@ -66,7 +113,7 @@
 #define CMD_GETPOSITION        17  // long getPosition( uint8_t motor )                                  get position
 #define CMD_GETPOSITIONALL     18  // (long,long,long,long) getPositionAll( void )                       get position of all motors
 
-#define CMD_SETACCELERATION    19  // void setAcceleration( uint8_t motor, long acceleration )           set acceleration
+#define CMD_SETACCELERATION    19  // void setAcceleration( uint8_t motor, long acceleration )           set acceleration in steps/s², 0 = no ramp
 #define CMD_GETACCELERATION    20  // long getAcceleration( uint8_t motor )                              get acceleration
 #define CMD_SETACCELERATIONALL 21  // void setAccelerationAll( long acc1, long acc2, long acc3, long acc4 ) set acceleration of all motors
 #define CMD_GETACCELERATIONALL 22  // (long,long,long,long) getAccelerationAll( void )                   get acceleration of all motors
@@ -90,19 +137,134 @@
 
 #define CMD_HOMINGOFFSET       36  // void homingOffset( unit8_t motor1, ulong offset )                 set offset to run during homing, after endstop is free again 
 
+#define CMD_SETTIMERSTATISTICS 37  // void setTimerStatistics( boolean on )                             start/stop measuring the stepper timer, starting resets all values
+#define CMD_GETTIMERSTATISTICS 38  // (long,long,long,long) getTimerStatistics( void )                   ticks/s achieved, ticks/s nominal, worst and average duration in µs
+
+#define CMD_MOVELINEAR         39  // void moveLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop ) coordinated relative move of all motors
+
+#define CMD_QUEUELINEAR        40  // void queueLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop ) add a linear move to the motion queue
+#define CMD_FLUSHQUEUE         41  // void flushQueue( void )                                           discard all queued linear moves
+#define CMD_GETQUEUEFREE       42  // uint8_t getQueueFree( void )                                      number of free slots in the motion queue
+
+#define CMD_GETSNAPSHOT        43  // (snapshot) getSnapshot( uint8_t chunk )                           32 bytes chunk of the packed controller state, chunk 0 takes a new snapshot
+
+#define CMD_SETEVENTMASK       44  // void setEventMask( uint8_t mask, uint8_t servo )                  events driving the event pin, servo output used as event pin or NOEVENTPIN
+#define CMD_GETEVENTS          45  // uint8_t getEvents( void )                                         latched events, reading clears them
+
+#define CMD_BATCH              46  // void batch( uint8_t flags, { uint8_t len, uint8_t cmd[len] } )    chunk of a batch: length prefixed commands, executed at BATCH_COMMIT
+
+#define CMD_GETEFFECTIVESPEED  47  // long getEffectiveSpeed( uint8_t motor )                           effective max speed in 1/1000 steps/s
+
+#define CMD_MOVESERVO          48  // void moveServo( uint8_t servo, long position, long speed, uint8_t easing )        move a servo with speed units/s
+#define CMD_MOVESERVOTIMED     49  // void moveServoTimed( uint8_t servo, long position, long duration, uint8_t easing ) move a servo in duration ms
+#define CMD_MOVESERVOALL       50  // void moveServoAll( long p1, long p2, long p3, long p4, long duration, uint8_t easing ) move all servos in duration ms
+#define CMD_GETSERVOMOVING     51  // uint8_t getServoMoving( void )                                    mask of moving servos
+
+#define CMD_SETGEARING         52  // void setGearing( uint8_t follower, uint8_t leader, long numerator, long denominator ) follower runs numerator/denominator steps per leader step, max. 1, numerator 0 disengages
+
+#define CMD_SETHOMINGSPEED     53  // void setHomingSpeed( uint8_t motor, long fast, long slow )         homing speeds in steps/s, 0 = maxSpeed and maxSpeed/10
+#define CMD_HOMINGALL          54  // void homingAll( long d1, long d2, long d3, long d4, uint8_t disableOnStopMask ) homing of all motors with distance != 0 in parallel, EVENT_HOMED if all are done
+
+#define CMD_SETTRIGGER         55  // void setTrigger( uint8_t trigger, uint8_t motor, long position, uint8_t action, uint8_t servo, long value ) arm a position trigger, TRIGGER_NONE disarms
+#define CMD_GETTRIGGERS        56  // uint8_t getTriggers( void )                                      mask of armed triggers, a trigger disarms when it fires
+
+#define CMD_STREAM             57  // void stream( uint8_t count, { uint16_t ticks, int s1, int s2, int s3, int s4 }[count] ) add up to 3 samples to the stream buffer
+#define CMD_STARTSTREAM        58  // void startStream( uint8_t motorMask, uint8_t lowWater, boolean disableOnStop ) run the samples, EVENT_QUEUEEMPTY at lowWater samples left
+#define CMD_STOPSTREAM         59  // void stopStream( void )                                           stop streaming motors at once and discard all samples
+#define CMD_GETSTREAMFREE      60  // uint8_t getStreamFree( void )                                     number of free slots in the stream buffer
+
+#define CMD_SETTRACE           61  // void setTrace( uint8_t flags )                                    start tracing the TRACE_* records in flags, 0 stops, starting resets all values
+#define CMD_GETTRACE           62  // (records) getTrace( void )                                        number of records and up to 3 records, reading removes them from the trace buffer
+#define CMD_GETTRACESTATISTICS 63  // (long,long,long,long) getTraceStatistics( void )                  missed stepper ticks, worst and average command latency in µs, lost records
+
+#define CMD_GETBUSSTATISTICS   64  // (long x8) getBusStatistics( void )                                 reads, dropped, oversized & malformed frames, watchdog trips, end stop & EMS stops, loop()/s
+#define CMD_GETCOMMANDCOUNTS   65  // (uint16_t x16) getCommandCounts( uint8_t first )                  received commands of opcode first..first+15
+#define CMD_RESETBUSSTATISTICS 66  // void resetBusStatistics( void )                                   reset all bus statistics
+
+#define CMD_GETPROTOCOL        67  // (uint8_t,uint8_t) getProtocol( void )                             highest protocol version and its complement
+#define CMD_GETREPLY           68  // void getReply( uint8_t offset )                                   protocol v2 only: the next reads send the reply of the last command from offset
+
 #define stepperInterval        100  // 10kHz
-#define servoInterval           25  // 40kHz
+#define stepperFrequency       ( 1000000L / stepperInterval )
+#define servoInterval           25  // servo unit in µs
+
+// servo PWM: Timer1 runs with 0.5µs ticks, one interrupt starts the frame, one interrupt ends the pulses
+#define SERVOTICKS              ( servoInterval * 2 )  // Timer1 ticks per servo unit
+#define SERVOFRAME              40000                  // 20ms frame in Timer1 ticks
+#define SERVOMAXPULSE           ( SERVOFRAME - 2000 )  // keep 1ms between a pulse and the next frame
+#define SERVOMARGIN             16                     // pulse ends closer than 8µs are handled in one interrupt
+#define SERVOFRAMEMS            20                     // frame length in ms
+
+// servo motion profiles: progress of a move is fixed point 12.16, easing works on the 12 bit part
+#define SERVOEASESHIFT          12
+#define SERVOPROGRESS           ( 1UL << ( SERVOEASESHIFT + 16 ) )
+#define SERVOMAXPOSITION        ( SERVOFRAME / SERVOTICKS )  // moves are limited to +/- one frame
+
+// easing of servo moves
+#define SERVO_LINEAR            0
+#define SERVO_EASEIN            1
+#define SERVO_EASEOUT           2
+#define SERVO_EASEINOUT         3
+
+// events, latched until getEvents
+#define EVENT_MOTORS     0x0F  // flag 1..4: motor 1..4 stopped
+#define EVENT_ENDSTOP    0x10  // an end stop was triggered
+#define EVENT_EMS        0x20  // EMS was triggered
+#define EVENT_QUEUEEMPTY 0x40  // the last queued linear move is done or the stream buffer reached its low water mark
+#define EVENT_HOMED      0x80  // all motors of homingAll are done
+#define NOEVENTPIN       0xFF
+
+// electronic gearing
+#define NOGEAR        0xFF
+
+// position triggers
+#define MAXTRIGGER     4
+#define TRIGGER_NONE   0   // disarmed
+#define TRIGGER_SERVO  1   // set servo position to value
+#define TRIGGER_ON     2   // set servo pin HIGH without PWM
+#define TRIGGER_OFF    3   // set servo pin LOW without PWM
+
+#define HOMING_OFF     0
+#define HOMING_PHASE1  1   // fast seek until the end stop triggers
+#define HOMING_PHASE2  2   // slow back off until the end stop is released
+#define HOMING_PHASE3  3   // run homingOffset steps
+#define HOMING_BACKOFF 4   // fast back off until the end stop is released
+#define HOMING_SEEK    5   // slow re-approach until the end stop triggers again
+
+// ramp limits during homing
+#define HOMINGRAMP_NORMAL 0
+#define HOMINGRAMP_FAST   1
+#define HOMINGRAMP_SLOW   2
+
+// ramps are calculated in fixed point math: speed in steps/s << SPEEDSHIFT
+#define SPEEDSHIFT    16
+#define PHASEPERIOD   ( stepperFrequency << SPEEDSHIFT )  // phase accumulator overflow = 1 step
+#define RATIOSHIFT    16   // fixed point of the axis ratios of a linear move
+#define RAMP_DOWN     -1
+#define RAMP_CRUISE   0
+#define RAMP_UP       1
+
+// type of a ramp generator: accelerate, cruise and decelerate over stepsToGo
+struct t_ramp {
+  long    accumulator = 0;            // phase accumulator, sums up speed every tick and steps at PHASEPERIOD
+  long    stepsToGo = 0;              // distance in steps to go
+  long    speed = 0;                  // actual ramp speed, steps/s << SPEEDSHIFT
+  long    speedLimit = 0;             // maxSpeed, steps/s << SPEEDSHIFT
+  long    speedMin = 0;               // start and stop speed of a ramp, steps/s << SPEEDSHIFT
+  long    accelerationTick = 0;       // speed change per stepper tick, steps/s << SPEEDSHIFT. 0 = no ramp
+  long    rampSteps = 0;              // steps done while accelerating = steps needed to decelerate
+  int8_t  phase = RAMP_CRUISE;        // actual ramp phase
+  uint8_t dirSettle = 0;              // ticks to wait for the shift register after a direction change
+};
 
-#define HOMING_OFF    0
-#define HOMING_PHASE1 1
-#define HOMING_PHASE2 2
-#define HOMING_PHASE3 3
+// speed limits of a ramp, to switch them in the stepper timer
+struct t_rampLimit {
+  long    speedLimit;                 // steps/s << SPEEDSHIFT
+  long    speedMin;                   // steps/s << SPEEDSHIFT
+};
 
 // type to control one stepper
-struct t_stepper {
-  long    cycle = 0; 
-  long    cycleCounter = 0;
-  long    stepsToGo = 0;              // distance in steps to go
+struct t_stepper : t_ramp {
   int8_t  cw = 1;                     // running counterwise 1, contra clockwise -1
   int8_t  cwEndStop = 0;              // cw-mode before getting an end stop trigger event,  0 = unknown state
   long    position = 0;               // absolute position
@@ -112,49 +274,263 @@ struct t_stepper {
   boolean isMoving = false;
   uint8_t homing = HOMING_OFF;
   long    homingOffset = 0;          // steps to go during homing, if endstop is released in phase 2
+  long    homingFast = 0;            // homing seek speed in steps/s, 0 = maxSpeed
+  long    homingSlow = 0;            // homing re-approach speed in steps/s, 0 = maxSpeed/10
+  long    homingDistance = 0;        // max. steps of each homing phase
+  t_rampLimit homingRamp[3];         // normal, fast and slow ramp limits of a running homing
   boolean endStop = false;
   boolean ignoreEndStop = false;     // semaphore to ignore an end stop trigger, to move out of an triggered event
   uint8_t inSyncWith;                // the motor, I'm running in sync. if none, my own number
+  uint8_t gearLeader = NOGEAR;       // the motor, I'm geared to. if none, NOGEAR
+  long    gearNumerator = 0;         // gear ratio, the sign of the numerator sets the direction
+  long    gearDenominator = 1;
+  long    gearAccumulator = 0;       // leader steps * numerator, not stepped yet
   
 };
 
+// type of a position trigger: fires once, when motor crosses position
+struct t_trigger {
+  uint8_t action = TRIGGER_NONE;
+  uint8_t motor = 0;
+  uint8_t servo = 0;
+  boolean above = false;              // motor was above position when armed
+  long    position = 0;
+  long    value = 0;                  // servo position of TRIGGER_SERVO
+};
+
+// type to control a coordinated linear move of several steppers. The ramp runs on the longest axis,
+// all other axes follow with bresenham
+struct t_linear : t_ramp {
+  uint8_t motors = 0;                 // mask of all motors in the move, 0 = no linear move running
+  long    distance = 0;               // steps of the longest axis
+  long    delta[MaxStepper];          // steps of each axis
+  long    error[MaxStepper];          // bresenham error of each axis
+  long    ratio[MaxStepper];          // delta / distance << RATIOSHIFT, to get the axis speeds cheaply
+  long    speedStop = 0;              // standstill speedMin of the move, speedMin is its exit speed
+  long    stopSteps = 0;              // steps to decelerate from the exit speed to standstill
+};
+
+// type of a queued linear move, all ramp parameters are precalculated by planLinear
+struct t_segment {
+  long    delta[MaxStepper];          // steps of each axis, negative values run ccw
+  long    distance;                   // steps of the longest axis
+  long    ratio[MaxStepper];          // abs( delta ) / distance << RATIOSHIFT
+  long    speedLimit;                 // ramp parameters, see t_ramp
+  long    speedMin;
+  long    accelerationTick;
+  long    speedEntry;                 // speed at the start of the move, steps/s << SPEEDSHIFT, set by planQueue
+  long    speedExit;                  // speed at the end of the move, steps/s << SPEEDSHIFT, set by planQueue
+  long    rampSteps;                  // steps needed to decelerate from speedEntry to speedExit
+  long    stopSteps;                  // steps needed to decelerate from speedExit to standstill, set by planQueue
+  long    junctionSpeed;              // path speed in steps/s at the end of the move, set by planQueue
+  uint8_t motors;                     // mask of all motors in the move
+  boolean disableOnStop;
+};
+
+// size of the motion queue, needs to be a power of 2
+#define MOTIONQUEUESIZE 8
+
+// a stream sample: steps of each motor, spread evenly over ticks stepper ticks
+struct t_sample {
+  uint16_t ticks;                     // duration in stepper ticks, 1..STREAMMAXTICKS
+  int16_t  steps[MaxStepper];         // signed steps of each motor, max. ticks
+};
+
+// size of the stream buffer, needs to be a power of 2
+#define STREAMSIZE       16
+#define STREAMMAXTICKS   32767
+#define STREAMSAMPLESIZE 10           // bytes of a sample in CMD_STREAM
+
+// type to run the stream: each motor steps with bresenham over the ticks of the actual sample
+struct t_stream {
+  uint8_t  motors = 0;                // mask of streaming motors, 0 = no stream running
+  uint8_t  lowWater = 0;              // EVENT_QUEUEEMPTY, if only lowWater samples are left
+  uint16_t ticks = 0;                 // ticks left of the actual sample
+  uint16_t duration = 0;              // ticks of the actual sample
+  uint16_t steps[MaxStepper];         // steps of each motor in the actual sample
+  uint16_t error[MaxStepper];         // bresenham error of each motor
+};
+
 #define SERVOINTERNALOFFSET 60
 
+// trace records
+#define TRACE_STEP    0x01   // stepper tick with step pulses: data = mask of stepped motors, value = duration of the tick in µs
+#define TRACE_MISSED  0x02   // stepper ticks were missed: data = missed ticks, value = 0
+#define TRACE_COMMAND 0x04   // command executed: data = command, value = delay since the I2C receive in µs
+#define TRACE_SERVO   0x08   // servo frame: data = number of pulses, value = duration of the frame interrupt in µs
+#define TRACERECORDSIZE 8    // bytes of a record in CMD_GETTRACE
+#define TRACECHUNK      3    // records per CMD_GETTRACE
+
+#ifdef TRACEBUFFER
+// size of the trace buffer, needs to be a power of 2
+#define TRACESIZE 16
+
+struct t_trace {
+  uint8_t       type;                 // TRACE_*
+  uint8_t       data;
+  uint16_t      value;
+  unsigned long time;                 // micros() at the start of the traced event
+};
+#endif
+
 // type to control all servos
 struct t_servo {
-  volatile long duty = SERVOINTERNALOFFSET;
-  long dutyCounter;
-  long position = 0;
+  volatile long pulse = SERVOINTERNALOFFSET * SERVOTICKS;  // pulse width in Timer1 ticks, 0 = no pulse, -1 = PWM offline
+  long position = 0;                  // target position
   long offset = 0;
+  // motion profile, stepped by the servo timer every frame
+  volatile long actual = 0;           // actual position in Timer1 ticks
+  volatile boolean moving = false;
+  uint8_t  easing = SERVO_LINEAR;
+  long     from = 0;                  // start position in Timer1 ticks
+  long     distance = 0;              // distance in Timer1 ticks
+  uint32_t progress = 0;              // 0..SERVOPROGRESS
+  uint32_t progressStep = 0;          // progress per frame
 };
 
 boolean emergencyStop = false;
 uint8_t microstepMode = FULLSTEP;
 
-#define maxCmdSize 16
+#define maxCmdSize BUFFER_LENGTH
+
+#define maxReplySize BUFFER_LENGTH
+
+// size of the command FIFO, needs to be a power of 2
+#define CMDFIFOSIZE 4
+
+// batches: a batch is sent in chunks of up to maxCmdSize bytes and collected in the batch buffer
+#define BATCHSIZE    64
+#define BATCH_BEGIN  1   // first chunk, starts a new batch
+#define BATCH_COMMIT 2   // last chunk, executes the batch
+
+// snapshot of the controller state, version 1:
+//   0     version
+//   1     mask of moving motors
+//   2     mask of motors with active end stop
+//   3     mask of homing motors
+//   4     flag 1 EMS, flag 2 linear move running
+//   5     free slots in the motion queue
+//   6-21  4x long position
+//   22-37 4x long steps to go
+//   38-53 4x long actual speed in steps/s
+//   54-61 4x int servo position
+#define SNAPSHOTVERSION 1
+#define SNAPSHOTSIZE    62
+
+// protocol v2 frames, v1 frames are the plain command
+//   write: FRAME2, len, seq, cmd[len], crc of the whole frame
+//   read:  status, seq, len, crc of the header, data[len], crc of the whole frame
+//          seq is the one of the frame the status belongs to, discarded frames included
+#define PROTOCOLVERSION 2
+#define FRAME2          0xF2                  // first byte of a v2 frame, never used as command
+#define FRAME2MAXCMD    ( maxCmdSize - 4 )    // max. command length in a v2 frame
+#define FRAME2MAXDATA   ( maxReplySize - 5 )  // max. reply data in a v2 frame, use CMD_GETREPLY for the rest
+#define STATUS_OK       0                     // frame accepted, the reply of a getter follows
+#define STATUS_PENDING  1                     // frame accepted, the reply isn't ready yet
+#define STATUS_CRC      2                     // CRC error, frame discarded
+#define STATUS_LENGTH   3                     // length doesn't fit the frame, frame discarded
+#define STATUS_BUSY     4                     // command FIFO full, frame discarded
+#define STATUS_NONE     0xFF                  // no v2 frame received
+
+// commands counted by opcode, needs to cover all commands
+#define CMDCOUNTERS  72
+#define CMDCOUNTCHUNK 16   // counts per CMD_GETCOMMANDCOUNTS
+
+// bus statistics, all counters are shared with the I2C interrupt
+struct t_busStatistics {
+  unsigned long reads;                // requests served by requestEvent
+  unsigned long dropped;              // commands dropped, because the command FIFO was full
+  unsigned long oversized;            // v2 frames & batch chunks truncated to maxCmdSize, batches not fitting into the batch buffer
+  unsigned long malformed;            // empty frames, unknown commands
+  unsigned long watchdogTrips;
+  unsigned long endStopStops;         // motors stopped by an end stop
+  unsigned long emsStops;             // motors stopped by EMS
+  unsigned long loops;                // loop() iterations since the last rate calculation
+  uint16_t      commands[CMDCOUNTERS];  // received commands by opcode, wrapping around
+};
 
 struct t_CmdBlock {
   boolean newCmd = false;
   uint8_t Cmd[maxCmdSize];
+  uint8_t seq = 0;                    // sequence number of a v2 frame
+#ifdef TRACEBUFFER
+  unsigned long received;             // micros() at the I2C receive
+#endif
 };
 
 // Servos
 t_servo Servo[MaxServo];
 
-long servoCycle = 20000 / servoInterval;
-long servoCycleCounter = 0;
+// pulse ends of the running servo frame, sorted by time
+uint8_t  servoOrder[MaxServo];    // servo of each pulse end
+uint16_t servoEnd[MaxServo];      // pulse end in Timer1 ticks since the frame start
+uint8_t  servoEnds = 0;           // number of pulse ends in this frame
+uint8_t  servoNext = 0;           // next pulse end
 boolean timer1Started = false;
 
 // Steppers
 t_stepper Stepper[MaxStepper];
-
-// received command data
+uint8_t   gearLeaders = 0;           // mask of all motors with geared followers
+uint8_t   homingMask = 0;            // motors of the running homingAll
+
+// position triggers
+t_trigger Trigger[MAXTRIGGER];
+uint8_t   triggersArmed = 0;         // mask of armed triggers
+
+// coordinated linear move
+t_linear Linear;
+
+// motion queue: commands add segments at head, the stepper timer takes them from tail
+t_segment        MotionQueue[MOTIONQUEUESIZE];
+volatile uint8_t motionQueueHead = 0;
+volatile uint8_t motionQueueTail = 0;
+long             motionJunctionSpeed = 0;   // path speed at the end of the running move
+uint8_t          motionHeld = 0;            // motors done with their part of a move, kept enabled for the queue
+boolean          motionReplan = false;      // new moves need to be planned
+
+// stream buffer: CMD_STREAM adds samples at head, the stepper timer takes them from tail
+t_stream         Stream;
+t_sample         StreamBuffer[STREAMSIZE];
+volatile uint8_t streamHead = 0;
+volatile uint8_t streamTail = 0;
+
+// command in work
 t_CmdBlock CmdBlock;
 
-// returnBuffer & Size
-uint8_t returnBuffer[16];
+// command FIFO: receiveEvent adds commands at head, loop() takes them from tail
+t_CmdBlock       CmdFifo[CMDFIFOSIZE];
+volatile uint8_t cmdFifoHead = 0;
+volatile uint8_t cmdFifoTail = 0;
+
+// double buffered replies: requestEvent sends the front buffer, commands write the other one
+uint8_t          replyBuffer[2][maxReplySize];
+uint8_t          replyBytes[2] = { 0, 0 };
+uint8_t          replySeq[2]   = { 0, 0 };   // sequence number of the command, which sent the reply
+volatile uint8_t replyFront = 0;
+
+// protocol v2 state, the host reads the status of the last frame
+volatile boolean frame2         = false;         // the last frame was a v2 frame, replies are framed, too
+volatile uint8_t frame2Status   = STATUS_NONE;   // status of the last frame
+volatile uint8_t frame2StatusSeq = 0;            // sequence number of the last frame, sent with its status
+volatile boolean frame2Accepted = false;         // frame2Seq & frame2Crc are valid
+volatile uint8_t frame2Seq      = 0;             // sequence number of the last accepted frame
+volatile uint8_t frame2Crc      = 0;             // crc of the last accepted frame
+volatile boolean frame2Getter   = false;         // the last accepted frame is a getter
+volatile uint8_t frame2Offset   = 0;             // reply data is sent from offset, see CMD_GETREPLY
+
+// returnBuffer & Size of the command in work
+uint8_t *returnBuffer = replyBuffer[1];
 uint8_t returnBytes = 0;
 
+// packed controller state, read in chunks by CMD_GETSNAPSHOT
+uint8_t snapshot[SNAPSHOTSIZE];
+
+// collected commands of a batch
+uint8_t batchBuffer[BATCHSIZE];
+uint8_t batchLen = 0;
+boolean batchOverflow = false;    // the batch is discarded at commit
+boolean batchTruncated = false;   // a length prefix didn't fit into its frame, counted as oversized
+
 // watchdog:
 //  -1 watchdog deactivated
 //  >0 time in millis when the watchdog should stop the system
@@ -169,6 +545,43 @@ float maxMotorCurrent = 0.7;
 // mySerialNumber
 int mySerialNumber = 0;
 
+// stepper timer statistics
+volatile boolean       timerStatistics    = false;
+volatile unsigned long timerTicks         = 0;   // ticks since last rate calculation
+volatile unsigned long timerDurationSum   = 0;   // sum of all durations since last rate calculation in µs
+volatile unsigned long timerWorstDuration = 0;   // worst duration in µs
+unsigned long          timerRateStart     = 0;   // millis() of last rate calculation
+long                   timerRate          = 0;   // achieved ticks/s
+long                   timerAvgDuration   = 0;   // average duration in µs
+
+// bus statistics
+volatile t_busStatistics Bus;
+unsigned long          loopRateStart      = 0;   // millis() of last rate calculation
+long                   loopRate           = 0;   // loop() iterations/s
+
+#ifdef TRACEBUFFER
+// trace buffer: timers and commands add records at head, CMD_GETTRACE and the serial console take them from tail
+t_trace                Trace[TRACESIZE];
+volatile uint8_t       traceHead          = 0;
+volatile uint8_t       traceTail          = 0;
+volatile uint8_t       traceFlags         = 0;   // traced records, 0 = trace is off
+volatile unsigned long traceNextTick      = 0;   // micros() the next stepper tick is due
+volatile unsigned long traceMissedTicks   = 0;
+volatile unsigned long traceLost          = 0;   // records lost, because the trace buffer was full
+volatile unsigned long traceCommands      = 0;   // commands executed
+volatile unsigned long traceLatencySum    = 0;   // sum of all command latencies in µs
+volatile unsigned long traceLatencyWorst  = 0;   // worst command latency in µs
+#define TRACING traceFlags
+#else
+#define TRACING 0
+#endif
+
+// events
+volatile uint8_t events        = 0;          // latched events
+uint8_t          eventMask     = 0;          // events driving the event pin
+uint8_t          eventPin      = NOEVENTPIN; // servo output used as event pin
+boolean          eventPinState = false;      // actual level of the event pin
+
 // Mode: Maintenance/Normal
 #define MAINTENANCE      1
 #define NORMAL           0
@@ -177,6 +590,85 @@ uint8_t mode = NORMAL;
 // ************ motor current control ***************
 boolean      boardV3 = false;
 
+// background sampling of the reference voltage, V2 boards only:
+// the ADC is triggered by the Timer0 overflow every 1.024ms, readings are averaged by a moving average
+#define CURRENTFILTERSHIFT  4      // filter 1/16
+#define CURRENTCHECKINTERVAL 250   // supervision in loop() every 250ms
+#define CURRENTTOLERANCE    0.05   // allowed deviation in A
+
+volatile boolean  currentSampling = false;
+volatile uint16_t currentFilter   = 0;    // averaged ADC reading << CURRENTFILTERSHIFT
+uint16_t          currentLow      = 0;    // allowed window of currentFilter
+uint16_t          currentHigh     = 0;
+unsigned long     currentCheck    = 0;    // millis() of the last supervision
+
+uint16_t current2ADC( float current ) {
+  // reference voltage of a motor current as averaged ADC reading
+  return (uint16_t) ( current * ( 8 * 0.068 ) / 2.56 * 1024 * ( 1 << CURRENTFILTERSHIFT ) );
+}
+
+void setCurrentWindow( void ) {
+  // precalculates the allowed readings of maxMotorCurrent, so the supervision is an integer compare
+  currentLow  = current2ADC( max( maxMotorCurrent - CURRENTTOLERANCE, 0 ) );
+  currentHigh = current2ADC( maxMotorCurrent + CURRENTTOLERANCE );
+}
+
+void beginCurrentSampling( void ) {
+  // start free-running conversions of MREFI with the internal 2.56V reference
+
+  uint8_t channel = analogPinToChannel( MREFI - A0 );
+
+  uint8_t oldSREG = SREG;
+  noInterrupts();
+  ADMUX  = _BV(REFS1) | _BV(REFS0) | ( channel & 0x07 );
+  ADCSRB = ( ( ( channel >> 3 ) & 0x01 ) << MUX5 ) | _BV(ADTS2);                           // trigger: Timer0 overflow
+  ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);     // 125kHz ADC clock
+  currentSampling = false;
+  SREG = oldSREG;
+
+  setCurrentWindow();
+
+}
+
+ISR( ADC_vect ) {
+  // a new reading of the reference voltage
+
+  uint16_t a = ADC;
+
+  if ( currentSampling ) {
+    currentFilter += a - ( currentFilter >> CURRENTFILTERSHIFT );
+  } else {
+    // first reading fills the filter
+    currentFilter   = a << CURRENTFILTERSHIFT;
+    currentSampling = true;
+  }
+
+}
+
+uint16_t getCurrentReading( void ) {
+  // latest averaged reading of the reference voltage << CURRENTFILTERSHIFT
+
+  uint8_t oldSREG = SREG;  // shared with the ADC interrupt
+  noInterrupts();
+  uint16_t a = currentFilter;
+  SREG = oldSREG;
+
+  return a;
+
+}
+
+boolean currentInRange( void ) {
+  // supervision of the reference voltage, no ADC access
+
+  if ( boardV3 || !currentSampling ) {
+    return true;
+  }
+
+  uint16_t a = getCurrentReading();
+  return ( a >= currentLow ) && ( a <= currentHigh );
+
+}
+
 float getCurrent( uint8_t digits) {
   // gets the motors current setting
   // works only in V2 mode
@@ -188,10 +680,11 @@ float getCurrent( uint8_t digits) {
     return maxMotorCurrent;
   }
 
-  // get reading
-  a = analogRead( MREFI );
+  // get the averaged reading, the first one needs some ms after starting
+  while ( !currentSampling );
+  a = getCurrentReading();
   // convert to volts
-  v = ( (float) a ) / 1024 * 2.56;   
+  v = ( (float) a ) / ( 1 << CURRENTFILTERSHIFT ) / 1024 * 2.56;   
   // calculate motor current
   c = v / ( 8 * 0.068 );
 
@@ -297,6 +790,9 @@ void initializeHardware( void ) {
   // all drivers off
   write595( 31 ); 
 
+  // from now on, shift register updates are interrupt driven. Don't use SPI.transfer anymore.
+  begin595();
+
   // Servos
   for (i=0; i<MaxServo; i++ ) {
     pinMode( SERVO[i], OUTPUT );
@@ -324,7 +820,9 @@ void initializeHardware( void ) {
 
   // *** reference voltage ***  
   pinMode( MREFI, INPUT );
-  analogReference( INTERNAL );
+  if ( !boardV3 ) {
+    beginCurrentSampling();
+  }
 
   // *** I2C ***
   Wire.begin(myI2CBusAddress);
@@ -439,6 +937,9 @@ void BannerText( void ) {
   if (mode==NORMAL) {
     Serial.println( "" );
     Serial.println( "Operating mode normal." );
+    #ifdef TRACEBUFFER
+      Serial.println( "Press t to dump the trace buffer." );
+    #endif
     Serial.println( "Press any key to enter maintenance mode.");
   }
   
@@ -469,6 +970,12 @@ void setup() {
 
   BannerText();
 
+  // start stepper timer, in maintenance mode Timer3 is used by the error LED
+  if ( mode == NORMAL ) {
+    Timer3.initialize( stepperInterval );
+    Timer3.attachInterrupt( StepperTimer );
+  }
+
 }
 
 String readln( char prompt[] ) {
@@ -554,6 +1061,7 @@ void setMaxCurrent( void ) {
   }
 
   maxMotorCurrent = newMaxMotorCurrent;
+  setCurrentWindow();
   Serial.print( "New max current is " ); Serial.println( maxMotorCurrent ); 
   
 }
@@ -649,266 +1157,1803 @@ void maintenanceLoop( void ) {
 
 // ********** Servo & LED Timer **********
 
-void servoTimer( void ) {
+void servoBegin( void ) {
+  // start the servo frames, if not already started: Timer1 in CTC mode with TOP = ICR1, prescaler 8
+  // OC1A/B stay disconnected: the LED on D9 (OC1A) is switched by digitalWrite only, analogWrite
+  // on it would reconfigure Timer1 and break the servo frames
 
-  // interrupt to control the servos
+  if ( timer1Started ) {
+    return;
+  }
+  timer1Started = true;
 
-  int i;
+  uint8_t oldSREG = SREG;
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS11);
+  ICR1   = SERVOFRAME - 1;
+  OCR1A  = 0xFFFF;
+  TCNT1  = 0;
+  TIFR1  = _BV(ICF1) | _BV(OCF1A);
+  TIMSK1 = _BV(ICIE1) | _BV(OCIE1A);
+  SREG = oldSREG;
+
+}
+
+void servoFrame( void ) {
+
+  // interrupt at the start of each 20ms frame: starts all pulses and schedules their ends
 
-  // common clycle counter for all servos
-  servoCycleCounter--;
+  uint8_t i, j;
+  uint8_t mask[IO_PORTS] = { 0 };   // pins to change
+  uint16_t start;
+  unsigned long traceStart = TRACING ? micros() : 0;
 
-  if ( servoCycleCounter <= 0 ) {
-    // servo cycle ended?
+  servoEnds = 0;
+  
+  for (i=0;i<MaxServo;i++) {
 
-    // start new cycle;
-    servoCycleCounter = servoCycle;
+    long pulse = Servo[i].pulse;
 
-    // start all duties
-    for (i=0;i<MaxServo;i++) {
-      Servo[i].dutyCounter = Servo[i].duty;
+    // start only, if a pulse is set
+    if ( pulse > 0 ) {
       
-      // start only, if a duty value is set
-      if (Servo[i].dutyCounter>0) {
-        digitalWrite( SERVO[i], HIGH );
+      mask[ SERVO_PORT[i] ] |= SERVO_MASK[i];
+
+      // insert sorted by pulse width
+      j = servoEnds++;
+      while ( ( j > 0 ) && ( servoEnd[j-1] > pulse ) ) {
+        servoEnd[j]   = servoEnd[j-1];
+        servoOrder[j] = servoOrder[j-1];
+        j--;
       }
+      servoEnd[j]   = pulse;
+      servoOrder[j] = i;
       
     }
     
-  } else {
-    
-    // check all duties if they are ending
-    for (i=0;i<MaxServo;i++) {
+  }
 
-      // something to count?
-      if (Servo[i].dutyCounter>0) {
-        
-         Servo[i].dutyCounter--;
+  ioSet<IO_SERVOPORTS>( mask );
 
-         // end counter?
-         if ( Servo[i].dutyCounter <= 0 ) {
-           // stop duty
-           digitalWrite( SERVO[i], LOW );
-         }
-      }
+  // pulse ends are relative to the real start, so interrupt latency doesn't shorten the pulses
+  start = TCNT1;
+  for (i=0;i<servoEnds;i++) {
+    servoEnd[i] += start;
+  }
+
+  servoNext = 0;
+  OCR1A = ( servoEnds > 0 ) ? servoEnd[0] : 0xFFFF;
+
+  // this frame is scheduled, step the motion profiles for the next one
+  for (i=0;i<MaxServo;i++) {
+    if ( Servo[i].moving ) {
+      servoStep( i );
     }
-    
+  }
+
+  if ( TRACING ) {
+    traceAdd( TRACE_SERVO, servoEnds, micros() - traceStart, traceStart );
   }
   
 }
 
-// ********** stepper timer: due to timing problemns, this function is triggers via main loop instead of timer events **********
+long servoEase( uint8_t easing, long u ) {
+  // easing curve, u and result are 0..1 << SERVOEASESHIFT
+  switch ( easing ) {
+    case SERVO_EASEIN:
+      return ( u * u ) >> SERVOEASESHIFT;
+    case SERVO_EASEOUT:
+      return ( u * ( ( 2L << SERVOEASESHIFT ) - u ) ) >> SERVOEASESHIFT;
+    case SERVO_EASEINOUT:
+      // smoothstep 3u² - 2u³
+      return ( ( ( u * u ) >> SERVOEASESHIFT ) * ( ( 3L << SERVOEASESHIFT ) - 2 * u ) ) >> SERVOEASESHIFT;
+    default:
+      return u;
+  }
+}
+
+void servoStep( uint8_t s ) {
+  // next frame of a servo move, interrupts need to be disabled
+  // no divisions here, progressStep is precalculated in startServoMove
 
-void StepperTimer( void ) {
+  t_servo *v = &Servo[s];
 
-  // interrupt to control the steppers
-   
-  int i;
-  boolean endStop;
+  if ( v->progress >= SERVOPROGRESS - v->progressStep ) {
+    // last frame: end exactly at the target
+    v->actual = v->from + v->distance;
+    v->moving = false;
+  } else {
+    v->progress += v->progressStep;
+    v->actual = v->from + ( ( v->distance * servoEase( v->easing, v->progress >> 16 ) ) >> SERVOEASESHIFT );
+  }
 
-  emergencyStop = !digitalRead( EMS );
+  v->pulse = servoPulse( s );
 
-  // check all steppers
-  for (i=0; i<MaxStepper; i++ ) {
+}
 
-     // check endStop
-     endStop = !digitalRead( ES[i] );
+void servoPulseEnd( void ) {
 
-     // run all HOMING stuff only, if a end stop trigger event is found
-     if ( endStop != Stepper[i].endStop ) {
-      
-        if ( endStop && (!Stepper[i].endStop) && ( Stepper[i].homing == HOMING_PHASE1 ) ) {
-           // end stop triggert during homing
-           Stepper[i].cw = -Stepper[i].cw;                     // change direction
-           write595( DIRECTION[i], ( Stepper[i].cw == -1 ) );  // change direction
-           Stepper[i].homing = HOMING_PHASE2;                  // run until end stop is released
-        }
+  // compare match interrupt: ends all pulses, which are due, and schedules the next one
 
-        if ( (!endStop) && (Stepper[i].endStop) && ( Stepper[i].homing == HOMING_PHASE2 ) ) {
-           // end stop released during homing
-           Stepper[i].stepsToGo = Stepper[i].homingOffset;    // set steps to go additionally
-           Stepper[i].homing    = HOMING_PHASE3;              // start 3rd pahse and run the additional steps
-        } 
+  uint8_t mask[IO_PORTS] = { 0 };   // pins to change
+  uint8_t s;
 
-        // store the new state
-        Stepper[i].endStop = endStop;
-     }
-     
+  while ( ( servoNext < servoEnds ) && ( servoEnd[servoNext] <= TCNT1 + SERVOMARGIN ) ) {
+    s = servoOrder[ servoNext++ ];
+    // a servo taken offline in the meantime keeps its pin
+    if ( Servo[s].pulse >= 0 ) {
+      mask[ SERVO_PORT[s] ] |= SERVO_MASK[s];
+    }
+  }
 
-     // check, if the stepper is running
-     if ( Stepper[i].isMoving > 0 ) {
+  ioClear<IO_SERVOPORTS>( mask );
 
-       // check on ES or EMS - only if homing is off and ignoreEndStop isn't set
-       if ( ( ( Stepper[i].endStop ) && 
-              ( Stepper[i].homing != HOMING_PHASE2 ) && 
-              ( Stepper[i].homing != HOMING_PHASE3 ) && 
-              ( Stepper[i].ignoreEndStop == false ) 
-            ) || emergencyStop ) {
+  OCR1A = ( servoNext < servoEnds ) ? servoEnd[servoNext] : 0xFFFF;
+  
+}
 
-          // stop all motors which are in sync (I'm is in sync with myself)
-          for (int j=0; j<MaxStepper; j ++ ) {
+ISR( TIMER1_CAPT_vect ) {
+  servoFrame();
+}
 
-            if ( Stepper[j].inSyncWith == i ) {
-         
-              // stop moving
-              Stepper[j].isMoving = false;
-              Stepper[j].stepsToGo = 0;
-
-              // store cw mode before stopping
-              Stepper[j].cwEndStop = Stepper[j].cw;
-
-              // set disableOnStop
-              write595( ENABLE[j], Stepper[j].disableOnStop );
-              
-            }
-            
-          }
-          
-       } else {
+ISR( TIMER1_COMPA_vect ) {
+  servoPulseEnd();
+}
 
-         // reset ignoreEndStop
-         if ( Stepper[i].ignoreEndStop ) {
-          Stepper[i].ignoreEndStop = !Stepper[i].endStop;
-         }
+// ********** stepper timer: Timer3 interrupt, every stepperInterval µs **********
 
-         // check if cycle ended
-         Stepper[i].cycleCounter--;
-         if ( Stepper[i].cycleCounter <= 0 ) {
-
-           // invoke a step and start a new cycle
-           Stepper[i].cycleCounter = Stepper[i].cycle;
-           digitalWrite( STEP[i], HIGH );
-           digitalWrite( STEP[i], LOW );
-           Stepper[i].stepsToGo--;
-           Stepper[i].position += Stepper[i].cw;
-
-           // check if motion has to stop
-           if ( Stepper[i].stepsToGo <= 0 ) {
-             Stepper[i].isMoving = false;                       // stop moving
-             write595( ENABLE[i], Stepper[i].disableOnStop );   // disable motor current if needed
-             Stepper[i].homing    = HOMING_OFF;                 // if it was homing, it's all done now
-           }
-         
-         }
+boolean stepDue( t_ramp *r ) {
+  // calculates the ramp and checks, if a step is needed in this tick
+  // integer math only, all ramp parameters are precalculated in calcRamp
 
-       }
-       
-     }
-     
+  if ( r->dirSettle > 0 ) {
+    // direction is not written to the shift register yet
+    r->dirSettle--;
+    return false;
+  }
+
+  if ( r->accelerationTick == 0 ) {
+    // no acceleration, run with constant speed
+    r->phase = RAMP_CRUISE;
+    r->speed = r->speedLimit;
+
+  } else if ( r->stepsToGo <= r->rampSteps ) {
+    // the remaining steps are needed to stop
+    r->phase = RAMP_DOWN;
+    r->speed -= r->accelerationTick;
+    if ( r->speed < r->speedMin ) {
+      r->speed = r->speedMin;
+    }
+    
+  } else if ( r->speed < r->speedLimit ) {
+    // accelerate up to maxSpeed
+    r->phase = RAMP_UP;
+    r->speed += r->accelerationTick;
+    if ( r->speed > r->speedLimit ) {
+      r->speed = r->speedLimit;
+    }
+    
+  } else {
+    // cruise, maxSpeed could be decreased while moving
+    r->phase = RAMP_CRUISE;
+    r->speed = r->speedLimit;
+  }
+
+  // the accumulator sums up the speed, the remainder is kept, so any speed is exact on average
+  r->accumulator += r->speed;
+  if ( r->accumulator < PHASEPERIOD ) {
+    return false;
   }
+  r->accumulator -= PHASEPERIOD;
+
+  // deceleration needs as many steps as acceleration
+  if ( r->phase == RAMP_UP ) {
+    r->rampSteps++;
+  } else if ( ( r->phase == RAMP_DOWN ) && ( r->rampSteps > 0 ) ) {
+    r->rampSteps--;
+  }
+
+  return true;
   
 }
 
-// ********** I2C commands **********
-
-void setWatchdog( long w ) {
-  // activates the watchdog timer
+void startRamp( t_ramp *r ) {
+  // starts a ramp from standstill, the first step is done after the direction is written
 
-  // store the time, when the watchdog timer should stop the system
-  watchdog = millis() + w;
+  r->dirSettle    = 1;
+  r->speed        = r->speedMin;
+  r->rampSteps    = 0;
+  r->phase        = RAMP_UP;
+  r->accumulator  = PHASEPERIOD;
   
 }
 
-void setRelDistance( uint8_t motor, long relDistance, boolean force = false ) {
+void stepMotor( uint8_t i, uint8_t stepMask[IO_PORTS] ) {
+  // invoke a step, all steppers are pulsed together at the end of the tick
 
-  // cmd is only accepted on the primary motor
-  if ( ( Stepper[motor].inSyncWith != motor ) && !force ) {
-    return;
+  stepPulse( i, stepMask );
+  Stepper[i].stepsToGo--;
+
+  // check if motion has to stop
+  if ( Stepper[i].stepsToGo <= 0 ) {
+    events |= 1 << i;                                  // motion complete event
+    Stepper[i].isMoving = false;                       // stop moving
+    if ( ( Linear.motors & ( 1 << i ) ) && ( motionQueueTail != motionQueueHead ) ) {
+      motionHeld |= 1 << i;                            // a short axis keeps its position for the queued moves
+    } else {
+      stage595( ENABLE[i], Stepper[i].disableOnStop ); // disable motor current if needed
+    }
+    endHoming( i );                                    // if it was homing, it's all done now
   }
   
-  // check if another motor is inSnycWith this motor
-  for (int i=0; i<MaxStepper; i++ ) {
-    if ( ( Stepper[i].inSyncWith == motor ) && ( i != motor ) ) {
-      // run same command
-      setRelDistance( i, relDistance );
+}
+
+void stepPulse( uint8_t i, uint8_t stepMask[IO_PORTS] ) {
+  // a step without any distance handling
+
+  stepMask[ STEP_PORT[i] ] |= STEP_MASK[i];
+  Stepper[i].position += Stepper[i].cw;
+
+  // geared followers get their share of the step
+  if ( gearLeaders & ( 1 << i ) ) {
+    for (uint8_t j=0; j<MaxStepper; j++ ) {
+      if ( Stepper[j].gearLeader == i ) {
+        Stepper[j].gearAccumulator += ( Stepper[i].cw > 0 ) ? Stepper[j].gearNumerator : -Stepper[j].gearNumerator;
+      }
     }
   }
+  
+}
 
-  // check to run clockwise or counterclockwise
-  if ( relDistance < 0 ) {
-    // ccw
-    Stepper[motor].cw = -1;
-    write595( DIRECTION[motor], 1 );
-  } else {
-    // cw
-    Stepper[motor].cw = 1;
-    write595( DIRECTION[motor], 0 );
+void endHoming( uint8_t i ) {
+  // homing is done or aborted: restores the ramp, EVENT_HOMED if all motors of homingAll are done
+
+  if ( Stepper[i].homing == HOMING_OFF ) {
+    return;
   }
 
-  // set distance 
-  Stepper[motor].stepsToGo = abs(relDistance);
+  Stepper[i].homing     = HOMING_OFF;
+  Stepper[i].speedLimit = Stepper[i].homingRamp[ HOMINGRAMP_NORMAL ].speedLimit;
+  Stepper[i].speedMin   = Stepper[i].homingRamp[ HOMINGRAMP_NORMAL ].speedMin;
+
+  if ( homingMask & ( 1 << i ) ) {
+    homingMask &= ~( 1 << i );
+    if ( homingMask == 0 ) {
+      events |= EVENT_HOMED;
+    }
+  }
 
 }
 
-void setAbsDistance( uint8_t motor, long absDistance ) {
-  // set a absolute distance to go to
+void homingPhase( uint8_t i, uint8_t phase, uint8_t ramp ) {
+  // reverses a homing motor and starts the next phase with the fast or slow ramp
 
-  setRelDistance( motor, absDistance - Stepper[motor].position );
+  t_stepper *m = &Stepper[i];
+
+  m->cw = -m->cw;                                      // change direction
+  stage595( DIRECTION[i], ( m->cw == -1 ) );
+  m->homing     = phase;
+  m->stepsToGo  = m->homingDistance;
+  m->speedLimit = m->homingRamp[ramp].speedLimit;
+  m->speedMin   = m->homingRamp[ramp].speedMin;
+  startRamp( m );                                      // restart the ramp in the new direction
 
 }
 
-void setMaxSpeed( uint8_t motor, long speed, boolean force = false ) {
-  // set cyle times, speed is steps/second
+void haltMotor( uint8_t i ) {
+  // stops a motor immediately on end stop or EMS
 
-  // cmd is only accepted on the primary motor
-  if ( ( Stepper[motor].inSyncWith != motor ) && !force ) {
-    return;
-  }
+  Stepper[i].isMoving = false;
+  Stepper[i].stepsToGo = 0;
+  events |= 1 << i;
+
+  // store cw mode before stopping
+  Stepper[i].cwEndStop = Stepper[i].cw;
+
+  // set disableOnStop
+  stage595( ENABLE[i], Stepper[i].disableOnStop );
+
+  // an aborted homing is done, too
+  endHoming( i );
   
-  // check if another motor is inSnycWith this motor
-  for (int i=0; i<MaxStepper; i++ ) {
-    if ( ( Stepper[i].inSyncWith == motor ) && ( i != motor ) ) {
-      // run same command
-      setMaxSpeed( i, speed, true );
+}
+
+void haltGroup( uint8_t i ) {
+  // stops a motor on end stop or EMS together with all motors in sync and its whole linear move
+
+  // stop all motors which are in sync (I'm is in sync with myself)
+  for (int j=0; j<MaxStepper; j ++ ) {
+
+    if ( Stepper[j].inSyncWith == i ) {
+      haltMotor( j );
     }
+    
   }
 
-  Stepper[motor].maxSpeed = speed;
-  Stepper[motor].cycle = (long)( (1 / (float) speed ) * 1000000 / stepperInterval);
+  // stop the whole linear move and all queued ones
+  if ( Linear.motors & ( 1 << i ) ) {
+    for (int j=0; j<MaxStepper; j ++ ) {
+      if ( Linear.motors & ( 1 << j ) ) {
+        haltMotor( j );
+      }
+    }
+    Linear.motors   = 0;
+    motionQueueTail = motionQueueHead;
+  }
+
+  // stop the whole stream
+  if ( Stream.motors & ( 1 << i ) ) {
+    for (int j=0; j<MaxStepper; j ++ ) {
+      if ( Stream.motors & ( 1 << j ) ) {
+        haltMotor( j );
+      }
+    }
+    Stream.motors = 0;
+    streamTail    = streamHead;
+  }
 
 }
 
-void startMoving( uint8_t motor, boolean disableOnStop, boolean force = false ) {
+void streamStep( uint8_t stepMask[IO_PORTS] ) {
+  // steps of the actual sample, the next sample is loaded in the tick the actual one ends.
+  // A new direction is written at the end of this tick, so it's ready for the first step.
+
+  uint8_t   i;
+  t_sample *sample;
+
+  if ( Stream.ticks > 0 ) {
+
+    Stream.ticks--;
+
+    for (i=0; i<MaxStepper; i++ ) {
+      if ( ( Stream.motors & ( 1 << i ) ) && ( Stepper[i].isMoving ) ) {
+        // bresenham
+        Stream.error[i] += Stream.steps[i];
+        if ( Stream.error[i] >= Stream.duration ) {
+          Stream.error[i] -= Stream.duration;
+          stepPulse( i, stepMask );
+        }
+      }
+    }
+
+  }
+
+  if ( Stream.ticks > 0 ) {
+    return;
+  }
+
+  if ( streamTail == streamHead ) {
+    // all samples done, the stream ends
+    for (i=0; i<MaxStepper; i++ ) {
+      if ( Stream.motors & ( 1 << i ) ) {
+        events |= 1 << i;
+        Stepper[i].isMoving = false;
+        stage595( ENABLE[i], Stepper[i].disableOnStop );
+      }
+    }
+    Stream.motors = 0;
+    return;
+  }
+
+  // next sample
+  sample = &StreamBuffer[ streamTail & ( STREAMSIZE - 1 ) ];
+  Stream.ticks    = sample->ticks;
+  Stream.duration = sample->ticks;
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( Stream.motors & ( 1 << i ) ) {
+      int8_t cw = ( sample->steps[i] < 0 ) ? -1 : 1;
+      Stream.steps[i] = min( abs( sample->steps[i] ), sample->ticks );
+      Stream.error[i] = sample->ticks / 2;
+      if ( ( Stream.steps[i] > 0 ) && ( cw != Stepper[i].cw ) ) {
+        Stepper[i].cw = cw;
+        stage595( DIRECTION[i], ( cw == -1 ) );
+      }
+    }
+  }
+  streamTail++;
+
+  if ( (uint8_t)( streamHead - streamTail ) == Stream.lowWater ) {
+    events |= EVENT_QUEUEEMPTY;
+  }
+
+}
+
+void gearStep( uint8_t i, uint8_t stepMask[IO_PORTS] ) {
+  // steps a geared follower, if the leader's steps add up to a whole step.
+  // A follower does max. one step per tick, setGearing keeps the ratio at 1 or below. A direction change
+  // delays the step by one tick, the accumulator keeps it until the leader slows down.
+
+  t_stepper *f = &Stepper[i];
+  int8_t    cw;
+
+  if ( f->gearAccumulator >= f->gearDenominator ) {
+    cw = 1;
+  } else if ( f->gearAccumulator <= -f->gearDenominator ) {
+    cw = -1;
+  } else {
+    return;
+  }
+
+  if ( emergencyStop ) {
+    f->gearAccumulator = 0;
+    return;
+  }
+
+  // end stop in moving direction: stop the leader, so both stay in sync
+  if ( f->endStop && ( f->cwEndStop == cw ) ) {
+    if ( Stepper[ f->gearLeader ].isMoving ) {
+      haltGroup( f->gearLeader );
+    }
+    f->gearAccumulator = 0;
+    return;
+  }
+
+  // a new direction is written at the end of this tick, step in the next one
+  if ( cw != f->cw ) {
+    f->cw = cw;
+    stage595( DIRECTION[i], ( cw == -1 ) );
+    return;
+  }
+
+  if ( cw > 0 ) {
+    f->gearAccumulator -= f->gearDenominator;
+  } else {
+    f->gearAccumulator += f->gearDenominator;
+  }
+  stepMask[ STEP_PORT[i] ] |= STEP_MASK[i];
+  f->position += cw;
+
+}
+
+void checkTriggers( void ) {
+  // fires all armed triggers, whose motor reached the position
+
+  uint8_t i;
+  uint8_t mask[IO_PORTS];
+  t_trigger *t;
+  long position;
+
+  for (i=0; i<MAXTRIGGER; i++ ) {
+
+    if ( !( triggersArmed & ( 1 << i ) ) ) {
+      continue;
+    }
+
+    t        = &Trigger[i];
+    position = Stepper[ t->motor ].position;
+
+    if ( t->above ? ( position > t->position ) : ( position < t->position ) ) {
+      continue;
+    }
+
+    triggersArmed &= ~( 1 << i );
+
+    // the servo output isn't an event pin anymore
+    if ( eventPin == t->servo ) {
+      eventPin = NOEVENTPIN;
+    }
+
+    Servo[ t->servo ].moving = false;
+
+    if ( t->action == TRIGGER_SERVO ) {
+      // takes effect with the next servo frame
+      Servo[ t->servo ].position = t->value;
+      Servo[ t->servo ].actual   = t->value * SERVOTICKS;
+      Servo[ t->servo ].pulse    = servoPulse( t->servo );
+    
+    } else {
+      // switch the pin at once
+      Servo[ t->servo ].pulse = -1;   // take PWM offline
+      memset( mask, 0, sizeof( mask ) );
+      mask[ SERVO_PORT[ t->servo ] ] = SERVO_MASK[ t->servo ];
+      if ( t->action == TRIGGER_ON ) {
+        ioSet<IO_SERVOPORTS>( mask );
+      } else {
+        ioClear<IO_SERVOPORTS>( mask );
+      }
+    }
+    
+  }
+
+}
+
+void StepperTimer( void ) {
+
+  // interrupt to control the steppers
+   
+  int i;
+  boolean endStop;
+  unsigned long start = 0;
+  uint8_t pins[IO_PORTS];                  // end stop & EMS port readings
+  uint8_t stepMask[IO_PORTS] = { 0 };      // step pins to pulse
+  uint8_t step = 0;                        // any step pin to pulse
+
+  if ( timerStatistics || TRACING ) {
+    start = micros();
+  }
+
+  if ( TRACING ) {
+    traceTick( start );
+  }
+
+  // read all end stops at once
+  ioRead<IO_ESPORTS>( pins );
+
+  endStop = !( pins[ EMS_PORT ] & EMS_MASK );
+  if ( endStop && !emergencyStop ) {
+    events |= EVENT_EMS;
+  }
+  emergencyStop = endStop;
+
+  // check all steppers
+  for (i=0; i<MaxStepper; i++ ) {
+
+     // check endStop
+     endStop = !( pins[ ES_PORT[i] ] & ES_MASK[i] );
+
+     // run all HOMING stuff only, if a end stop trigger event is found
+     if ( endStop != Stepper[i].endStop ) {
+      
+        if ( endStop && (!Stepper[i].endStop) && ( Stepper[i].homing == HOMING_PHASE1 ) ) {
+           // end stop triggert during the fast seek: back off fast
+           homingPhase( i, HOMING_BACKOFF, HOMINGRAMP_FAST );
+        
+        } else if ( endStop && (!Stepper[i].endStop) && ( Stepper[i].homing == HOMING_SEEK ) ) {
+           // end stop triggert during the slow re-approach: back off slowly, this is the exact position
+           homingPhase( i, HOMING_PHASE2, HOMINGRAMP_SLOW );
+        
+        } else if ( (!endStop) && (Stepper[i].endStop) && ( Stepper[i].homing == HOMING_BACKOFF ) ) {
+           // end stop released after the fast seek: re-approach slowly
+           homingPhase( i, HOMING_SEEK, HOMINGRAMP_SLOW );
+        
+        } else if ( (!endStop) && (Stepper[i].endStop) && ( Stepper[i].homing == HOMING_PHASE2 ) ) {
+           // end stop released during homing
+           if ( Stepper[i].homingOffset > 0 ) {
+             Stepper[i].stepsToGo  = Stepper[i].homingOffset;    // set steps to go additionally
+             Stepper[i].homing     = HOMING_PHASE3;              // start 3rd pahse and run the additional steps
+             Stepper[i].speedLimit = Stepper[i].homingRamp[ HOMINGRAMP_FAST ].speedLimit;
+           } else {
+             haltMotor( i );                                     // all done
+           }
+        } 
+
+        if ( endStop ) {
+          events |= EVENT_ENDSTOP;
+          // a geared follower doesn't stop by itself, store its direction
+          if ( Stepper[i].gearLeader != NOGEAR ) {
+            Stepper[i].cwEndStop = Stepper[i].cw;
+          }
+        }
+
+        // store the new state
+        Stepper[i].endStop = endStop;
+     }
+     
+
+     // check, if the stepper is running
+     if ( Stepper[i].isMoving > 0 ) {
+
+       // check on ES or EMS - only if homing is off and ignoreEndStop isn't set
+       if ( ( ( Stepper[i].endStop ) && 
+              ( Stepper[i].homing != HOMING_BACKOFF ) && 
+              ( Stepper[i].homing != HOMING_PHASE2 ) && 
+              ( Stepper[i].homing != HOMING_PHASE3 ) && 
+              ( Stepper[i].ignoreEndStop == false ) 
+            ) || emergencyStop ) {
+
+          if ( emergencyStop ) {
+            Bus.emsStops++;
+          } else {
+            Bus.endStopStops++;
+          }
+          haltGroup( i );
+          
+       } else {
+
+         // reset ignoreEndStop
+         if ( Stepper[i].ignoreEndStop ) {
+          Stepper[i].ignoreEndStop = !Stepper[i].endStop;
+         }
+
+         // check if a step is needed, motors in a linear move or a stream are stepped below
+         if ( ( !( ( Linear.motors | Stream.motors ) & ( 1 << i ) ) ) && stepDue( &Stepper[i] ) ) {
+           stepMotor( i, stepMask );
+         }
+
+       }
+       
+     }
+     
+  }
+
+  // events latched before the linear move
+  uint8_t latched = events;
+
+  // motors of a linear move ending in this tick, their drivers stay enabled for the next queued move
+  uint8_t finished = 0;
+
+  // coordinated linear move
+  if ( ( Linear.motors ) && stepDue( &Linear ) ) {
+
+    Linear.stepsToGo--;
+
+    for (i=0; i<MaxStepper; i++ ) {
+
+      if ( ( Linear.motors & ( 1 << i ) ) && ( Stepper[i].isMoving ) ) {
+        // bresenham
+        Linear.error[i] += Linear.delta[i];
+        if ( Linear.error[i] >= Linear.distance ) {
+          Linear.error[i] -= Linear.distance;
+          stepMotor( i, stepMask );
+        }
+      }
+      
+    }
+
+    // all done?
+    if ( Linear.stepsToGo <= 0 ) {
+      finished      = Linear.motors;
+      Linear.motors = 0;
+    }
+    
+  }
+
+  // start the next queued move in the same tick, so the motors stay enabled
+  if ( ( Linear.motors == 0 ) && ( motionQueueTail != motionQueueHead ) ) {
+    if ( startSegment( &MotionQueue[ motionQueueTail & ( MOTIONQUEUESIZE - 1 ) ], finished | motionHeld ) ) {
+      motionQueueTail++;
+      // motors continuing in the next move didn't stop
+      events &= ~( Linear.motors & ~latched );
+    } else {
+      // end stop or EMS, discard all queued moves
+      discardQueue();
+    }
+  }
+
+  // the motion queue ran empty, the motors kept enabled for it follow their disableOnStop now
+  if ( ( motionHeld ) && ( Linear.motors == 0 ) && ( motionQueueTail == motionQueueHead ) ) {
+    for (i=0; i<MaxStepper; i++ ) {
+      if ( ( motionHeld & ( 1 << i ) ) && !Stepper[i].isMoving ) {
+        stage595( ENABLE[i], Stepper[i].disableOnStop );
+      }
+    }
+    motionHeld = 0;
+  }
+
+  // a linear move ended without a queued one to follow
+  if ( ( Linear.motors == 0 ) && ( Linear.stepsToGo <= 0 ) && ( Linear.distance > 0 ) ) {
+    Linear.distance = 0;
+    events |= EVENT_QUEUEEMPTY;
+  }
+
+  // streamed samples
+  if ( Stream.motors ) {
+    streamStep( stepMask );
+  }
+
+  // geared followers
+  if ( gearLeaders ) {
+    for (i=0; i<MaxStepper; i++ ) {
+      if ( Stepper[i].gearLeader != NOGEAR ) {
+        gearStep( i, stepMask );
+      }
+    }
+  }
+
+  // position triggers, all positions of this tick are final
+  if ( triggersArmed ) {
+    checkTriggers();
+  }
+
+  // step pulse
+  for (i=0; i<IO_PORTS; i++ ) {
+    step |= stepMask[i];
+  }
+  if ( step ) {
+    ioPulse<IO_STEPPORTS>( stepMask );
+  }
+
+  // write all direction & enable changes at once
+  flush595();
+
+  // signal events
+  updateEventPin();
+
+  if ( timerStatistics || TRACING ) {
+    unsigned long duration = micros() - start;
+    if ( timerStatistics ) {
+      timerTicks++;
+      timerDurationSum += duration;
+      if ( duration > timerWorstDuration ) {
+        timerWorstDuration = duration;
+      }
+    }
+    if ( TRACING && step ) {
+      traceSteps( stepMask, duration, start );
+    }
+  }
+  
+}
+
+void updateEventPin( void ) {
+  // the event pin is HIGH as long as a masked event is latched, interrupts need to be disabled
+
+  boolean on = ( events & eventMask ) != 0;
+
+  if ( ( eventPin == NOEVENTPIN ) || ( on == eventPinState ) ) {
+    return;
+  }
+
+  uint8_t mask[IO_PORTS] = { 0 };
+  mask[ SERVO_PORT[eventPin] ] = SERVO_MASK[eventPin];
+  if ( on ) {
+    ioSet<IO_SERVOPORTS>( mask );
+  } else {
+    ioClear<IO_SERVOPORTS>( mask );
+  }
+  eventPinState = on;
+
+}
+
+void setEventMask( uint8_t mask, uint8_t s ) {
+  // sets the events driving the event pin, a servo output is used as event pin
+
+  uint8_t oldSREG = SREG;  // shared with the stepper & servo timer
+  noInterrupts();
+
+  if ( ( eventPin != NOEVENTPIN ) && ( eventPin != s ) ) {
+    // release the old pin
+    digitalWrite( SERVO[eventPin], LOW );
+  }
+
+  eventMask     = mask;
+  eventPin      = s;
+  eventPinState = false;
+
+  if ( eventPin != NOEVENTPIN ) {
+    Servo[eventPin].moving = false;
+    Servo[eventPin].pulse  = -1; // take PWM offline
+    digitalWrite( SERVO[eventPin], LOW );
+    updateEventPin();
+  }
+
+  SREG = oldSREG;
+
+}
+
+uint8_t getEvents( void ) {
+  // returns the latched events and clears them
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+  uint8_t e = events;
+  events = 0;
+  updateEventPin();
+  SREG = oldSREG;
+
+  return e;
+
+}
+
+void setTimerStatistics( boolean on ) {
+  // start/stop measuring the stepper timer, starting resets all values
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer and getters
+  noInterrupts();
+  timerTicks         = 0;
+  timerDurationSum   = 0;
+  timerWorstDuration = 0;
+  timerStatistics    = on;
+  timerRateStart     = millis();
+  timerRate          = 0;
+  timerAvgDuration   = 0;
+  SREG = oldSREG;
+  
+}
+
+void calcTimerStatistics( void ) {
+  // calculates the achieved stepper timer rate once per second
+
+  unsigned long now = millis();
+
+  if ( ( !timerStatistics ) || ( now - timerRateStart < 1000 ) ) {
+    return;
+  }
+
+  noInterrupts();
+  unsigned long ticks       = timerTicks;
+  unsigned long durationSum = timerDurationSum;
+  timerTicks       = 0;
+  timerDurationSum = 0;
+  interrupts();
+
+  long rate        = ticks * 1000 / ( now - timerRateStart );
+
+  noInterrupts();
+  timerRate        = rate;
+  timerAvgDuration = ( ticks > 0 ) ? durationSum / ticks : 0;
+  timerRateStart   = now;
+  interrupts();
+  
+}
+
+// ********** trace buffer **********
+
+void traceAdd( uint8_t type, uint8_t data, unsigned long value, unsigned long time ) {
+  // adds a record, if its type is traced. Interrupts need to be disabled.
+
+#ifdef TRACEBUFFER
+  if ( !( traceFlags & type ) ) {
+    return;
+  }
+
+  // trace buffer full, the host needs to read it
+  if ( (uint8_t)( traceHead - traceTail ) >= TRACESIZE ) {
+    traceLost++;
+    return;
+  }
+
+  t_trace *t = &Trace[ traceHead & ( TRACESIZE - 1 ) ];
+  t->type  = type;
+  t->data  = data;
+  t->value = ( value > 0xFFFF ) ? 0xFFFF : value;
+  t->time  = time;
+  traceHead++;
+#endif
+
+}
+
+void traceTick( unsigned long start ) {
+  // counts missed stepper ticks, called at the start of each tick.
+  // Timer3 keeps one pending interrupt only, so a tick starting an interval late or more lost the ticks in between.
+
+#ifdef TRACEBUFFER
+  uint8_t missed = 0;
+
+  if ( (long)( start - traceNextTick ) < 0 ) {
+    // earlier than expected, this tick had less interrupt latency
+    traceNextTick = start;
+  }
+
+  while ( (long)( start - traceNextTick ) >= stepperInterval ) {
+    traceNextTick += stepperInterval;
+    if ( missed < 0xFF ) {
+      missed++;
+    }
+  }
+  traceNextTick += stepperInterval;
+
+  if ( missed ) {
+    traceMissedTicks += missed;
+    traceAdd( TRACE_MISSED, missed, 0, start );
+  }
+#endif
+
+}
+
+void traceSteps( uint8_t stepMask[IO_PORTS], unsigned long duration, unsigned long start ) {
+  // records a stepper tick with step pulses, interrupts need to be disabled
+
+#ifdef TRACEBUFFER
+  if ( !( traceFlags & TRACE_STEP ) ) {
+    return;
+  }
+
+  uint8_t motors = 0;
+  for (uint8_t i=0; i<MaxStepper; i++ ) {
+    if ( stepMask[ STEP_PORT[i] ] & STEP_MASK[i] ) {
+      motors |= 1 << i;
+    }
+  }
+
+  traceAdd( TRACE_STEP, motors, duration, start );
+#endif
+
+}
+
+void traceReceive( t_CmdBlock *c ) {
+  // stamps a received command, runs in receiveEvent
+
+#ifdef TRACEBUFFER
+  if ( traceFlags ) {
+    c->received = micros();
+  }
+#endif
+
+}
+
+void traceCommand( t_CmdBlock *c ) {
+  // latency of a command from the I2C receive to its execution
+
+#ifdef TRACEBUFFER
+  // reading the trace isn't traced
+  if ( ( !traceFlags ) || ( c->Cmd[0] == CMD_GETTRACE ) || ( c->Cmd[0] == CMD_GETTRACESTATISTICS ) ) {
+    return;
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer & receiveEvent
+  noInterrupts();
+  unsigned long latency = micros() - c->received;
+  traceCommands++;
+  traceLatencySum += latency;
+  if ( latency > traceLatencyWorst ) {
+    traceLatencyWorst = latency;
+  }
+  traceAdd( TRACE_COMMAND, c->Cmd[0], latency, c->received );
+  SREG = oldSREG;
+#endif
+
+}
+
+void setTrace( uint8_t flags ) {
+  // starts tracing the records in flags, 0 stops. Starting resets the trace & the timer statistics.
+
+#ifdef TRACEBUFFER
+  if ( flags ) {
+    setTimerStatistics( true );
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the timers & receiveEvent
+  noInterrupts();
+  traceHead         = 0;
+  traceTail         = 0;
+  traceNextTick     = micros() + stepperInterval;
+  traceMissedTicks  = 0;
+  traceLost         = 0;
+  traceCommands     = 0;
+  traceLatencySum   = 0;
+  traceLatencyWorst = 0;
+  traceFlags        = flags;
+  SREG = oldSREG;
+#endif
+
+}
+
+void getTrace( void ) {
+  // replies the number of records and up to TRACECHUNK records, which are removed from the trace buffer.
+  // record: type, data, uint16_t value, unsigned long time
+
+  uint8_t n = 0;
+
+#ifdef TRACEBUFFER
+  uint8_t oldSREG = SREG;  // shared with the timers
+  noInterrupts();
+
+  n = traceHead - traceTail;
+  if ( n > TRACECHUNK ) {
+    n = TRACECHUNK;
+  }
+
+  returnBuffer[ returnBytes++ ] = n;
+  for (uint8_t i=0; i<n; i++ ) {
+    t_trace *t = &Trace[ traceTail & ( TRACESIZE - 1 ) ];
+    returnBuffer[ returnBytes++ ] = t->type;
+    returnBuffer[ returnBytes++ ] = t->data;
+    returnBuffer[ returnBytes++ ] = t->value & 0xFF;
+    returnBuffer[ returnBytes++ ] = t->value >> 8;
+    returnBytes = ReturnLong( returnBytes, t->time );
+    traceTail++;
+  }
+
+  SREG = oldSREG;
+#else
+  // not compiled in, there are never any records
+  returnBuffer[ returnBytes++ ] = n;
+#endif
+
+}
+
+void getTraceStatistics( void ) {
+  // replies missed stepper ticks, worst & average command latency in µs and lost records
+
+#ifdef TRACEBUFFER
+  uint8_t oldSREG = SREG;  // shared with the timers & receiveEvent
+  noInterrupts();
+  returnBytes = ReturnLong( returnBytes, traceMissedTicks );
+  returnBytes = ReturnLong( returnBytes, traceLatencyWorst );
+  returnBytes = ReturnLong( returnBytes, ( traceCommands > 0 ) ? traceLatencySum / traceCommands : 0 );
+  returnBytes = ReturnLong( returnBytes, traceLost );
+  SREG = oldSREG;
+#else
+  for (uint8_t i=0; i<4; i++ ) {
+    returnBytes = ReturnLong( returnBytes, 0 );
+  }
+#endif
+
+}
+
+#ifdef TRACEBUFFER
+void dumpTrace( void ) {
+  // prints and removes all records, prints all statistics
+
+  t_trace t;
+
+  Serial.println( "time[us]    record   data  value" );
+
+  while ( traceTail != traceHead ) {
+
+    noInterrupts();
+    t = Trace[ traceTail & ( TRACESIZE - 1 ) ];
+    traceTail++;
+    interrupts();
+
+    Serial.print( t.time );
+    Serial.print( "  " );
+    switch ( t.type ) {
+      case TRACE_STEP:    Serial.print( "step    " ); break;
+      case TRACE_MISSED:  Serial.print( "missed  " ); break;
+      case TRACE_COMMAND: Serial.print( "command " ); break;
+      case TRACE_SERVO:   Serial.print( "servo   " ); break;
+    }
+    Serial.print( t.data );
+    Serial.print( "  " );
+    Serial.println( t.value );
+
+  }
+
+  noInterrupts();
+  unsigned long missed   = traceMissedTicks;
+  unsigned long lost     = traceLost;
+  unsigned long worst    = traceLatencyWorst;
+  unsigned long avg      = ( traceCommands > 0 ) ? traceLatencySum / traceCommands : 0;
+  interrupts();
+
+  Serial.print( "stepper ticks/s:    " ); Serial.print( timerRate ); Serial.print( " of " ); Serial.println( stepperFrequency );
+  Serial.print( "tick duration [us]: " ); Serial.print( timerWorstDuration ); Serial.print( " worst, " ); Serial.print( timerAvgDuration ); Serial.println( " avg" );
+  Serial.print( "missed ticks:       " ); Serial.println( missed );
+  Serial.print( "cmd latency [us]:   " ); Serial.print( worst ); Serial.print( " worst, " ); Serial.print( avg ); Serial.println( " avg" );
+  Serial.print( "lost records:       " ); Serial.println( lost );
+
+}
+#endif
+
+// ********** bus statistics **********
+
+void countBus( volatile unsigned long *counter ) {
+  // increments a counter outside of the interrupts
+
+  uint8_t oldSREG = SREG;  // shared with the I2C interrupt
+  noInterrupts();
+  (*counter)++;
+  SREG = oldSREG;
+
+}
+
+void calcBusStatistics( void ) {
+  // calculates the loop() rate once per second
+
+  unsigned long now = millis();
+
+  countBus( &Bus.loops );
+
+  if ( now - loopRateStart < 1000 ) {
+    return;
+  }
+
+  noInterrupts();
+  unsigned long loops = Bus.loops;
+  Bus.loops = 0;
+  interrupts();
+
+  long rate = loops * 1000 / ( now - loopRateStart );
+
+  noInterrupts();
+  loopRate      = rate;
+  loopRateStart = now;
+  interrupts();
+
+}
+
+void resetBusStatistics( void ) {
+  // resets all counters
+
+  uint8_t oldSREG = SREG;  // shared with the I2C interrupt & the stepper timer
+  noInterrupts();
+  memset( (void *) &Bus, 0, sizeof( Bus ) );
+  loopRate      = 0;
+  loopRateStart = millis();
+  SREG = oldSREG;
+
+}
+
+void getBusStatistics( void ) {
+  // replies reads, dropped, oversized & malformed frames, watchdog trips, end stop & EMS stops and loop()/s
+
+  uint8_t oldSREG = SREG;  // shared with the I2C interrupt & the stepper timer
+  noInterrupts();
+  returnBytes = ReturnLong( returnBytes, Bus.reads );
+  returnBytes = ReturnLong( returnBytes, Bus.dropped );
+  returnBytes = ReturnLong( returnBytes, Bus.oversized );
+  returnBytes = ReturnLong( returnBytes, Bus.malformed );
+  returnBytes = ReturnLong( returnBytes, Bus.watchdogTrips );
+  returnBytes = ReturnLong( returnBytes, Bus.endStopStops );
+  returnBytes = ReturnLong( returnBytes, Bus.emsStops );
+  returnBytes = ReturnLong( returnBytes, loopRate );
+  SREG = oldSREG;
+
+}
+
+void getCommandCounts( uint8_t first ) {
+  // replies the received commands of opcode first..first+CMDCOUNTCHUNK-1
+
+  uint8_t oldSREG = SREG;  // shared with the I2C interrupt
+  noInterrupts();
+  for (uint8_t k=0; k<CMDCOUNTCHUNK; k++ ) {
+    uint16_t op    = first + k;   // first is sent by the host, don't let the opcode wrap around
+    uint16_t count = ( op < CMDCOUNTERS ) ? Bus.commands[op] : 0;
+    returnBuffer[ returnBytes++ ] = count & 0xFF;
+    returnBuffer[ returnBytes++ ] = count >> 8;
+  }
+  SREG = oldSREG;
+
+}
+
+// ********** I2C commands **********
+
+void setWatchdog( long w ) {
+  // activates the watchdog timer
+
+  // store the time, when the watchdog timer should stop the system
+  watchdog = millis() + w;
+  
+}
+
+void setRelDistance( uint8_t motor, long relDistance, boolean force = false ) {
+
+  // cmd is only accepted on the primary motor
+  if ( ( Stepper[motor].inSyncWith != motor ) && !force ) {
+    return;
+  }
+  
+  // check if another motor is inSnycWith this motor
+  for (int i=0; i<MaxStepper; i++ ) {
+    if ( ( Stepper[i].inSyncWith == motor ) && ( i != motor ) ) {
+      // run same command
+      setRelDistance( i, relDistance, true );
+    }
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
+  // a running motor has to wait for a new direction
+  if ( ( relDistance < 0 ) != ( Stepper[motor].cw < 0 ) ) {
+    Stepper[motor].dirSettle = 1;
+  }
+
+  // check to run clockwise or counterclockwise
+  if ( relDistance < 0 ) {
+    // ccw
+    Stepper[motor].cw = -1;
+    stage595( DIRECTION[motor], 1 );
+  } else {
+    // cw
+    Stepper[motor].cw = 1;
+    stage595( DIRECTION[motor], 0 );
+  }
+
+  // set distance 
+  Stepper[motor].stepsToGo = abs(relDistance);
+
+  SREG = oldSREG;
+
+}
+
+void setAbsDistance( uint8_t motor, long absDistance ) {
+  // set a absolute distance to go to
+
+  setRelDistance( motor, absDistance - Stepper[motor].position );
+
+}
+
+void setMaxSpeed( uint8_t motor, long speed, boolean force = false ) {
+  // set max speed, speed is steps/second
+
+  // cmd is only accepted on the primary motor
+  if ( ( Stepper[motor].inSyncWith != motor ) && !force ) {
+    return;
+  }
+  
+  // check if another motor is inSnycWith this motor
+  for (int i=0; i<MaxStepper; i++ ) {
+    if ( ( Stepper[i].inSyncWith == motor ) && ( i != motor ) ) {
+      // run same command
+      setMaxSpeed( i, speed, true );
+    }
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the getters
+  noInterrupts();
+  Stepper[motor].maxSpeed = speed;
+  SREG = oldSREG;
+
+  calcRamp( &Stepper[motor], speed, Stepper[motor].acceleration );
+
+}
+
+long rampSpeedMin( long speed, long acceleration ) {
+  // start & stop speed of a ramp is the speed reached after the first step, steps/s << SPEEDSHIFT
+
+  if ( acceleration <= 0 ) {
+    // no ramp
+    return speed << SPEEDSHIFT;
+  }
+
+  return (long)( min( sqrt( 2 * (float) acceleration ), (float) speed ) * ( 1L << SPEEDSHIFT ) );
+
+}
+
+void calcRamp( t_ramp *r, long speed, long acceleration ) {
+  // precalculates the ramp parameters in fixed point math, so stepperTimer doesn't need any floats or divisions
+
+  long accelerationTick = 0;
+  long speedMin;
+
+  speed = constrain( speed, 0, stepperFrequency );
+
+  if ( acceleration > 0 ) {
+    // speed change per tick, at least 1 to get a ramp
+    accelerationTick = max( ( ( (long long) acceleration ) << SPEEDSHIFT ) / stepperFrequency, 1 );
+  }
+
+  speedMin = rampSpeedMin( speed, acceleration );
+
+  // a running motor must not see half of the changes
+  uint8_t oldSREG = SREG;
+  noInterrupts();
+  r->speedLimit       = speed << SPEEDSHIFT;
+  r->accelerationTick = accelerationTick;
+  r->speedMin         = speedMin;
+  SREG = oldSREG;
+
+}
+
+void startMoving( uint8_t motor, boolean disableOnStop, boolean force = false ) {
   // start a motor
 
-  // cmd is only accepted on the primary motor
-  if ( ( Stepper[motor].inSyncWith != motor ) && !force ) {
+  // cmd is only accepted on the primary motor
+  if ( ( Stepper[motor].inSyncWith != motor ) && !force ) {
+    return;
+  }
+ 
+  // check if another motor is inSnycWith this motor
+  for (int i=0; i<MaxStepper; i++ ) {
+    if ( ( Stepper[i].inSyncWith == motor ) && ( i != motor ) ) {
+      // run same command
+      startMoving( i, disableOnStop, true );
+    }
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
+  if ( !canStart( motor ) ) {
+    SREG = oldSREG;
+    return;
+  }
+
+  // now, the stepper could start
+  Linear.motors &= ~( 1 << motor ); // leave a running linear move
+  Stepper[motor].disableOnStop = disableOnStop;
+  startRamp( &Stepper[motor] );
+  stage595( ENABLE[motor], 0 );      // set enable
+  Stepper[motor].isMoving = true;    // start interrupt working
+
+  SREG = oldSREG;
+
+}
+
+boolean canStart( uint8_t motor ) {
+  // checks emergency stop and end stop, before a motor starts
+
+  // don't start if emercencyStop is activated
+  if ( emergencyStop ) {
+    return false;
+  }
+
+  // a geared follower is moved by its leader only
+  if ( Stepper[motor].gearLeader != NOGEAR ) {
+    return false;
+  }
+
+  // if endStop is triggered, test to move in "the other direction" 
+  if ( Stepper[motor].endStop ) {  
+    // endStop is triggered
+    
+    if ( Stepper[motor].cwEndStop == 0 ) { 
+      // last direction is unknown, so don't start moving
+      return false;
+    }
+    
+    if ( Stepper[motor].cwEndStop == Stepper[motor].cw ) { 
+      // last direction is the same as the new direction, so don't start moving
+      return false;
+    }
+    
+  }
+
+  return true;
+  
+}
+
+boolean planLinear( long distance[MaxStepper], long feedrate, boolean disableOnStop, t_segment *s ) {
+  // prepares a coordinated relative move: all motors start and stop together, the longest axis runs with feedrate.
+  // The shared ramp uses the smallest acceleration any motor allows, the feedrate is reduced until no motor
+  // exceeds its maxSpeed. No motor exceeds its own acceleration or speed setting.
+  // returns false, if there is nothing to move
+
+  int     i;
+  long    longest = 0;
+  float   acceleration = 0;
+  t_ramp  ramp;
+
+  s->motors        = 0;
+  s->disableOnStop = disableOnStop;
+
+  // motors in sync run the distance of their primary motor
+  for (i=0; i<MaxStepper; i++ ) {
+    s->delta[i] = distance[ Stepper[i].inSyncWith ];
+    if ( s->delta[i] != 0 ) {
+      s->motors |= 1 << i;
+      longest = max( longest, abs( s->delta[i] ) );
+    }
+  }
+
+  if ( s->motors == 0 ) {
+    return false;
+  }
+
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( ( s->delta[i] != 0 ) && ( Stepper[i].acceleration > 0 ) ) {
+      float a = (float) Stepper[i].acceleration * longest / abs( s->delta[i] );
+      if ( ( acceleration == 0 ) || ( a < acceleration ) ) {
+        acceleration = a;
+      }
+    }
+    if ( ( s->delta[i] != 0 ) && ( Stepper[i].maxSpeed > 0 ) ) {
+      float f = (float) Stepper[i].maxSpeed * longest / abs( s->delta[i] );
+      if ( f < feedrate ) {
+        feedrate = f;
+      }
+    }
+  }
+
+  calcRamp( &ramp, feedrate, (long) acceleration );
+
+  s->distance         = longest;
+  for (i=0; i<MaxStepper; i++ ) {
+    // 64 bit division here, getSpeed runs in the interrupts
+    s->ratio[i] = ( (long long) abs( s->delta[i] ) << RATIOSHIFT ) / longest;
+  }
+  s->speedLimit       = ramp.speedLimit;
+  s->speedMin         = ramp.speedMin;
+  s->accelerationTick = ramp.accelerationTick;
+
+  // start and stop from standstill, until planQueue finds better junction speeds
+  s->speedEntry       = ramp.speedMin;
+  s->speedExit        = ramp.speedMin;
+  s->rampSteps        = 0;
+  s->stopSteps        = 0;
+  s->junctionSpeed    = 0;
+
+  return true;
+
+}
+
+boolean startSegment( t_segment *s, uint8_t running ) {
+  // starts a prepared linear move, interrupts need to be disabled
+  // running are the motors of the move ending just now, they are enabled already
+  // returns false, if a motor can't start
+
+  int     i;
+  uint8_t settle = 0;
+
+  // set directions & distances, all motors need to be able to start
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( s->motors & ( 1 << i ) ) {
+      int8_t cw = ( s->delta[i] < 0 ) ? -1 : 1;
+      if ( ( cw != Stepper[i].cw ) || !( running & ( 1 << i ) ) ) {
+        // new direction or enable needs to be written to the shift register first
+        settle = 1;
+      }
+      Stepper[i].cw        = cw;
+      Stepper[i].stepsToGo = abs( s->delta[i] );
+      stage595( DIRECTION[i], ( cw == -1 ) );
+    }
+  }
+
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( ( s->motors & ( 1 << i ) ) && !canStart( i ) ) {
+      for (int j=0; j<MaxStepper; j++ ) {
+        if ( s->motors & ( 1 << j ) ) {
+          Stepper[j].stepsToGo = 0;
+        }
+      }
+      return false;
+    }
+  }
+
+  // bresenham on the longest axis
+  Linear.distance         = s->distance;
+  Linear.stepsToGo        = s->distance;
+  Linear.speedLimit       = s->speedLimit;
+  Linear.speedMin         = s->speedMin;
+  Linear.accelerationTick = s->accelerationTick;
+  for (i=0; i<MaxStepper; i++ ) {
+    Linear.delta[i] = abs( s->delta[i] );
+    Linear.error[i] = s->distance / 2;
+    Linear.ratio[i] = s->ratio[i];
+  }
+  // a blended junction continues the step timing of the move before
+  long accumulator  = Linear.accumulator;
+  boolean blended   = ( s->speedEntry > s->speedMin );
+  startRamp( &Linear );
+  Linear.dirSettle  = settle;
+  Linear.speed      = s->speedEntry;
+  Linear.speedMin   = s->speedExit;
+  Linear.rampSteps  = s->rampSteps;
+  Linear.speedStop  = s->speedMin;
+  Linear.stopSteps  = s->stopSteps;
+  if ( blended ) {
+    Linear.accumulator = accumulator;
+  }
+  motionJunctionSpeed = s->junctionSpeed;
+
+  // start all motors
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( s->motors & ( 1 << i ) ) {
+      Stepper[i].disableOnStop = s->disableOnStop;
+      endHoming( i );
+      stage595( ENABLE[i], 0 );
+      Stepper[i].isMoving      = true;
+    }
+  }
+  Linear.motors = s->motors;
+
+  return true;
+
+}
+
+void moveLinear( long distance[MaxStepper], long feedrate, boolean disableOnStop ) {
+  // starts a coordinated relative move immediately, all queued moves are discarded
+
+  t_segment s;
+
+  if ( !planLinear( distance, feedrate, disableOnStop, &s ) ) {
     return;
   }
- 
-  // check if another motor is inSnycWith this motor
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+  motionQueueTail = motionQueueHead;
+  Linear.motors   = 0;
+  startSegment( &s, 0 );
+  SREG = oldSREG;
+
+}
+
+void queueLinear( long distance[MaxStepper], long feedrate, boolean disableOnStop ) {
+  // adds a coordinated relative move to the motion queue, it's ignored if the queue is full.
+  // The stepper timer starts it in the tick, the move before ends.
+
+  if ( getQueueFree() == 0 ) {
+    return;
+  }
+
+  // the stepper timer doesn't touch slots between tail and head
+  if ( planLinear( distance, feedrate, disableOnStop, &MotionQueue[ motionQueueHead & ( MOTIONQUEUESIZE - 1 ) ] ) ) {
+    motionQueueHead++;
+    motionReplan = true;
+  }
+
+}
+
+float junctionLimit( t_segment *s1, float length1, t_segment *s2, float length2 ) {
+  // max. path speed at the junction of two moves: the speed change of each axis must not exceed
+  // the speed the axis could start with from standstill, sqrt( 2 * acceleration ).
+
+  float limit = 1e9;
+
   for (int i=0; i<MaxStepper; i++ ) {
-    if ( ( Stepper[i].inSyncWith == motor ) && ( i != motor ) ) {
-      // run same command
-      startMoving( i, disableOnStop, true );
+
+    float change = abs( s1->delta[i] / length1 - s2->delta[i] / length2 );
+    float jump   = ( Stepper[i].acceleration > 0 ) ? sqrt( 2 * (float) Stepper[i].acceleration ) : Stepper[i].maxSpeed;
+
+    if ( change > 0 ) {
+      limit = min( limit, jump / change );
+    }
+
+    // don't exceed the axis max. speed at the junction
+    if ( Stepper[i].maxSpeed > 0 ) {
+      if ( s1->delta[i] != 0 ) {
+        limit = min( limit, Stepper[i].maxSpeed * length1 / abs( s1->delta[i] ) );
+      }
+      if ( s2->delta[i] != 0 ) {
+        limit = min( limit, Stepper[i].maxSpeed * length2 / abs( s2->delta[i] ) );
+      }
     }
   }
 
-  // don't start if emercencyStop is activated
-  if ( emergencyStop ) {
+  return limit;
+
+}
+
+void planQueue( void ) {
+  // look-ahead planner, runs in loop() and not in the stepper timer.
+  // Calculates the junction speeds of all queued moves, so moves in similar directions blend without
+  // stopping. Speeds are path speeds in steps/s, the last queued move stops at standstill.
+  // A running move, which isn't decelerating yet, gets a higher exit speed, so moves queued one by one
+  // blend, too.
+
+  int       k;
+  int       n;
+  float     length[MOTIONQUEUESIZE];      // path length in steps
+  float     accel[MOTIONQUEUESIZE];       // path acceleration in steps/s²
+  float     entry[MOTIONQUEUESIZE + 1];   // path speed at the start of each move, entry[n] = 0
+  t_segment running;                      // the running move, only its geometry and ramp
+  long      runningSpeed = 0;             // actual speed of the running move in steps/s
+  float     runningLength = 0;
+  long      runningExit = 0;              // new exit speed and stop steps of the running move
+  long      runningStop = 0;
+
+  if ( !motionReplan ) {
     return;
   }
+  motionReplan = false;
 
-  // if endStop is triggered, test to move in "the other direction" 
-  if ( Stepper[motor].endStop ) {  
-    // endStop is triggered
-    
-    if ( Stepper[motor].cwEndStop == 0 ) { 
-      // last direction is unknown, so don't start moving
+  // the running move can't slow down for the next move any more, its exit speed can only be raised
+  noInterrupts();
+  uint8_t tail  = motionQueueTail;
+  n             = (uint8_t)( motionQueueHead - tail );
+  entry[0]      = ( Linear.motors != 0 ) ? motionJunctionSpeed : 0;
+  boolean raise = ( Linear.motors != 0 ) && ( Linear.accelerationTick > 0 ) && ( Linear.phase != RAMP_DOWN );
+  if ( raise ) {
+    for (int i=0; i<MaxStepper; i++ ) {
+      running.delta[i] = ( Linear.motors & ( 1 << i ) ) ? Linear.delta[i] * Stepper[i].cw : 0;
+    }
+    running.distance         = Linear.distance;
+    running.speedLimit       = Linear.speedLimit;
+    running.speedMin         = Linear.speedStop;
+    running.accelerationTick = Linear.accelerationTick;
+    runningSpeed             = Linear.speed >> SPEEDSHIFT;
+  }
+  interrupts();
+
+  if ( n == 0 ) {
+    return;
+  }
+
+  // geometry and junction limits
+  for (k=0; k<n; k++ ) {
+    t_segment *s = &MotionQueue[ ( tail + k ) & ( MOTIONQUEUESIZE - 1 ) ];
+
+    length[k] = 0;
+    for (int i=0; i<MaxStepper; i++ ) {
+      length[k] += (float) s->delta[i] * s->delta[i];
+    }
+    length[k] = sqrt( length[k] );
+
+    // the ramp runs on the longest axis, without acceleration there's no ramp to blend
+    accel[k] = (float) s->accelerationTick * stepperFrequency / ( 1L << SPEEDSHIFT ) * length[k] / s->distance;
+
+    if ( k > 0 ) {
+      t_segment *p = &MotionQueue[ ( tail + k - 1 ) & ( MOTIONQUEUESIZE - 1 ) ];
+      if ( ( p->accelerationTick == 0 ) || ( s->accelerationTick == 0 ) ) {
+        entry[k] = 0;
+      } else {
+        entry[k] = junctionLimit( p, length[k-1], s, length[k] );
+        entry[k] = min( entry[k], (float) ( p->speedLimit >> SPEEDSHIFT ) * length[k-1] / p->distance );
+        entry[k] = min( entry[k], (float) ( s->speedLimit >> SPEEDSHIFT ) * length[k] / s->distance );
+      }
+    }
+  }
+  entry[n] = 0;
+
+  // junction of the running move and the first queued one, not faster than the running move is now
+  float fixed = entry[0];
+  if ( raise && ( accel[0] > 0 ) ) {
+    t_segment *s = &MotionQueue[ tail & ( MOTIONQUEUESIZE - 1 ) ];
+    for (int i=0; i<MaxStepper; i++ ) {
+      runningLength += (float) running.delta[i] * running.delta[i];
+    }
+    runningLength = sqrt( runningLength );
+    float v = junctionLimit( &running, runningLength, s, length[0] );
+    v = min( v, (float) ( running.speedLimit >> SPEEDSHIFT ) * runningLength / running.distance );
+    v = min( v, (float) runningSpeed * runningLength / running.distance );
+    v = min( v, (float) ( s->speedLimit >> SPEEDSHIFT ) * length[0] / s->distance );
+    entry[0] = max( entry[0], v );
+  }
+
+  // backward pass: every move needs to be able to decelerate to the entry speed of the next one
+  for (k=n-1; k>=0; k-- ) {
+    if ( accel[k] > 0 ) {
+      entry[k] = min( entry[k], sqrt( entry[k+1] * entry[k+1] + 2 * accel[k] * length[k] ) );
+    }
+  }
+  entry[0] = max( entry[0], fixed );
+
+  // the running move decelerates to the raised exit speed instead of standstill
+  raise = raise && ( entry[0] > fixed );
+  if ( raise ) {
+    float ratio = running.distance / runningLength;
+    float a     = (float) running.accelerationTick * stepperFrequency / ( 1L << SPEEDSHIFT );
+    float vMin  = (float) running.speedMin / ( 1L << SPEEDSHIFT );
+    float vExit = max( entry[0] * ratio, vMin );
+    runningExit = (long)( vExit * ( 1L << SPEEDSHIFT ) );
+    runningStop = (long)( ( vExit * vExit - vMin * vMin ) / ( 2 * a ) );
+  }
+
+  // forward pass: every move needs to be able to accelerate to the entry speed of the next one
+  for (k=0; k<n; k++ ) {
+    if ( accel[k] > 0 ) {
+      entry[k+1] = min( entry[k+1], sqrt( entry[k] * entry[k] + 2 * accel[k] * length[k] ) );
+    }
+  }
+
+  // the stepper timer could have started a move meanwhile, so plan again
+  noInterrupts();
+  if ( motionQueueTail != tail ) {
+    motionReplan = true;
+    interrupts();
+    return;
+  }
+
+  if ( raise ) {
+    if ( ( Linear.motors == 0 ) || ( Linear.phase == RAMP_DOWN ) || ( Linear.rampSteps + Linear.stopSteps < runningStop ) ) {
+      // the running move started decelerating meanwhile, it keeps its exit speed
+      motionReplan = true;
+      interrupts();
       return;
     }
-    
-    if ( Stepper[motor].cwEndStop == Stepper[motor].cw ) { 
-      // last direction is the same as the new direction, so don't start moving
+    Linear.rampSteps   += Linear.stopSteps - runningStop;
+    Linear.stopSteps    = runningStop;
+    Linear.speedMin     = runningExit;
+    motionJunctionSpeed = (long) entry[0];
+  }
+
+  // store the ramps in steps of the longest axis
+  for (k=0; k<n; k++ ) {
+    t_segment *s = &MotionQueue[ ( tail + k ) & ( MOTIONQUEUESIZE - 1 ) ];
+
+    if ( s->accelerationTick == 0 ) {
+      continue;
+    }
+
+    float ratio    = s->distance / length[k];
+    float a        = accel[k] * ratio;
+    float vMin     = (float) s->speedMin / ( 1L << SPEEDSHIFT );
+    float vEntry   = max( entry[k] * ratio, vMin );
+    float vExit    = max( entry[k+1] * ratio, vMin );
+
+    s->speedEntry    = (long)( vEntry * ( 1L << SPEEDSHIFT ) );
+    s->speedExit     = (long)( vExit * ( 1L << SPEEDSHIFT ) );
+    s->rampSteps     = (long)( ( vEntry * vEntry - vExit * vExit ) / ( 2 * a ) );
+    s->stopSteps     = (long)( ( vExit * vExit - vMin * vMin ) / ( 2 * a ) );
+    s->junctionSpeed = (long) entry[k+1];
+  }
+  interrupts();
+
+}
+
+void flushQueue( void ) {
+  // discards all queued moves, a running move isn't stopped
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+  discardQueue();
+  SREG = oldSREG;
+
+}
+
+void discardQueue( void ) {
+  // discards all queued moves, interrupts need to be disabled.
+  // The running move was planned to end at the junction speed, it has to stop at standstill now.
+
+  motionQueueTail     = motionQueueHead;
+  motionJunctionSpeed = 0;
+
+  if ( Linear.speedMin > Linear.speedStop ) {
+    Linear.speedMin   = Linear.speedStop;
+    Linear.rampSteps += Linear.stopSteps;   // starts decelerating earlier
+    Linear.stopSteps  = 0;
+  }
+
+}
+
+uint8_t getQueueFree( void ) {
+  // number of free slots in the motion queue
+
+  return MOTIONQUEUESIZE - (uint8_t)( motionQueueHead - motionQueueTail );
+
+}
+
+void stream( uint8_t count ) {
+  // adds count samples of the command to the stream buffer, samples not fitting into the buffer are discarded
+
+  uint8_t i, j, p;
+  t_sample *sample;
+
+  for (i=0; ( i < count ) && ( 2 + ( i + 1 ) * STREAMSAMPLESIZE <= maxCmdSize ); i++ ) {
+
+    if ( getStreamFree() == 0 ) {
       return;
     }
-    
+
+    p = 2 + i * STREAMSAMPLESIZE;
+    sample = &StreamBuffer[ streamHead & ( STREAMSIZE - 1 ) ];
+    sample->ticks = constrain( (uint16_t) Cmd2Int( p ), 1, STREAMMAXTICKS );
+    for (j=0; j<MaxStepper; j++ ) {
+      sample->steps[j] = Cmd2Int( p + 2 + 2 * j );
+    }
+
+    // the sample is complete, now the stepper timer may take it
+    streamHead++;
+
   }
 
-  // now, the stepper could start
-  Stepper[motor].disableOnStop = disableOnStop;
-  write595( ENABLE[motor], 0 );      // set enable
-  Stepper[motor].isMoving = true;    // start interrupt working
+}
+
+void startStream( uint8_t motorMask, uint8_t lowWater, boolean disableOnStop ) {
+  // runs the samples of the stream buffer on all motors in motorMask, queue samples before starting.
+  // The stream ends, when all samples are done.
+
+  uint8_t i;
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( ( motorMask & ( 1 << i ) ) && !canStart( i ) ) {
+      SREG = oldSREG;
+      return;
+    }
+  }
+
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( motorMask & ( 1 << i ) ) {
+      Linear.motors &= ~( 1 << i );    // leave a running linear move
+      endHoming( i );
+      Stepper[i].disableOnStop = disableOnStop;
+      Stepper[i].stepsToGo     = 0;
+      stage595( ENABLE[i], 0 );
+      Stepper[i].isMoving      = true;
+    }
+  }
+
+  Stream.lowWater = lowWater;
+  Stream.ticks    = 0;                   // the first sample is loaded in the next tick
+  Stream.motors   = motorMask;
+
+  SREG = oldSREG;
+
+}
+
+void stopStream( void ) {
+  // stops all streaming motors at once and discards all samples
+
+  uint8_t i;
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( Stream.motors & ( 1 << i ) ) {
+      Stepper[i].isMoving = false;
+      stage595( ENABLE[i], Stepper[i].disableOnStop );
+    }
+  }
+  Stream.motors = 0;
+  streamTail    = streamHead;
+
+  SREG = oldSREG;
+
+}
+
+uint8_t getStreamFree( void ) {
+  // number of free slots in the stream buffer
+
+  return STREAMSIZE - (uint8_t)( streamHead - streamTail );
 
 }
 
@@ -917,6 +2962,10 @@ void startMovingAll( uint8_t motorMask, uint8_t disableOnStopMask ) {
   
   int i;
   int mask = 1;
+
+  // all motors start in the same stepper tick
+  uint8_t oldSREG = SREG;
+  noInterrupts();
   
   for (i=0; i<MaxStepper; i++ ) {
 
@@ -928,6 +2977,8 @@ void startMovingAll( uint8_t motorMask, uint8_t disableOnStopMask ) {
 
   }
 
+  SREG = oldSREG;
+
 }
 
 void stopMoving( uint8_t motor, boolean force = false ) {
@@ -946,9 +2997,21 @@ void stopMoving( uint8_t motor, boolean force = false ) {
     }
   }
   
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
+  // leave a running linear move, the following queued moves don't make sense anymore
+  if ( Linear.motors & ( 1 << motor ) ) {
+    Linear.motors &= ~( 1 << motor );
+    flushQueue();
+  }
+  Stream.motors &= ~( 1 << motor );
   Stepper[motor].isMoving = false;
   Stepper[motor].stepsToGo = 0;
-  write595( ENABLE[motor], Stepper[motor].disableOnStop );
+  stage595( ENABLE[motor], Stepper[motor].disableOnStop );
+  endHoming( motor );
+
+  SREG = oldSREG;
 
 }
 
@@ -957,6 +3020,10 @@ void stopMovingAll( uint8_t motorMask ) {
   
   int i;
   int mask = 1;
+
+  // all motors stop in the same stepper tick
+  uint8_t oldSREG = SREG;
+  noInterrupts();
   
   for (i=0; i<MaxStepper; i++ ) {
 
@@ -968,6 +3035,8 @@ void stopMovingAll( uint8_t motorMask ) {
 
   }
 
+  SREG = oldSREG;
+
 }
 
 void microsteps( uint8_t myMicrostepMode ) {
@@ -1007,6 +3076,86 @@ uint8_t getStatusMotor( uint8_t motor ) {
          
 }
 
+long getEffectiveSpeed( uint8_t motor ) {
+  // effective max speed in 1/1000 steps/s, the phase accumulator reproduces it exactly on average
+  return ( (long long) Stepper[motor].speedLimit * 1000 ) >> SPEEDSHIFT;
+}
+
+long getSpeed( uint8_t motor ) {
+  // actual speed of a motor in steps/s
+
+  if ( !Stepper[motor].isMoving ) {
+    return 0;
+  }
+
+  if ( Linear.motors & ( 1 << motor ) ) {
+    // bresenham axis: part of the longest axis speed
+    return ( ( Linear.speed >> SPEEDSHIFT ) * Linear.ratio[motor] ) >> RATIOSHIFT;
+  }
+
+  return Stepper[motor].speed >> SPEEDSHIFT;
+
+}
+
+uint8_t snapshotLong( uint8_t startFrom, long value ) {
+  // sets a long in the snapshot
+  // returns startFrom + 4
+
+  for (int i=0; i<4;i++ ) {
+    snapshot[startFrom] = value & 0xFF;
+    value = value >> 8;
+    startFrom++;
+  }
+
+  return startFrom;
+}
+
+void takeSnapshot( void ) {
+  // packs the state of all motors and servos, all values are taken in the same stepper tick
+
+  uint8_t i;
+  uint8_t p = 6;
+
+  uint8_t oldSREG = SREG;
+  noInterrupts();
+
+  snapshot[0] = SNAPSHOTVERSION;
+  snapshot[1] = isMovingAll();
+  snapshot[2] = 0;
+  snapshot[3] = 0;
+  for (i=0; i<MaxStepper; i++) {
+    snapshot[2] |= Stepper[i].endStop << i;
+    snapshot[3] |= ( Stepper[i].homing != HOMING_OFF ) << i;
+  }
+  snapshot[4] = emergencyStop | ( ( Linear.motors != 0 ) << 1 );
+  snapshot[5] = getQueueFree();
+
+  for (i=0; i<MaxStepper; i++) { p = snapshotLong( p, Stepper[i].position ); }
+  for (i=0; i<MaxStepper; i++) { p = snapshotLong( p, Stepper[i].stepsToGo ); }
+  for (i=0; i<MaxStepper; i++) { p = snapshotLong( p, getSpeed( i ) ); }
+  for (i=0; i<MaxServo; i++) {
+    long position = getServo( i );
+    snapshot[p++] = position & 0xFF;
+    snapshot[p++] = ( position >> 8 ) & 0xFF;
+  }
+
+  SREG = oldSREG;
+
+}
+
+void getSnapshot( uint8_t chunk ) {
+  // returns a chunk of the snapshot, chunk 0 takes a new one
+
+  if ( chunk == 0 ) {
+    takeSnapshot();
+  }
+
+  for (uint16_t i = chunk * maxReplySize; ( i < SNAPSHOTSIZE ) && ( returnBytes < maxReplySize ); i++ ) {
+    returnBuffer[ returnBytes++ ] = snapshot[i];
+  }
+
+}
+
 void setPosition( uint8_t motor, long position, boolean force = false ) {
   // sets motor position
 
@@ -1023,7 +3172,10 @@ void setPosition( uint8_t motor, long position, boolean force = false ) {
     }
   }
 
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
   Stepper[motor].position = position;
+  SREG = oldSREG;
   
 }
 
@@ -1053,7 +3205,12 @@ void setAcceleration( uint8_t motor, long acceleration, boolean force = false) {
     }
   }
   
+  uint8_t oldSREG = SREG;  // shared with the getters
+  noInterrupts();
   Stepper[motor].acceleration = acceleration;
+  SREG = oldSREG;
+
+  calcRamp( &Stepper[motor], Stepper[motor].maxSpeed, acceleration );
 }
 
 void getAccelerationAll() {
@@ -1066,32 +3223,110 @@ void getAccelerationAll() {
   
 }
 
+long servoPulse( uint8_t s ) {
+  // pulse width of a servo in Timer1 ticks
+  return constrain( Servo[s].actual + ( Servo[s].offset + SERVOINTERNALOFFSET ) * SERVOTICKS, 0, SERVOMAXPULSE );
+}
+
+long getServo( uint8_t s ) {
+  // actual servo position, moves in progress included
+
+  uint8_t oldSREG = SREG;  // shared with the servo timer
+  noInterrupts();
+  long actual = Servo[s].actual;
+  SREG = oldSREG;
+
+  // round to whole servo units
+  return ( actual + ( ( actual < 0 ) ? -SERVOTICKS/2 : SERVOTICKS/2 ) ) / SERVOTICKS;
+
+}
+
 void setServo( uint8_t s, long position ) {
-  // set servo position
+  // set servo position, a running move is cancelled
+  startServoMove( s, position, 0, SERVO_LINEAR );
+}
+
+void startServoMove( uint8_t s, long position, long duration, uint8_t easing ) {
+  // move a servo to position in duration ms, 0 jumps to position
   
   // if not already startet, start servo Timer
-  if ( !timer1Started ) {
-    timer1Started = true;
-    Timer1.initialize( servoInterval );
-    Timer1.attachInterrupt( servoTimer );
-  }
+  servoBegin();
 
+  position = constrain( position, -SERVOMAXPOSITION, SERVOMAXPOSITION );
+  long frames = duration / SERVOFRAMEMS;
+
+  uint8_t oldSREG = SREG;  // shared with the servo timer and getters
+  noInterrupts();
+  if ( eventPin == s ) {
+    eventPin = NOEVENTPIN;   // the servo output isn't an event pin anymore
+  }
   Servo[s].position = position;
+  if ( frames > 0 ) {
+    // start at the actual position, even if the last move didn't finish yet
+    Servo[s].from         = Servo[s].actual;
+    Servo[s].distance     = position * SERVOTICKS - Servo[s].actual;
+    Servo[s].easing       = easing;
+    Servo[s].progress     = 0;
+    Servo[s].progressStep = ( SERVOPROGRESS + frames - 1 ) / frames;  // rounded up, the move ends in the last frame
+    Servo[s].moving       = true;
+  } else {
+    Servo[s].actual = position * SERVOTICKS;
+    Servo[s].moving = false;
+  }
+  Servo[s].pulse = servoPulse( s );
+  SREG = oldSREG;
+  
+}
+
+void moveServo( uint8_t s, long position, long speed, uint8_t easing ) {
+  // move a servo with speed units/s, speed 0 jumps to position
+
+  long duration = 0;
+
+  if ( speed > 0 ) {
+    duration = abs( constrain( position, -SERVOMAXPOSITION, SERVOMAXPOSITION ) - getServo( s ) ) * 1000L / speed;
+  }
+
+  startServoMove( s, position, duration, easing );
+
+}
+
+void moveServoAll( long position[MaxServo], long duration, uint8_t easing ) {
+  // move all servos in duration ms, all start in the same frame and finish together
+
+  uint8_t i;
+
+  uint8_t oldSREG = SREG;  // start all moves in the same frame
+  noInterrupts();
+  for (i=0;i<MaxServo;i++) {
+    startServoMove( i, position[i], duration, easing );
+  }
+  SREG = oldSREG;
+
+}
+
+uint8_t getServoMoving( void ) {
+  // mask of moving servos
+
+  uint8_t i;
+  uint8_t mask = 0;
+
+  for (i=0;i<MaxServo;i++) {
+    mask |= Servo[i].moving << i;
+  }
+
+  return mask;
 
-  noInterrupts();
-  Servo[s].duty     = Servo[s].position + Servo[s].offset + SERVOINTERNALOFFSET;
-  interrupts();
-  
 }
 
 void setServoOffset( uint8_t s, long offset ) {
   // set servo offset
 
-  Servo[s].offset = offset;
-  
+  uint8_t oldSREG = SREG;  // shared with the servo timer and getters
   noInterrupts();
-  Servo[s].duty   = Servo[s].position + Servo[s].offset + SERVOINTERNALOFFSET;
-  interrupts();
+  Servo[s].offset = offset;
+  Servo[s].pulse  = servoPulse( s );
+  SREG = oldSREG;
 
 }
 
@@ -1101,7 +3336,7 @@ void getServoAll() {
 
   int i;
   for (i=0;i<MaxServo;i++) {
-    returnBytes = ReturnLong( returnBytes, Servo[i].position );
+    returnBytes = ReturnLong( returnBytes, getServo( i ) );
   }
   
 }
@@ -1119,42 +3354,123 @@ void getServoOffsetAll() {
 void setServoOnOff( uint8_t s, boolean on ) {
   // sets servo pin continous on/off
 
+  uint8_t oldSREG = SREG;  // shared with the servo timer
   noInterrupts();
-  Servo[s].duty = -1; // take PWM offline
-  interrupts();
+  Servo[s].moving = false;
+  Servo[s].pulse  = -1; // take PWM offline
+  SREG = oldSREG;
 
   digitalWrite( SERVO[s], on );
 
 }
 
 void homing( uint8_t motor, long maxDistance, boolean disableOnStop ) {
-  // run a homing cycle:
-  //   1. run maxDistance and stop if maxDistance is reached or end stop found.
-  //   2. if end stop found, run with 1/10 speed until end stop is released
+  // run a homing cycle, each phase runs max. maxDistance:
+  //   1. run with the fast homing speed until the end stop triggers
+  //   2. back off with the fast homing speed until the end stop is released
+  //   3. re-approach with the slow homing speed until the end stop triggers again
+  //   4. back off with the slow homing speed until the end stop is released
+  //   5. run homingOffset steps
 
   // cmd is only accepted on the primary motor
   if ( Stepper[motor].inSyncWith != motor ) {
     return;
   }
 
-  Stepper[motor].homing = HOMING_PHASE1;
+  // all ramp limits are precalculated, the stepper timer just switches them
+  long fast = ( Stepper[motor].homingFast > 0 ) ? Stepper[motor].homingFast : Stepper[motor].maxSpeed;
+  long slow = ( Stepper[motor].homingSlow > 0 ) ? Stepper[motor].homingSlow : max( Stepper[motor].maxSpeed / 10, 1 );
+  fast = constrain( fast, 0, stepperFrequency );
+  slow = constrain( slow, 0, fast );
+
+  t_rampLimit ramp[3];
+  ramp[ HOMINGRAMP_FAST ].speedLimit = fast << SPEEDSHIFT;
+  ramp[ HOMINGRAMP_FAST ].speedMin   = rampSpeedMin( fast, Stepper[motor].acceleration );
+  ramp[ HOMINGRAMP_SLOW ].speedLimit = slow << SPEEDSHIFT;
+  ramp[ HOMINGRAMP_SLOW ].speedMin   = rampSpeedMin( slow, Stepper[motor].acceleration );
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+  
+  // a running homing keeps the normal limits
+  if ( Stepper[motor].homing == HOMING_OFF ) {
+    ramp[ HOMINGRAMP_NORMAL ].speedLimit = Stepper[motor].speedLimit;
+    ramp[ HOMINGRAMP_NORMAL ].speedMin   = Stepper[motor].speedMin;
+  } else {
+    ramp[ HOMINGRAMP_NORMAL ] = Stepper[motor].homingRamp[ HOMINGRAMP_NORMAL ];
+  }
+  memcpy( Stepper[motor].homingRamp, ramp, sizeof( ramp ) );
+
+  Stepper[motor].homing         = HOMING_PHASE1;
+  Stepper[motor].homingDistance = abs( maxDistance );
+  Stepper[motor].speedLimit     = ramp[ HOMINGRAMP_FAST ].speedLimit;
+  Stepper[motor].speedMin       = ramp[ HOMINGRAMP_FAST ].speedMin;
   setRelDistance( motor, maxDistance );
   startMoving( motor, disableOnStop );
 
+  // end stop or EMS: homing is done at once
+  if ( !Stepper[motor].isMoving ) {
+    endHoming( motor );
+  }
+
+  SREG = oldSREG;
+
+}
+
+void homingAll( long maxDistance[MaxStepper], uint8_t disableOnStopMask ) {
+  // homing of all motors with maxDistance != 0 in parallel, EVENT_HOMED signals that all of them are done
+
+  uint8_t i;
+  uint8_t mask = 0;
+
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( ( maxDistance[i] != 0 ) && ( Stepper[i].inSyncWith == i ) ) {
+      mask |= 1 << i;
+    }
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+  homingMask = mask;
+  if ( mask == 0 ) {
+    events |= EVENT_HOMED;
+  }
+  SREG = oldSREG;
+
+  for (i=0; i<MaxStepper; i++ ) {
+    if ( mask & ( 1 << i ) ) {
+      homing( i, maxDistance[i], disableOnStopMask & ( 1 << i ) );
+    }
+  }
+
+}
+
+void setHomingSpeed( uint8_t motor, long fast, long slow ) {
+  // sets the homing speeds in steps/s, used by the next homing
+
+  Stepper[motor].homingFast = fast;
+  Stepper[motor].homingSlow = slow;
+  
 }
 
 void homingOffset( uint8_t motor, long Offset) {
   // Apply homing offset to run in HOMING_PHASE3
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
   Stepper[motor].homingOffset = abs( Offset );
+  SREG = oldSREG;
 } 
 
 void setInSync( uint8_t motor1, uint8_t motor2, boolean on ) {
   // set two motors to run in sync
 
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
   for (int i=0; i<MaxStepper; i++ ) {
 
    // check if a motor is already syncronized with m1 oder m2: stop motor and "unsync" it
-   if ( ( Stepper[i].inSyncWith = motor1 ) || ( Stepper[i].inSyncWith = motor2 ) ) {
+   if ( ( Stepper[i].inSyncWith == motor1 ) || ( Stepper[i].inSyncWith == motor2 ) ) {
     stopMoving( i );
     Stepper[i].inSyncWith = i;
    }
@@ -1166,25 +3482,104 @@ void setInSync( uint8_t motor1, uint8_t motor2, boolean on ) {
     Stepper[motor2].inSyncWith = motor1;
     Stepper[motor2].maxSpeed = Stepper[motor1].maxSpeed;
     Stepper[motor2].acceleration = Stepper[motor1].acceleration;
+    calcRamp( &Stepper[motor2], Stepper[motor2].maxSpeed, Stepper[motor2].acceleration );
+  }
+
+  SREG = oldSREG;
+
+}
+
+void setGearing( uint8_t follower, uint8_t leader, long numerator, long denominator ) {
+  // gears follower to leader: it runs numerator/denominator steps per leader step, in the same tick.
+  // numerator 0 or leader NOGEAR disengages. Leaders can't be followers and vice versa.
+  // gearStep does max. one step per tick like the leader, so ratios above 1 are ignored.
+
+  if ( ( follower == leader ) || ( denominator <= 0 ) || ( abs( numerator ) > denominator ) ) {
+    return;
+  }
+
+  if ( ( numerator == 0 ) || ( leader == NOGEAR ) ) {
+    leader = NOGEAR;
+  } else if ( ( Stepper[leader].gearLeader != NOGEAR ) || ( gearLeaders & ( 1 << follower ) ) ) {
+    return;
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
+  // the follower doesn't move by itself anymore
+  if ( leader != NOGEAR ) {
+    stopMoving( follower, true );
+  }
+
+  Stepper[follower].gearLeader      = leader;
+  Stepper[follower].gearNumerator   = numerator;
+  Stepper[follower].gearDenominator = denominator;
+  Stepper[follower].gearAccumulator = 0;
+
+  // a geared follower stays enabled
+  stage595( ENABLE[follower], ( leader == NOGEAR ) ? Stepper[follower].disableOnStop : 0 );
+
+  gearLeaders = 0;
+  for (int i=0; i<MaxStepper; i++ ) {
+    if ( Stepper[i].gearLeader != NOGEAR ) {
+      gearLeaders |= 1 << Stepper[i].gearLeader;
+    }
+  }
+
+  SREG = oldSREG;
+
+}
+
+void setTrigger( uint8_t trigger, uint8_t motor, long position, uint8_t action, uint8_t s, long value ) {
+  // arms a position trigger: if motor reaches position, action is done on servo s within the same stepper tick.
+  // A trigger fires once, TRIGGER_NONE disarms it. A trigger at the actual position fires at once.
+
+  if ( trigger >= MAXTRIGGER ) {
+    return;
+  }
+
+  if ( action == TRIGGER_SERVO ) {
+    value = constrain( value, -SERVOMAXPOSITION, SERVOMAXPOSITION );
+    servoBegin();
+  }
+
+  uint8_t oldSREG = SREG;  // shared with the stepper timer
+  noInterrupts();
+
+  Trigger[trigger].action   = action;
+  Trigger[trigger].motor    = motor;
+  Trigger[trigger].servo    = s;
+  Trigger[trigger].position = position;
+  Trigger[trigger].value    = value;
+  Trigger[trigger].above    = ( Stepper[motor].position > position );
+
+  if ( action == TRIGGER_NONE ) {
+    triggersArmed &= ~( 1 << trigger );
+  } else {
+    triggersArmed |= 1 << trigger;
   }
 
+  SREG = oldSREG;
+
 }
 
 long Cmd2Long( uint8_t startFrom ) {
   // gets a long out of the cmdBuffer, starting at position startFrom
 
-  return ((long)  CmdBlock.Cmd[startFrom] ) |
-         (((long) CmdBlock.Cmd[startFrom+1] ) << 8 ) |
-         (((long) CmdBlock.Cmd[startFrom+2] ) << 16 ) |
-         (((long) CmdBlock.Cmd[startFrom+3] ) << 24 );
+  // assembled as 32 bit value, so the sign is right with any size of long (e.g. in the simulator)
+  return (int32_t) ( ((uint32_t)  CmdBlock.Cmd[startFrom] ) |
+                     (((uint32_t) CmdBlock.Cmd[startFrom+1] ) << 8 ) |
+                     (((uint32_t) CmdBlock.Cmd[startFrom+2] ) << 16 ) |
+                     (((uint32_t) CmdBlock.Cmd[startFrom+3] ) << 24 ) );
          
 }
 
 int Cmd2Int( uint8_t startFrom ) {
   // gets a int out of the cmdBuffer, starting at position startFrom
 
-  return ((int)  CmdBlock.Cmd[startFrom] ) |
-         (((int) CmdBlock.Cmd[startFrom+1] ) << 8 );
+  return (int16_t) ( ((uint16_t)  CmdBlock.Cmd[startFrom] ) |
+                     (((uint16_t) CmdBlock.Cmd[startFrom+1] ) << 8 ) );
          
 }
 
@@ -1350,7 +3745,7 @@ void cmdInterpreter( void ) {
         break;
 
       case CMD_GETSERVO:
-        returnBytes = ReturnLong( returnBytes, Servo[s].position );
+        returnBytes = ReturnLong( returnBytes, getServo( s ) );
         break;
 
       case CMD_SETSERVOALL:
@@ -1414,41 +3809,488 @@ void cmdInterpreter( void ) {
         // motor, offset
         homingOffset( motor, Cmd2Long(2) );
         break;
+
+      case CMD_SETTIMERSTATISTICS:
+        // on
+        setTimerStatistics( CmdBlock.Cmd[1] );
+        break;
+
+      case CMD_GETTIMERSTATISTICS:
+        returnBytes = ReturnLong( returnBytes, timerRate );
+        returnBytes = ReturnLong( returnBytes, stepperFrequency );
+        returnBytes = ReturnLong( returnBytes, timerWorstDuration );
+        returnBytes = ReturnLong( returnBytes, timerAvgDuration );
+        break;
+
+      case CMD_MOVELINEAR: {
+        // d1, d2, d3, d4, feedrate, disableOnStop
+        long distance[MaxStepper] = { Cmd2Long(1), Cmd2Long(5), Cmd2Long(9), Cmd2Long(13) };
+        moveLinear( distance, Cmd2Long(17), CmdBlock.Cmd[21] );
+        break;
+      }
+
+      case CMD_QUEUELINEAR: {
+        // d1, d2, d3, d4, feedrate, disableOnStop
+        long distance[MaxStepper] = { Cmd2Long(1), Cmd2Long(5), Cmd2Long(9), Cmd2Long(13) };
+        queueLinear( distance, Cmd2Long(17), CmdBlock.Cmd[21] );
+        break;
+      }
+
+      case CMD_FLUSHQUEUE:
+        flushQueue();
+        break;
+
+      case CMD_GETQUEUEFREE:
+        returnBuffer[ returnBytes++ ] = getQueueFree();
+        break;
+
+      case CMD_STREAM:
+        // count, samples
+        stream( CmdBlock.Cmd[1] );
+        break;
+
+      case CMD_STARTSTREAM:
+        // motorMask, lowWater, disableOnStop
+        startStream( CmdBlock.Cmd[1], CmdBlock.Cmd[2], CmdBlock.Cmd[3] );
+        break;
+
+      case CMD_STOPSTREAM:
+        stopStream();
+        break;
+
+      case CMD_GETSTREAMFREE:
+        returnBuffer[ returnBytes++ ] = getStreamFree();
+        break;
+
+      case CMD_SETTRACE:
+        // flags
+        setTrace( CmdBlock.Cmd[1] );
+        break;
+
+      case CMD_GETTRACE:
+        getTrace();
+        break;
+
+      case CMD_GETTRACESTATISTICS:
+        getTraceStatistics();
+        break;
+
+      case CMD_GETSNAPSHOT:
+        // chunk
+        getSnapshot( CmdBlock.Cmd[1] );
+        break;
+
+      case CMD_SETEVENTMASK:
+        // mask, servo
+        setEventMask( CmdBlock.Cmd[1], ( CmdBlock.Cmd[2] == NOEVENTPIN ) ? NOEVENTPIN : interface2servo( CmdBlock.Cmd[2] ) );
+        break;
+
+      case CMD_GETEVENTS:
+        returnBuffer[ returnBytes++ ] = getEvents();
+        break;
+
+      case CMD_BATCH:
+        // flags, commands
+        batch( CmdBlock.Cmd[1] );
+        break;
+
+      case CMD_GETEFFECTIVESPEED:
+        returnBytes = ReturnLong( returnBytes, getEffectiveSpeed( motor ) );
+        break;
+
+      case CMD_MOVESERVO:
+        // servo, position, speed, easing
+        moveServo( s, Cmd2Long(2), Cmd2Long(6), CmdBlock.Cmd[10] );
+        break;
+
+      case CMD_MOVESERVOTIMED:
+        // servo, position, duration, easing
+        startServoMove( s, Cmd2Long(2), Cmd2Long(6), CmdBlock.Cmd[10] );
+        break;
+
+      case CMD_MOVESERVOALL:
+        // p1, p2, p3, p4, duration, easing
+        {
+          long position[MaxServo] = { Cmd2Long(1), Cmd2Long(5), Cmd2Long(9), Cmd2Long(13) };
+          moveServoAll( position, Cmd2Long(17), CmdBlock.Cmd[21] );
+        }
+        break;
+
+      case CMD_GETSERVOMOVING:
+        returnBuffer[ returnBytes++ ] = getServoMoving();
+        break;
+
+      case CMD_SETHOMINGSPEED:
+        // motor, fast, slow
+        setHomingSpeed( motor, Cmd2Long(2), Cmd2Long(6) );
+        break;
+
+      case CMD_HOMINGALL:
+        // d1, d2, d3, d4, disableOnStopMask
+        {
+          long maxDistance[MaxStepper] = { Cmd2Long(1), Cmd2Long(5), Cmd2Long(9), Cmd2Long(13) };
+          homingAll( maxDistance, CmdBlock.Cmd[17] );
+        }
+        break;
+
+      case CMD_SETTRIGGER:
+        // trigger, motor, position, action, servo, value
+        setTrigger( CmdBlock.Cmd[1], interface2motor( CmdBlock.Cmd[2] ), Cmd2Long(3), CmdBlock.Cmd[7], interface2servo( CmdBlock.Cmd[8] ), Cmd2Long(9) );
+        break;
+
+      case CMD_GETTRIGGERS:
+        returnBuffer[ returnBytes++ ] = triggersArmed;
+        break;
+
+      case CMD_SETGEARING:
+        // follower, leader, numerator, denominator
+        setGearing( motor, ( CmdBlock.Cmd[2] == 0 ) ? NOGEAR : interface2motor( CmdBlock.Cmd[2] ), Cmd2Long(3), Cmd2Long(7) );
+        break;
+
+      case CMD_GETBUSSTATISTICS:
+        getBusStatistics();
+        break;
+
+      case CMD_GETCOMMANDCOUNTS:
+        // first
+        getCommandCounts( CmdBlock.Cmd[1] );
+        break;
+
+      case CMD_RESETBUSSTATISTICS:
+        resetBusStatistics();
+        break;
+
+      case CMD_GETPROTOCOL:
+        returnBuffer[ returnBytes++ ] = PROTOCOLVERSION;
+        returnBuffer[ returnBytes++ ] = ~PROTOCOLVERSION;
+        break;
+
+      default:
+        // unknown command
+        countBus( &Bus.malformed );
+        break;
+    }
+
+    // write all direction & enable changes of this command at once
+    flush595();
+
+    // getters publish their reply
+    if ( returnBytes > 0 ) {
+      publishReply();
+    }
+
+  }
+
+}
+
+void batch( uint8_t flags ) {
+  // collects the commands of a batch chunk, the whole batch is executed at commit.
+  // A batch, not fitting into the batch buffer or with a truncated chunk, is discarded.
+
+  uint8_t i = 2;
+
+  if ( flags & BATCH_BEGIN ) {
+    batchLen       = 0;
+    batchOverflow  = false;
+    batchTruncated = false;
+  }
+
+  // append all commands of this chunk, zero length ends the chunk
+  while ( ( i < maxCmdSize ) && ( CmdBlock.Cmd[i] > 0 ) ) {
+    uint16_t len = CmdBlock.Cmd[i] + 1;   // a prefix of 255 must not wrap to 0
+    if ( CmdBlock.Cmd[i] > maxCmdSize - i - 1 ) {
+      // the command runs over the end of the frame, the TWI truncated a chunk longer than maxCmdSize
+      if ( !batchTruncated ) {
+        countBus( &Bus.oversized );
+      }
+      batchOverflow  = true;
+      batchTruncated = true;
+      break;
+    }
+    if ( batchLen + len > BATCHSIZE ) {
+      batchOverflow = true;
+      break;
+    }
+    memcpy( &batchBuffer[batchLen], &CmdBlock.Cmd[i], len );
+    batchLen += len;
+    i        += len;
+  }
+
+  if ( !( flags & BATCH_COMMIT ) ) {
+    return;
+  }
+
+  // execute all commands back-to-back, no other command is executed in between
+  if ( !batchOverflow ) {
+    for (i=0; i<batchLen; i+=batchBuffer[i]+1 ) {
+      memset( CmdBlock.Cmd, 0, maxCmdSize );
+      memcpy( CmdBlock.Cmd, &batchBuffer[i+1], batchBuffer[i] );
+      if ( CmdBlock.Cmd[0] != CMD_BATCH ) {
+        cmdInterpreter();
+      }
+    }
+  } else if ( !batchTruncated ) {
+    countBus( &Bus.oversized );
+  }
+
+  batchLen    = 0;
+  returnBytes = 0;   // a batch doesn't reply
+
+}
+
+boolean isGetter( uint8_t cmd ) {
+  // true, if a command only reads data and sends a reply.
+  // queueCommand runs getters inside the I2C interrupt, with all interrupts disabled, so the reply
+  // is ready for a protocol v1 read right behind the write. Each getter listed here needs to:
+  //   - finish within a few ten µs, the stepper timer waits meanwhile. The longest one is
+  //     CMD_GETSNAPSHOT chunk 0, which packs the whole controller state.
+  //   - have bounded loops and check all indices sent by the host against its buffers.
+  //   - never wait for an interrupt, a flag set by loop() or the serial port.
+  // A getter not fitting these rules has to be answered by loop() and isn't listed here.
+
+  switch ( cmd ) {
+    case CMD_GETMICROSTEPMODE:
+    case CMD_GETSTEPSTOGO:
+    case CMD_GETMAXSPEED:
+    case CMD_ISMOVING:
+    case CMD_ISMOVINGALL:
+    case CMD_GETSTATE:
+    case CMD_GETPOSITION:
+    case CMD_GETPOSITIONALL:
+    case CMD_GETACCELERATION:
+    case CMD_GETACCELERATIONALL:
+    case CMD_GETSERVO:
+    case CMD_GETSERVOALL:
+    case CMD_GETSERVOOFFSET:
+    case CMD_GETSERVOOFFSETALL:
+    case CMD_GETTIMERSTATISTICS:
+    case CMD_GETQUEUEFREE:
+    case CMD_GETSNAPSHOT:
+    case CMD_GETEVENTS:
+    case CMD_GETEFFECTIVESPEED:
+    case CMD_GETSERVOMOVING:
+    case CMD_GETTRIGGERS:
+    case CMD_GETSTREAMFREE:
+    case CMD_GETTRACE:
+    case CMD_GETTRACESTATISTICS:
+    case CMD_GETBUSSTATISTICS:
+    case CMD_GETCOMMANDCOUNTS:
+    case CMD_GETPROTOCOL:
+      return true;
+    default:
+      return false;
+  }
+
+}
+
+void publishReply( void ) {
+  // makes the reply in returnBuffer visible to requestEvent and switches to the other buffer
+
+  uint8_t oldSREG = SREG;
+  noInterrupts();
+  replyBytes[ replyFront ^ 1 ] = returnBytes;
+  replySeq[ replyFront ^ 1 ]   = CmdBlock.seq;
+  replyFront   = replyFront ^ 1;
+  returnBuffer = replyBuffer[ replyFront ^ 1 ];
+  SREG = oldSREG;
+
+}
+
+void dispatchCommands( void ) {
+  // executes all commands of the command FIFO, runs in loop() with interrupts enabled
+
+  while ( cmdFifoTail != cmdFifoHead ) {
+    CmdBlock = CmdFifo[ cmdFifoTail & ( CMDFIFOSIZE - 1 ) ];
+    traceCommand( &CmdBlock );
+    cmdInterpreter();
+    cmdFifoTail++;
+  }
+
+}
+
+uint8_t crc8( uint8_t crc, const uint8_t *data, uint8_t len ) {
+  // CRC-8 with polynomial x^8 + x^2 + x + 1
+
+  while ( len-- ) {
+    crc ^= *data++;
+    for (uint8_t i=0; i<8; i++ ) {
+      crc = ( crc & 0x80 ) ? ( crc << 1 ) ^ 0x07 : crc << 1;
+    }
+  }
+
+  return crc;
+
+}
+
+boolean queueCommand( const uint8_t *cmd, uint8_t len, uint8_t seq ) {
+  // copies a received command into the command FIFO, runs in receiveEvent.
+  // Returns false, if the FIFO is full and the command is dropped.
+
+  // FIFO full, drop the command
+  if ( (uint8_t)( cmdFifoHead - cmdFifoTail ) >= CMDFIFOSIZE ) {
+    Bus.dropped++;
+    return false;
+  }
+
+  t_CmdBlock *c = &CmdFifo[ cmdFifoHead & ( CMDFIFOSIZE - 1 ) ];
+
+  // store received data into CommandBuffer, fill all
+  memcpy( c->Cmd, cmd, len );
+  memset( &c->Cmd[len], 0, maxCmdSize - len );
+  c->seq = seq;
+
+  // New data available!!!
+  c->newCmd = true;
+  traceReceive( c );
+
+  if ( c->Cmd[0] < CMDCOUNTERS ) {
+    Bus.commands[ c->Cmd[0] ]++;
+  }
+
+  // a getter without commands waiting in front of it is answered at once, so the reply is
+  // ready for the next request. loop() isn't executing any command right now.
+  // A host reading with a repeated start right behind the write gets this reply, too: the TWI
+  // stretches the clock until receiveEvent returns. A getter behind other commands is answered
+  // by loop(), protocol v2 reports it as pending meanwhile. A v1 read can't tell and gets the reply
+  // before, so the host libraries negotiate v2 by themselves. See isGetter for the rules a getter
+  // needs to follow to run in here.
+  if ( isGetter( c->Cmd[0] ) && ( cmdFifoTail == cmdFifoHead ) ) {
+    CmdBlock = *c;
+    traceCommand( &CmdBlock );
+    cmdInterpreter();
+    return true;
+  }
+
+  cmdFifoHead++;
+
+  return true;
+  
+}
+
+void receiveFrame2( const uint8_t *frame, uint8_t bytes ) {
+  // checks a v2 frame and queues its command. The host reads the status, a frame
+  // with the same sequence number & crc as the last accepted one is a retry and executed once.
+
+  uint8_t len = frame[1];
+  uint8_t seq = ( bytes > 2 ) ? frame[2] : 0;
+  uint8_t crc = frame[ bytes - 1 ];
+
+  frame2          = true;
+  frame2StatusSeq = seq;   // a host retrying a busy frame needs to find its status
+
+  if ( ( bytes < 5 ) || ( len != bytes - 4 ) ) {
+    if ( len > FRAME2MAXCMD ) {
+      // the host wrote more than maxCmdSize bytes, the TWI truncated the frame
+      Bus.oversized++;
+    } else {
+      Bus.malformed++;
     }
+    frame2Status = STATUS_LENGTH;
+    return;
+  }
+
+  if ( crc8( 0, frame, bytes - 1 ) != crc ) {
+    Bus.malformed++;
+    frame2Status = STATUS_CRC;
+    return;
+  }
+
+  frame2Status = STATUS_OK;
+
+  // continue sending the last reply
+  if ( frame[3] == CMD_GETREPLY ) {
+    frame2Offset = frame[4];
+    return;
+  }
+
+  // the host missed the status of an accepted frame
+  if ( frame2Accepted && ( seq == frame2Seq ) && ( crc == frame2Crc ) ) {
+    return;
+  }
 
+  if ( !queueCommand( &frame[3], len, seq ) ) {
+    frame2Status = STATUS_BUSY;
+    return;
   }
 
+  frame2Accepted = true;
+  frame2Seq      = seq;
+  frame2Crc      = crc;
+  frame2Getter   = isGetter( frame[3] );
+  frame2Offset   = 0;
+
 }
 
 void receiveEvent(int uint8_tsReceived){
-  // is called when I2C data is received
+  // is called when I2C data is received, the command is only copied into the command FIFO.
+  // The TWI keeps only the first maxCmdSize bytes of a longer frame. The v2 len and the
+  // length prefixes of a batch chunk show the truncation, a plain v1 command can't tell.
+  uint8_t frame[maxCmdSize];
   int i;
 
-  // store received data into CommandBuffer
+  // an empty write, e.g. a bus scan, isn't a command
+  if ( uint8_tsReceived == 0 ) {
+    Bus.malformed++;
+    return;
+  }
+
   for (i=0; i<uint8_tsReceived; i++) {
-    CmdBlock.Cmd[i] = Wire.read();
+    frame[i] = Wire.read();
   }
 
-  // fill all
-  for (; i<maxCmdSize; i++) {
-    CmdBlock.Cmd[i] = 0;
+  if ( frame[0] == FRAME2 ) {
+    receiveFrame2( frame, uint8_tsReceived );
+  } else {
+    // a v1 host or a host negotiating the protocol, forget the last v2 frame
+    frame2         = false;
+    frame2Accepted = false;
+    frame2Status   = STATUS_NONE;
+    queueCommand( frame, uint8_tsReceived, 0 );
   }
+  
+}
 
-  // New data available!!!
-  CmdBlock.newCmd = true;
+void sendFrame2( void ) {
+  // sends the status of the last v2 frame and the reply of a getter
+
+  uint8_t frame[maxReplySize];
+  uint8_t status = frame2Status;
+  uint8_t len    = 0;
+
+  if ( ( status == STATUS_OK ) && frame2Getter ) {
+    if ( replySeq[ replyFront ] != frame2Seq ) {
+      // the getter waits in the command FIFO
+      status = STATUS_PENDING;
+    } else if ( replyBytes[ replyFront ] > frame2Offset ) {
+      len = min( replyBytes[ replyFront ] - frame2Offset, FRAME2MAXDATA );
+    }
+  }
+
+  frame[0] = status;
+  frame[1] = frame2StatusSeq;
+  frame[2] = len;
+  frame[3] = crc8( 0, frame, 3 );
+  memcpy( &frame[4], &replyBuffer[ replyFront ][ frame2Offset ], len );
+  frame[ 4 + len ] = crc8( 0, frame, 4 + len );
+
+  Wire.write( frame, 5 + len );
 
-  cmdInterpreter();
-  
 }
 
 void requestEvent() {
-  // i2C-Interrupt to send data to master
+  // i2C-Interrupt to send data to master, never waits for a command
   
-  Wire.write( returnBuffer, returnBytes );
+  if ( frame2 ) {
+    sendFrame2();
+  } else {
+    Wire.write( replyBuffer[ replyFront ], replyBytes[ replyFront ] );
+  }
+  Bus.reads++;
   
 }
 
 void activateErrorLED( void ) {
+  // takes Timer3 from the stepper timer, so all motors will stop
   Timer3.initialize( 100000 );
   Timer3.attachInterrupt( errorLEDTimer );
 }
@@ -1458,15 +4300,21 @@ void errorLEDTimer( void ) {
   digitalWrite( LED, !digitalRead( LED ) );
 }
 
-
-unsigned long lastStep = 0;   // time of last times stepper timer
-
 void loop() {
 
-  unsigned long now;          // now, to calculate if a step could happen
-
   // check on keyboard event to change to maintenance mode
   if (Serial.available()){
+    #ifdef TRACEBUFFER
+      // t dumps the trace buffer, line ends are ignored
+      char c = Serial.peek();
+      if ( ( c == 't' ) || ( c == '\r' ) || ( c == '\n' ) ) {
+        Serial.read();
+        if ( c == 't' ) {
+          dumpTrace();
+        }
+        return;
+      }
+    #endif
     // set maintenance mode
     mode = MAINTENANCE;
     activateErrorLED();
@@ -1476,22 +4324,30 @@ void loop() {
     }
   }
 
-  // check if reference voltage is in range
-  if ( abs( maxMotorCurrent - getCurrent(100) ) > 0.05 ) {
-    mode = MAINTENANCE;
-    activateErrorLED();
+  // check if reference voltage is in range, a few times per second is enough
+  if ( millis() - currentCheck >= CURRENTCHECKINTERVAL ) {
+    currentCheck = millis();
+    if ( !currentInRange() ) {
+      mode = MAINTENANCE;
+      activateErrorLED();
+    }
   }
 
   if (mode == MAINTENANCE) {
     maintenanceLoop();
   }
 
-  // Stepper Timer
-  now = micros();
-  if ( ( now < lastStep ) || ( now > lastStep + stepperInterval ) ) {
-    lastStep = now;
-    StepperTimer();
-  }
+  // execute all received commands
+  dispatchCommands();
+
+  // Stepper Timer statistics
+  calcTimerStatistics();
+
+  // loop() rate
+  calcBusStatistics();
+
+  // look-ahead planning of the motion queue
+  planQueue();
 
   // Watchdog Timer
   // check only, if watchdog is active
@@ -1499,8 +4355,12 @@ void loop() {
     // check if watchdog-Time is reached
     if ( millis() > watchdog ) {
       // watchdog is reached, stop all motors and stop watchdog
+      noInterrupts();
       stopMovingAll( 0x0F );
+      flush595();
+      interrupts();
       watchdog = -1;
+      countBus( &Bus.watchdogTrips );
     }
 
   }
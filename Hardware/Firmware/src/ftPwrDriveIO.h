@@ -0,0 +1,106 @@
+#ifndef ftPwrDriveIO_h
+#define ftPwrDriveIO_h
+
+// Fast port I/O for ftPwrDrive
+//
+// Translates the Arduino pin numbers of ftPwrDriveHW.h at compile time into
+// ATmega32U4 port registers and bit masks. The timer routines use it to read
+// all end stops with one port read and to pulse all step pins with single
+// register writes instead of digitalRead/digitalWrite.
+//
+// (C) 2019-2022 Christian Bergschneider & Stefan Fuss
+
+#include <Arduino.h>
+#include <util/delay.h>
+#include "ftPwrDriveHW.h"
+
+// ports
+#define IO_PORTB 0
+#define IO_PORTC 1
+#define IO_PORTD 2
+#define IO_PORTE 3
+#define IO_PORTF 4
+#define IO_PORTS 5
+
+// min. high time of a step pulse (A4988: 1µs)
+#define STEPPULSE_US 1
+
+// ATmega32U4 pin mapping of Arduino Leonardo pins D0..D23, A0..A5 are D18..D23
+constexpr uint8_t IO_PINPORT[] = { IO_PORTD, IO_PORTD, IO_PORTD, IO_PORTD, IO_PORTD, IO_PORTC, IO_PORTD, IO_PORTE,
+                                   IO_PORTB, IO_PORTB, IO_PORTB, IO_PORTB, IO_PORTD, IO_PORTC, IO_PORTB, IO_PORTB,
+                                   IO_PORTB, IO_PORTB, IO_PORTF, IO_PORTF, IO_PORTF, IO_PORTF, IO_PORTF, IO_PORTF };
+constexpr uint8_t IO_PINBIT[]  = { 2, 3, 1, 0, 4, 6, 7, 6,
+                                   4, 5, 6, 7, 6, 7, 3, 1,
+                                   2, 0, 7, 6, 5, 4, 1, 0 };
+
+constexpr uint8_t ioPort( uint8_t pin ) { return IO_PINPORT[pin]; }
+  // port of an arduino pin
+
+constexpr uint8_t ioMask( uint8_t pin ) { return 1 << IO_PINBIT[pin]; }
+  // bit mask of an arduino pin
+
+constexpr uint8_t ioPorts( uint8_t p1, uint8_t p2, uint8_t p3, uint8_t p4 ) { return ( 1 << ioPort( p1 ) ) | ( 1 << ioPort( p2 ) ) | ( 1 << ioPort( p3 ) ) | ( 1 << ioPort( p4 ) ); }
+  // set of ports used by 4 pins
+
+// port & mask tables of ftPwrDriveHW.h
+constexpr uint8_t STEP_PORT[MaxStepper] = { ioPort( M1STEP ), ioPort( M2STEP ), ioPort( M3STEP ), ioPort( M4STEP ) };
+constexpr uint8_t STEP_MASK[MaxStepper] = { ioMask( M1STEP ), ioMask( M2STEP ), ioMask( M3STEP ), ioMask( M4STEP ) };
+constexpr uint8_t ES_PORT[MaxStepper]   = { ioPort( ES1 ), ioPort( ES2 ), ioPort( ES3 ), ioPort( ES4 ) };
+constexpr uint8_t ES_MASK[MaxStepper]   = { ioMask( ES1 ), ioMask( ES2 ), ioMask( ES3 ), ioMask( ES4 ) };
+constexpr uint8_t SERVO_PORT[MaxServo]  = { ioPort( SERVO1 ), ioPort( SERVO2 ), ioPort( SERVO3 ), ioPort( SERVO4 ) };
+constexpr uint8_t SERVO_MASK[MaxServo]  = { ioMask( SERVO1 ), ioMask( SERVO2 ), ioMask( SERVO3 ), ioMask( SERVO4 ) };
+constexpr uint8_t EMS_PORT              = ioPort( EMS );
+constexpr uint8_t EMS_MASK              = ioMask( EMS );
+
+// ports used by a group of pins, all other ports are never touched
+constexpr uint8_t IO_STEPPORTS  = ioPorts( M1STEP, M2STEP, M3STEP, M4STEP );
+constexpr uint8_t IO_ESPORTS    = ioPorts( ES1, ES2, ES3, ES4 ) | ( 1 << EMS_PORT );
+constexpr uint8_t IO_SERVOPORTS = ioPorts( SERVO1, SERVO2, SERVO3, SERVO4 );
+
+#define IO_FOREACHPORT( ports, action ) \
+  if ( ( ports ) & ( 1 << IO_PORTB ) ) { action( B, IO_PORTB ); } \
+  if ( ( ports ) & ( 1 << IO_PORTC ) ) { action( C, IO_PORTC ); } \
+  if ( ( ports ) & ( 1 << IO_PORTD ) ) { action( D, IO_PORTD ); } \
+  if ( ( ports ) & ( 1 << IO_PORTE ) ) { action( E, IO_PORTE ); } \
+  if ( ( ports ) & ( 1 << IO_PORTF ) ) { action( F, IO_PORTF ); }
+
+template <uint8_t ports> inline void ioRead( uint8_t value[IO_PORTS] ) {
+  // reads all pins of the used ports
+  #define IO_READ( p, i ) value[i] = PIN ## p
+  IO_FOREACHPORT( ports, IO_READ );
+  #undef IO_READ
+}
+
+template <uint8_t ports> inline void ioSet( const uint8_t mask[IO_PORTS] ) {
+  // sets all masked pins of the used ports to HIGH, interrupts need to be disabled
+  #define IO_SET( p, i ) PORT ## p |= mask[i]
+  IO_FOREACHPORT( ports, IO_SET );
+  #undef IO_SET
+}
+
+template <uint8_t ports> inline void ioClear( const uint8_t mask[IO_PORTS] ) {
+  // sets all masked pins of the used ports to LOW, interrupts need to be disabled
+  #define IO_CLEAR( p, i ) PORT ## p &= ~mask[i]
+  IO_FOREACHPORT( ports, IO_CLEAR );
+  #undef IO_CLEAR
+}
+
+template <uint8_t pin> inline void ioWrite( uint8_t value ) {
+  // sets a single pin, interrupts need to be disabled
+  uint8_t mask[IO_PORTS] = { 0 };
+  mask[ ioPort( pin ) ] = ioMask( pin );
+  if ( value ) {
+    ioSet<1 << ioPort( pin )>( mask );
+  } else {
+    ioClear<1 << ioPort( pin )>( mask );
+  }
+}
+
+template <uint8_t ports> inline void ioPulse( const uint8_t mask[IO_PORTS] ) {
+  // generates a HIGH pulse on all masked pins, interrupts need to be disabled
+  ioSet<ports>( mask );
+  _delay_us( STEPPULSE_US );
+  ioClear<ports>( mask );
+}
+
+#endif
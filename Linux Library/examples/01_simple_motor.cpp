@@ -0,0 +1,47 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// 01_simple_motor: M1 runs 1000 steps forward & back, e.g. on a Raspberry Pi
+//
+// usage: 01_simple_motor [/dev/i2c-1 [address]]
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include "ftPwrDrive.h"
+#include "i2cDev.h"
+
+int main( int argc, char *argv[] ) {
+
+  i2cDev bus( ( argc > 1 ) ? argv[1] : "/dev/i2c-1" );
+
+  if ( !bus.isOpen() ) {
+    fprintf( stderr, "can't open the I2C bus or it doesn't support I2C transfers\n" );
+    return 1;
+  }
+
+  ftPwrDriveBus pipeline( bus );
+  ftPwrDrive    drive( pipeline, ( argc > 2 ) ? strtol( argv[2], NULL, 0 ) : 32 );
+
+  // use protocol v2, if the firmware knows it
+  printf( "protocol v%d\n", drive.setProtocol() );
+
+  drive.setMaxSpeed( M1, 400 );
+  drive.setAcceleration( M1, 200 );
+
+  drive.setRelDistance( M1, 1000 );
+  drive.startMoving( M1 );
+  drive.wait( M1 );
+  printf( "position %ld\n", drive.getPosition( M1 ) );
+
+  drive.setRelDistance( M1, -1000 );
+  drive.startMoving( M1 );
+  drive.wait( M1 );
+  printf( "position %ld\n", drive.getPosition( M1 ) );
+
+  return 0;
+}
@@ -0,0 +1,60 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// 02_fake_bus: two fake ftPwrDrive on one bus, driven by two threads with
+// protocol v2 and injected faults, no hardware needed.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#include <cstdio>
+#include <thread>
+#include "ftPwrDrive.h"
+#include "ftPwrDriveFake.h"
+
+static void run( ftPwrDriveBus *pipeline, uint8_t address, long steps ) {
+  // one thread per device
+
+  ftPwrDrive drive( *pipeline, address );
+
+  drive.setProtocol();
+  drive.setMaxSpeed( M1, 1000 );
+
+  for (int i=0; i<100; i++ ) {
+    drive.setRelDistance( M1, steps );
+    drive.startMoving( M1 );
+  }
+
+  // all positions at once
+  std::future<long> p1 = drive.getPositionAsync( M1 );
+  std::future<long> p2 = drive.getPositionAsync( M2 );
+  printf( "0x%02x: M1 %ld M2 %ld\n", address, p1.get(), p2.get() );
+}
+
+int main( void ) {
+
+  ftPwrDriveFake bus;
+  bus.addDevice( 32 );
+  bus.addDevice( 33 );
+  bus.setFaults( 7 );
+
+  ftPwrDriveBus pipeline( bus );
+
+  std::thread t1( run, &pipeline, 32, 10 );
+  std::thread t2( run, &pipeline, 33, -20 );
+  t1.join();
+  t2.join();
+
+  // check the fake devices got every command exactly once
+  bool ok = ( bus.getPosition( 32, M1 ) == 1000 ) && ( bus.getPosition( 33, M1 ) == -2000 );
+
+  ftPwrDrive drive( pipeline, 32 );
+  ftPwrDriveSnapshot snapshot;
+  ok = ok && drive.getSnapshot( snapshot ) && ( snapshot.position[0] == 1000 );
+
+  printf( "%lu transfers, %lu retries, %lu errors: %s\n", bus.getTransfers(), pipeline.retries.load(), pipeline.errors.load(), ok ? "ok" : "FAILED" );
+
+  return ok ? 0 : 1;
+}
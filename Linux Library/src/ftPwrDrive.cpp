@@ -0,0 +1,811 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+// PLEASE USE AT LEAST FIRMWARE 0.98 !!!
+//
+///////////////////////////////////////////////////
+
+#include "ftPwrDrive.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+// ftPwrDrive Commands, see the ftDuino library for the parameters
+#define CMD_SETWATCHDOG         0
+#define CMD_SETMICROSTEPMODE    1
+#define CMD_GETMICROSTEPMODE    2
+#define CMD_SETRELDISTANCE      3
+#define CMD_SETABSDISTANCE      5
+#define CMD_GETSTEPSTOGO        7
+#define CMD_SETMAXSPEED         8
+#define CMD_GETMAXSPEED         9
+#define CMD_STARTMOVING        10
+#define CMD_STARTMOVINGALL     11
+#define CMD_ISMOVING           12
+#define CMD_ISMOVINGALL        13
+#define CMD_GETSTATE           14
+#define CMD_SETPOSITION        15
+#define CMD_SETPOSITIONALL     16
+#define CMD_GETPOSITION        17
+#define CMD_GETPOSITIONALL     18
+#define CMD_SETACCELERATION    19
+#define CMD_GETACCELERATION    20
+#define CMD_SETACCELERATIONALL 21
+#define CMD_GETACCELERATIONALL 22
+#define CMD_SETSERVO           23
+#define CMD_GETSERVO           24
+#define CMD_SETSERVOALL        25
+#define CMD_GETSERVOALL        26
+#define CMD_SETSERVOOFFSET     27
+#define CMD_GETSERVOOFFSET     28
+#define CMD_SETSERVOOFFSETALL  29
+#define CMD_GETSERVOOFFSETALL  30
+#define CMD_SETSERVOONOFF      31
+#define CMD_HOMING             32
+#define CMD_STOPMOVING         33
+#define CMD_STOPMOVINGALL      34
+#define CMD_SETINSYNC          35
+#define CMD_HOMINGOFFSET       36
+#define CMD_SETTIMERSTATISTICS 37
+#define CMD_GETTIMERSTATISTICS 38
+#define CMD_MOVELINEAR         39
+#define CMD_QUEUELINEAR        40
+#define CMD_FLUSHQUEUE         41
+#define CMD_GETQUEUEFREE       42
+#define CMD_GETSNAPSHOT        43
+#define CMD_SETEVENTMASK       44
+#define CMD_GETEVENTS          45
+#define CMD_BATCH              46
+#define CMD_GETEFFECTIVESPEED  47
+#define CMD_MOVESERVO          48
+#define CMD_MOVESERVOTIMED     49
+#define CMD_MOVESERVOALL       50
+#define CMD_GETSERVOMOVING     51
+#define CMD_SETGEARING         52
+#define CMD_SETHOMINGSPEED     53
+#define CMD_HOMINGALL          54
+#define CMD_SETTRIGGER         55
+#define CMD_GETTRIGGERS        56
+#define CMD_STREAM             57
+#define CMD_STARTSTREAM        58
+#define CMD_STOPSTREAM         59
+#define CMD_GETSTREAMFREE      60
+#define CMD_SETTRACE           61
+#define CMD_GETTRACE           62
+#define CMD_GETTRACESTATISTICS 63
+#define CMD_GETBUSSTATISTICS   64
+#define CMD_GETCOMMANDCOUNTS   65
+#define CMD_RESETBUSSTATISTICS 66
+#define CMD_GETPROTOCOL        67
+
+// flags of a batch chunk
+#define BATCH_BEGIN            1
+#define BATCH_COMMIT           2
+
+#define STREAMSAMPLESIZE       10
+
+#define TRACERECORDSIZE        8
+#define TRACECHUNK             3
+
+#define SNAPSHOTVERSION        1
+#define SNAPSHOTSIZE           62
+#define SNAPSHOTCHUNK          32
+
+class i2cCommand {
+  // a command in the byte order of the firmware: long is 4 bytes, int 2 bytes on the ATmega32U4
+  public:
+    uint8_t data[32];
+    uint8_t len = 0;
+
+    void push( uint8_t v ) {
+      data[len++] = v;
+    }
+
+    void push( long v ) {
+      for (uint8_t i=0; i<4; i++ ) {
+        data[len++] = ( v >> ( i * 8 ) ) & 0xFF;
+      }
+    }
+
+    void push( int v ) {
+      data[len++] = v & 0xFF;
+      data[len++] = ( v >> 8 ) & 0xFF;
+    }
+};
+
+static long popLong( const ftPwrDriveReply &reply, uint8_t pos ) {
+  // reads a long of the firmware out of a reply
+  return (int32_t)( reply[pos] | ( reply[pos+1] << 8 ) | ( reply[pos+2] << 16 ) | ( (uint32_t) reply[pos+3] << 24 ) );
+}
+
+static int popInt( const ftPwrDriveReply &reply, uint8_t pos ) {
+  // reads an int of the firmware out of a reply
+  return (int16_t)( reply[pos] | ( reply[pos+1] << 8 ) );
+}
+
+template <typename R, typename F> static std::future<R> then( std::future<ftPwrDriveReply> reply, F f ) {
+  // future of a value decoded out of the reply, decoded when it's read
+  return std::async( std::launch::deferred, [f]( std::future<ftPwrDriveReply> r ) { return (R) f( r.get() ); }, std::move( reply ) );
+}
+
+ftPwrDrive::ftPwrDrive( ftPwrDriveBus &bus, uint8_t myI2CAddress ) : bus( bus ) {
+  // constructor, negotiates the protocol
+  i2cAddress = myI2CAddress;
+  setProtocol( 2 );
+}
+
+template <typename... T> void ftPwrDrive::sendData( uint8_t cmd, T... v ) {
+  // send a command, while batching it's appended to the batch
+
+  i2cCommand c;
+  c.push( cmd );
+  ( c.push( v ), ... );
+
+  if ( !batching ) {
+    bus.send( i2cAddress, c.data, c.len );
+    return;
+  }
+
+  // send full chunks
+  if ( batchLen + 1 + c.len > bus.maxCommand( i2cAddress ) ) {
+    sendBatch();
+  }
+
+  batch[batchLen++] = c.len;
+  memcpy( &batch[batchLen], c.data, c.len );
+  batchLen += c.len;
+}
+
+template <typename... T> std::future<ftPwrDriveReply> ftPwrDrive::queryData( uint8_t replyBytes, uint8_t cmd, T... v ) {
+  // queue a getter and its reply of replyBytes bytes
+
+  i2cCommand c;
+  c.push( cmd );
+  ( c.push( v ), ... );
+
+  return bus.query( i2cAddress, c.data, c.len, replyBytes );
+}
+
+void ftPwrDrive::Watchdog( long wtime ) {
+  // set wartchog timer
+  sendData( CMD_SETWATCHDOG, wtime );
+}
+
+void ftPwrDrive::setMicrostepMode( uint8_t mode ) {
+  // set microstep mode - FULLSTEP, HALFSTEP, QUARTERSTEP, EIGTHSTEP, SIXTEENTHSTEP
+  sendData( CMD_SETMICROSTEPMODE, mode );
+}
+
+uint8_t ftPwrDrive::getMicrostepMode( void ) {
+  // get microstep mode - FULLSTEP, HALFSTEP, QUARTERSTEP, EIGTHSTEP, SIXTEENTHSTEP
+  return queryData( 1, CMD_GETMICROSTEPMODE ).get()[0];
+}
+
+void ftPwrDrive::setRelDistance( uint8_t motor, long distance ) {
+  // set a distance to go, relative to actual position
+  sendData( CMD_SETRELDISTANCE, motor, distance );
+}
+
+void ftPwrDrive::setRelDistanceAll( long d1, long d2, long d3, long d4 ) {
+  // set a relative distance to go for all motors
+  setRelDistance( M1, d1 );
+  setRelDistance( M2, d2 );
+  setRelDistance( M3, d3 );
+  setRelDistance( M4, d4 );
+}
+
+void ftPwrDrive::setAbsDistance( uint8_t motor, long distance ) {
+  // set a absolute distance to go
+  sendData( CMD_SETABSDISTANCE, motor, distance );
+}
+
+void ftPwrDrive::setAbsDistanceAll( long d1, long d2, long d3, long d4 ) {
+  // set a absolute distance to go for all motors
+  setAbsDistance( M1, d1 );
+  setAbsDistance( M2, d2 );
+  setAbsDistance( M3, d3 );
+  setAbsDistance( M4, d4 );
+}
+
+long ftPwrDrive::getStepsToGo( uint8_t motor ) {
+  // number of needed steps to go to distance
+  return getStepsToGoAsync( motor ).get();
+}
+
+std::future<long> ftPwrDrive::getStepsToGoAsync( uint8_t motor ) {
+  // number of needed steps to go to distance
+  return then<long>( queryData( 4, CMD_GETSTEPSTOGO, motor ), []( const ftPwrDriveReply &r ) { return popLong( r, 0 ); } );
+}
+
+void ftPwrDrive::setMaxSpeed( uint8_t motor, long speed ) {
+  // set max speed
+  sendData( CMD_SETMAXSPEED, motor, speed );
+}
+
+long ftPwrDrive::getMaxSpeed( uint8_t motor ) {
+  // get max speed
+  return popLong( queryData( 4, CMD_GETMAXSPEED, motor ).get(), 0 );
+}
+
+void ftPwrDrive::startMoving( uint8_t motor, bool disableOnStop ) {
+  // start motor moving, disableOnStop disables the motor driver at the end of the movement
+  sendData( CMD_STARTMOVING, motor, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::startMovingAll( uint8_t maskMotor, uint8_t maskDisableOnStop ) {
+  // same as StartMoving, but using uint8_t masks
+  sendData( CMD_STARTMOVINGALL, maskMotor, (long) maskDisableOnStop );
+}
+
+void ftPwrDrive::stopMoving( uint8_t motor ) {
+  // stop motor moving immediately
+  sendData( CMD_STOPMOVING, motor );
+}
+
+void ftPwrDrive::stopMovingAll( uint8_t maskMotor ) {
+  // same as stopMoving, but using uint8_t masks
+  sendData( CMD_STOPMOVINGALL, maskMotor );
+}
+
+bool ftPwrDrive::isMoving( uint8_t motor ) {
+  // check, if a motor is moving
+  return queryData( 1, CMD_ISMOVING, motor ).get()[0];
+}
+
+uint8_t ftPwrDrive::isMovingAll( void ) {
+  // return value is uint8_tmask, flag 1 is motoris#1, flag2 is motor #2,
+  return isMovingAllAsync().get();
+}
+
+std::future<uint8_t> ftPwrDrive::isMovingAllAsync( void ) {
+  // return value is uint8_tmask, flag 1 is motoris#1, flag2 is motor #2,
+  return then<uint8_t>( queryData( 1, CMD_ISMOVINGALL ), []( const ftPwrDriveReply &r ) { return r[0]; } );
+}
+
+uint8_t ftPwrDrive::getState( uint8_t motor ) {
+  // 8754321  - flag 1 motor is running, flag 2 endstop, flag 3 EMS, flag 4 homing
+  return getStateAsync( motor ).get();
+}
+
+std::future<uint8_t> ftPwrDrive::getStateAsync( uint8_t motor ) {
+  // 8754321  - flag 1 motor is running, flag 2 endstop, flag 3 EMS, flag 4 homing
+  return then<uint8_t>( queryData( 1, CMD_GETSTATE, motor ), []( const ftPwrDriveReply &r ) { return r[0]; } );
+}
+
+bool ftPwrDrive::endStopActive( uint8_t motor ) {
+  // check, if end stop is pressed
+  return getState( motor ) & ENDSTOP;
+}
+
+bool ftPwrDrive::emergencyStopActive( void ) {
+  // check, if emergeny stop is pressed
+  return getState( M1 ) & EMERCENCYSTOP;
+}
+
+void ftPwrDrive::setPosition( uint8_t motor, long position ) {
+  // set position
+  sendData( CMD_SETPOSITION, motor, position );
+}
+
+void ftPwrDrive::setPositionAll( long p1, long p2, long p3, long p4 ) {
+  // set position of all motors
+  sendData( CMD_SETPOSITIONALL, p1, p2, p3, p4 );
+}
+
+long ftPwrDrive::getPosition( uint8_t motor ) {
+  // get position
+  return getPositionAsync( motor ).get();
+}
+
+std::future<long> ftPwrDrive::getPositionAsync( uint8_t motor ) {
+  // get position
+  return then<long>( queryData( 4, CMD_GETPOSITION, motor ), []( const ftPwrDriveReply &r ) { return popLong( r, 0 ); } );
+}
+
+void ftPwrDrive::getPositionAll( long &p1, long &p2, long &p3, long &p4 ) {
+  // get position of all motors
+  ftPwrDriveReply r = queryData( 16, CMD_GETPOSITIONALL ).get();
+  p1 = popLong( r, 0 );
+  p2 = popLong( r, 4 );
+  p3 = popLong( r, 8 );
+  p4 = popLong( r, 12 );
+}
+
+void ftPwrDrive::setAcceleration( uint8_t motor, long acceleration ) {
+  // set acceleration
+  sendData( CMD_SETACCELERATION, motor, acceleration );
+}
+
+void ftPwrDrive::setAccelerationAll( long a1, long a2, long a3, long a4 ) {
+  // set acceleration of all motors
+  sendData( CMD_SETACCELERATIONALL, a1, a2, a3, a4 );
+}
+
+long ftPwrDrive::getAcceleration( uint8_t motor ) {
+  // get acceleration
+  return popLong( queryData( 4, CMD_GETACCELERATION, motor ).get(), 0 );
+}
+
+void ftPwrDrive::getAccelerationAll( long &a1, long &a2, long &a3, long &a4 ) {
+  // get acceleration of all motors
+  ftPwrDriveReply r = queryData( 16, CMD_GETACCELERATIONALL ).get();
+  a1 = popLong( r, 0 );
+  a2 = popLong( r, 4 );
+  a3 = popLong( r, 8 );
+  a4 = popLong( r, 12 );
+}
+
+void ftPwrDrive::setServo( uint8_t servo, long position ) {
+  // set servo position
+  sendData( CMD_SETSERVO, servo, position );
+}
+
+long ftPwrDrive::getServo( uint8_t servo ) {
+  // get servo position
+  return popLong( queryData( 4, CMD_GETSERVO, servo ).get(), 0 );
+}
+
+void ftPwrDrive::setServoAll( long p1, long p2, long p3, long p4 ) {
+  // set all servos positions
+  sendData( CMD_SETSERVOALL, p1, p2, p3, p4 );
+}
+
+void ftPwrDrive::getServoAll( long &p1, long &p2, long &p3, long &p4 ) {
+  // get all servo positions
+  ftPwrDriveReply r = queryData( 16, CMD_GETSERVOALL ).get();
+  p1 = popLong( r, 0 );
+  p2 = popLong( r, 4 );
+  p3 = popLong( r, 8 );
+  p4 = popLong( r, 12 );
+}
+
+void ftPwrDrive::setServoOffset( uint8_t servo, long offset ) {
+  // set servo offset
+  sendData( CMD_SETSERVOOFFSET, servo, offset );
+}
+
+long ftPwrDrive::getServoOffset( uint8_t servo ) {
+  // get servo offset
+  return popLong( queryData( 4, CMD_GETSERVOOFFSET, servo ).get(), 0 );
+}
+
+void ftPwrDrive::setServoOffsetAll( long o1, long o2, long o3, long o4 ) {
+  // set servo offset all
+  sendData( CMD_SETSERVOOFFSETALL, o1, o2, o3, o4 );
+}
+
+void ftPwrDrive::getServoOffsetAll( long &o1, long &o2, long &o3, long &o4 ) {
+  // get all servo offset
+  ftPwrDriveReply r = queryData( 16, CMD_GETSERVOOFFSETALL ).get();
+  o1 = popLong( r, 0 );
+  o2 = popLong( r, 4 );
+  o3 = popLong( r, 8 );
+  o4 = popLong( r, 12 );
+}
+
+void ftPwrDrive::setServoOnOff( uint8_t servo, bool on ) {
+  // set servo pin On or Off without PWM
+  sendData( CMD_SETSERVOONOFF, servo, (uint8_t) on );
+}
+
+void ftPwrDrive::moveServo( uint8_t servo, long position, long speed, uint8_t easing ) {
+  // move a servo with speed units/s
+  sendData( CMD_MOVESERVO, servo, position, speed, easing );
+}
+
+void ftPwrDrive::moveServoTimed( uint8_t servo, long position, long duration, uint8_t easing ) {
+  // move a servo in duration ms
+  sendData( CMD_MOVESERVOTIMED, servo, position, duration, easing );
+}
+
+void ftPwrDrive::moveServoAll( long p1, long p2, long p3, long p4, long duration, uint8_t easing ) {
+  // move all servos in duration ms
+  sendData( CMD_MOVESERVOALL, p1, p2, p3, p4, duration, easing );
+}
+
+uint8_t ftPwrDrive::getServoMoving( void ) {
+  // mask of moving servos
+  return queryData( 1, CMD_GETSERVOMOVING ).get()[0];
+}
+
+void ftPwrDrive::homing( uint8_t motor, long maxDistance, bool disableOnStop ) {
+  // homing of motor using end stop
+  sendData( CMD_HOMING, motor, maxDistance, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::homingAll( long d1, long d2, long d3, long d4, uint8_t disableOnStopMask ) {
+  // homing of all motors with distance != 0 in parallel
+  sendData( CMD_HOMINGALL, d1, d2, d3, d4, disableOnStopMask );
+}
+
+void ftPwrDrive::setHomingSpeed( uint8_t motor, long fast, long slow ) {
+  // set the homing speeds in steps/s
+  sendData( CMD_SETHOMINGSPEED, motor, fast, slow );
+}
+
+bool ftPwrDrive::isHoming( uint8_t motor ) {
+  // check, homing is active
+  return getState( motor ) & HOMING;
+}
+
+void ftPwrDrive::homingOffset( uint8_t motor, long offset ) {
+  // set Offset to run in homing, after endstop is free again
+  sendData( CMD_HOMINGOFFSET, motor, offset );
+}
+
+void ftPwrDrive::wait( uint8_t motor_mask, uint16_t interval ) {
+  // wait until all motors in motor_mask completed their work
+
+  while ( isMovingAll() & motor_mask ) {
+    std::this_thread::sleep_for( std::chrono::milliseconds( interval ) );
+  }
+
+}
+
+float ftPwrDrive::setGearFactor( uint8_t motor, long gear1, long gear2 ) {
+  // Sets the gear factor. Please read setRelDistanceR for details.
+  return setGearFactor( motor, (float) gear1, (float) gear2 );
+}
+
+float ftPwrDrive::setGearFactor( uint8_t motor, float gear1, float gear2 ) {
+  // Sets the gear factor. Please read setRelDistanceR for details.
+  return gearFactor[ motorIndex(motor) ] = gear1 / gear2;
+}
+
+void ftPwrDrive::setRelDistanceR( uint8_t motor, float distance ) {
+  // Sets the relative distance in R - real units, 200 steps are one turn of the motor
+  setRelDistance( motor, gearFactor[ motorIndex( motor ) ] * 200 * distance );
+}
+
+void ftPwrDrive::setAbsDistanceR( uint8_t motor, float distance ) {
+  // Sets the absolute distance in R - real units. Please read setRelDistanceR for details.
+  setAbsDistance( motor, gearFactor[ motorIndex( motor ) ] * 200 * distance );
+}
+
+void ftPwrDrive::setInSync( uint8_t motor1, uint8_t motor2, bool OnOff ) {
+  // set two motors running in sync
+  sendData( CMD_SETINSYNC, motor1, motor2, (uint8_t) OnOff );
+}
+
+void ftPwrDrive::setTimerStatistics( bool on ) {
+  // start/stop measuring the stepper timer, starting resets all values
+  sendData( CMD_SETTIMERSTATISTICS, (uint8_t) on );
+}
+
+void ftPwrDrive::getTimerStatistics( long &rate, long &nominalRate, long &worstDuration, long &avgDuration ) {
+  // get achieved and nominal stepper timer ticks/s, worst and average duration of a tick in µs
+  ftPwrDriveReply r = queryData( 16, CMD_GETTIMERSTATISTICS ).get();
+  rate          = popLong( r, 0 );
+  nominalRate   = popLong( r, 4 );
+  worstDuration = popLong( r, 8 );
+  avgDuration   = popLong( r, 12 );
+}
+
+void ftPwrDrive::setTrace( uint8_t flags ) {
+  // start tracing the records in flags, 0 stops
+  sendData( CMD_SETTRACE, flags );
+}
+
+uint8_t ftPwrDrive::getTrace( ftPwrDriveTrace records[], uint8_t maxRecords ) {
+  // read and remove up to maxRecords records from the trace buffer
+
+  uint8_t count = 0;
+
+  while ( maxRecords - count >= TRACECHUNK ) {
+
+    ftPwrDriveReply reply = queryData( 1 + TRACECHUNK * TRACERECORDSIZE, CMD_GETTRACE ).get();
+
+    uint8_t n = reply[0];
+    if ( ( n == 0 ) || ( n > TRACECHUNK ) ) {
+      break;
+    }
+
+    for (uint8_t i=0; i<n; i++ ) {
+      uint8_t p = 1 + i * TRACERECORDSIZE;
+      records[count].type  = reply[p];
+      records[count].data  = reply[p+1];
+      records[count].value = reply[p+2] | ( reply[p+3] << 8 );
+      records[count].time  = (uint32_t) popLong( reply, p + 4 );
+      count++;
+    }
+
+  }
+
+  return count;
+}
+
+void ftPwrDrive::getTraceStatistics( long &missedTicks, long &worstLatency, long &avgLatency, long &lostRecords ) {
+  // get missed stepper ticks, worst and average command latency in µs and lost records
+  ftPwrDriveReply r = queryData( 16, CMD_GETTRACESTATISTICS ).get();
+  missedTicks  = popLong( r, 0 );
+  worstLatency = popLong( r, 4 );
+  avgLatency   = popLong( r, 8 );
+  lostRecords  = popLong( r, 12 );
+}
+
+void ftPwrDrive::getBusStatistics( ftPwrDriveBusStatistics &statistics ) {
+  // get the bus statistics
+
+  ftPwrDriveReply r = queryData( 32, CMD_GETBUSSTATISTICS ).get();
+
+  statistics.reads         = popLong( r, 0 );
+  statistics.dropped       = popLong( r, 4 );
+  statistics.oversized     = popLong( r, 8 );
+  statistics.malformed     = popLong( r, 12 );
+  statistics.watchdogTrips = popLong( r, 16 );
+  statistics.endStopStops  = popLong( r, 20 );
+  statistics.emsStops      = popLong( r, 24 );
+  statistics.loopRate      = popLong( r, 28 );
+}
+
+void ftPwrDrive::getCommandCounts( uint8_t first, uint16_t counts[ COMMANDCOUNTCHUNK ] ) {
+  // get the received commands of opcode first..first+COMMANDCOUNTCHUNK-1
+
+  ftPwrDriveReply r = queryData( COMMANDCOUNTCHUNK * 2, CMD_GETCOMMANDCOUNTS, first ).get();
+
+  for (uint8_t i=0; i<COMMANDCOUNTCHUNK; i++ ) {
+    counts[i] = r[ i * 2 ] | ( r[ i * 2 + 1 ] << 8 );
+  }
+}
+
+void ftPwrDrive::resetBusStatistics( void ) {
+  // reset all bus statistics
+  sendData( CMD_RESETBUSSTATISTICS );
+}
+
+uint8_t ftPwrDrive::setProtocol( uint8_t version ) {
+  // negotiate the protocol version
+
+  // ask in protocol v1, every firmware understands it
+  bus.setProtocol( i2cAddress, 1 );
+  if ( version < 2 ) {
+    return 1;
+  }
+  ftPwrDriveReply r = queryData( 2, CMD_GETPROTOCOL ).get();
+
+  // older firmware doesn't reply
+  uint8_t device = ( r[1] == (uint8_t) ~r[0] ) ? r[0] : 1;
+
+  version = std::max( std::min( version, device ), (uint8_t) 1 );
+  bus.setProtocol( i2cAddress, version );
+
+  return version;
+}
+
+uint8_t ftPwrDrive::getProtocol( void ) {
+  // protocol version in use
+  return bus.getProtocol( i2cAddress );
+}
+
+void ftPwrDrive::getProtocolStatistics( long &retries, long &errors ) {
+  // frames sent again and failed transfers
+  retries = bus.retries;
+  errors  = bus.errors;
+}
+
+void ftPwrDrive::sync( void ) {
+  // wait until all commands sent before reached the device
+  bus.sync();
+}
+
+void ftPwrDrive::setGearing( uint8_t follower, uint8_t leader, long numerator, long denominator ) {
+  // gear follower to leader with the ratio numerator/denominator
+  sendData( CMD_SETGEARING, follower, leader, numerator, denominator );
+}
+
+void ftPwrDrive::setTrigger( uint8_t trigger, uint8_t motor, long position, uint8_t action, uint8_t servo, long value ) {
+  // arm a position trigger
+  sendData( CMD_SETTRIGGER, trigger, motor, position, action, servo, value );
+}
+
+uint8_t ftPwrDrive::getTriggers( void ) {
+  // mask of armed triggers
+  return queryData( 1, CMD_GETTRIGGERS ).get()[0];
+}
+
+void ftPwrDrive::stream( uint16_t ticks, int s1, int s2, int s3, int s4 ) {
+  // add a sample, full frames are sent at once
+
+  int     steps[ MOTORS ] = { s1, s2, s3, s4 };
+  uint8_t p = 2 + streamSamples * STREAMSAMPLESIZE;
+
+  streamFrame[p++] = ticks & 0xFF;
+  streamFrame[p++] = ticks >> 8;
+  for (uint8_t i=0; i<MOTORS; i++ ) {
+    streamFrame[p++] = steps[i] & 0xFF;
+    streamFrame[p++] = ( steps[i] >> 8 ) & 0xFF;
+  }
+
+  // send, if the next sample doesn't fit into the frame
+  streamSamples++;
+  if ( 2 + ( streamSamples + 1 ) * STREAMSAMPLESIZE > bus.maxCommand( i2cAddress ) ) {
+    flushStream();
+  }
+}
+
+void ftPwrDrive::flushStream( void ) {
+  // send all collected samples
+
+  if ( streamSamples == 0 ) {
+    return;
+  }
+
+  streamFrame[0] = CMD_STREAM;
+  streamFrame[1] = streamSamples;
+  bus.send( i2cAddress, streamFrame, 2 + streamSamples * STREAMSAMPLESIZE );
+  streamSamples = 0;
+}
+
+void ftPwrDrive::startStream( uint8_t motorMask, uint8_t lowWater, bool disableOnStop ) {
+  // run the samples of the stream buffer
+  flushStream();
+  sendData( CMD_STARTSTREAM, motorMask, lowWater, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::stopStream( void ) {
+  // stop all streaming motors at once
+  streamSamples = 0;
+  sendData( CMD_STOPSTREAM );
+}
+
+uint8_t ftPwrDrive::getStreamFree( void ) {
+  // number of free slots in the stream buffer
+  return getStreamFreeAsync().get();
+}
+
+std::future<uint8_t> ftPwrDrive::getStreamFreeAsync( void ) {
+  // number of free slots in the stream buffer
+  return then<uint8_t>( queryData( 1, CMD_GETSTREAMFREE ), []( const ftPwrDriveReply &r ) { return r[0]; } );
+}
+
+void ftPwrDrive::moveLinear( long d1, long d2, long d3, long d4, long feedrate, bool disableOnStop ) {
+  // coordinated relative move of all motors on a straight line
+  sendData( CMD_MOVELINEAR, d1, d2, d3, d4, feedrate, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::queueLinear( long d1, long d2, long d3, long d4, long feedrate, bool disableOnStop ) {
+  // add a linear move to the motion queue
+  sendData( CMD_QUEUELINEAR, d1, d2, d3, d4, feedrate, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::flushQueue( void ) {
+  // discard all queued linear moves
+  sendData( CMD_FLUSHQUEUE );
+}
+
+uint8_t ftPwrDrive::getQueueFree( void ) {
+  // number of free slots in the motion queue
+  return getQueueFreeAsync().get();
+}
+
+std::future<uint8_t> ftPwrDrive::getQueueFreeAsync( void ) {
+  // number of free slots in the motion queue
+  return then<uint8_t>( queryData( 1, CMD_GETQUEUEFREE ), []( const ftPwrDriveReply &r ) { return r[0]; } );
+}
+
+void ftPwrDrive::waitQueue( uint16_t interval ) {
+  // wait until all queued moves are done
+
+  while ( ( getQueueFree() < MOTIONQUEUESIZE ) || isMovingAll() ) {
+    std::this_thread::sleep_for( std::chrono::milliseconds( interval ) );
+  }
+
+}
+
+bool ftPwrDrive::getSnapshot( ftPwrDriveSnapshot &snapshot ) {
+  // get the state of all motors and servos in one snapshot
+
+  ftPwrDriveReply buffer;
+  uint8_t         i;
+
+  // read all chunks, chunk 0 takes the snapshot
+  for (uint8_t chunk=0; chunk * SNAPSHOTCHUNK < SNAPSHOTSIZE; chunk++ ) {
+    uint8_t quantity = std::min( SNAPSHOTSIZE - chunk * SNAPSHOTCHUNK, SNAPSHOTCHUNK );
+    ftPwrDriveReply r = queryData( quantity, CMD_GETSNAPSHOT, chunk ).get();
+    buffer.insert( buffer.end(), r.begin(), r.end() );
+  }
+
+  snapshot.version = buffer[0];
+  if ( snapshot.version != SNAPSHOTVERSION ) {
+    return false;
+  }
+
+  snapshot.isMoving      = buffer[1];
+  snapshot.endStop       = buffer[2];
+  snapshot.homing        = buffer[3];
+  snapshot.emergencyStop = buffer[4] & 1;
+  snapshot.linearMove    = ( buffer[4] >> 1 ) & 1;
+  snapshot.queueFree     = buffer[5];
+
+  for (i=0; i<MOTORS; i++ ) {
+    snapshot.position[i]  = popLong( buffer, 6 + i * 4 );
+    snapshot.stepsToGo[i] = popLong( buffer, 22 + i * 4 );
+    snapshot.speed[i]     = popLong( buffer, 38 + i * 4 );
+  }
+
+  for (i=0; i<SERVOS; i++ ) {
+    snapshot.servo[i] = popInt( buffer, 54 + i * 2 );
+  }
+
+  return true;
+}
+
+void ftPwrDrive::setEventMask( uint8_t mask, uint8_t servo ) {
+  // set the events driving the event pin
+  sendData( CMD_SETEVENTMASK, mask, servo );
+}
+
+uint8_t ftPwrDrive::getEvents( void ) {
+  // get the latched events and clear them
+  return getEventsAsync().get();
+}
+
+std::future<uint8_t> ftPwrDrive::getEventsAsync( void ) {
+  // get the latched events and clear them
+  return then<uint8_t>( queryData( 1, CMD_GETEVENTS ), []( const ftPwrDriveReply &r ) { return r[0]; } );
+}
+
+uint8_t ftPwrDrive::waitEvent( uint8_t mask, uint16_t interval, unsigned long timeout ) {
+  // wait on events, polling the event register
+
+  auto    start = std::chrono::steady_clock::now();
+  uint8_t e;
+
+  while ( ( ( e = getEvents() ) & mask ) == 0 ) {
+    if ( ( timeout > 0 ) && ( std::chrono::steady_clock::now() - start >= std::chrono::milliseconds( timeout ) ) ) {
+      return 0;
+    }
+    std::this_thread::sleep_for( std::chrono::milliseconds( interval ) );
+  }
+
+  return e;
+}
+
+void ftPwrDrive::beginBatch( void ) {
+  // collect all following commands in a batch
+  batching = true;
+  batch[0] = CMD_BATCH;
+  batch[1] = BATCH_BEGIN;
+  batchLen = 2;
+}
+
+void ftPwrDrive::commitBatch( void ) {
+  // send the last chunk, the device executes the whole batch
+  batch[1] |= BATCH_COMMIT;
+  sendBatch();
+  batching = false;
+}
+
+void ftPwrDrive::sendBatch( void ) {
+  // send a chunk of the batch
+  bus.send( i2cAddress, batch, batchLen );
+
+  // next chunk
+  batch[1] = 0;
+  batchLen = 2;
+}
+
+float ftPwrDrive::getEffectiveSpeed( uint8_t motor ) {
+  // get the effective max speed in steps/s
+  return (float) popLong( queryData( 4, CMD_GETEFFECTIVESPEED, motor ).get(), 0 ) / 1000;
+}
+
+uint8_t ftPwrDrive::motorIndex( uint8_t motor ) {
+  // returns the index (0..3) of a motor
+  switch (motor) {
+    case M1:
+      return 0;
+    case M2:
+      return 1;
+    case M3:
+      return 2;
+    case M4:
+      return 3;
+    default:
+      return 0;
+  }
+}
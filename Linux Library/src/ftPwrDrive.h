@@ -0,0 +1,418 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// Same API as the ftDuino library on /dev/i2c-N, e.g. on a Raspberry Pi.
+// Commands are queued and sent by the I/O thread of ftPwrDriveBus, setters
+// return at once. Getters wait for their reply, the ...Async getters return
+// a future instead. Several ftPwrDrive on one bus share its I/O thread.
+// The bus is thread safe, an ftPwrDrive object isn't (batches & streams):
+// use one object per thread, even for the same device.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+// PLEASE USE AT LEAST FIRMWARE 0.98 !!!
+//
+///////////////////////////////////////////////////
+
+#ifndef ftPwrDrive_h
+#define ftPwrDrive_h
+
+#include <cstdint>
+#include <future>
+#include "ftPwrDriveBus.h"
+
+// some constant to make live easier:
+
+// microstep modes
+static const uint8_t FULLSTEP = 0, HALFSTEP = 4, QUARTERSTEP = 2, EIGTHSTEP = 6, SIXTEENTHSTEP = 7;
+
+// servo numbers
+static const uint8_t S1 = 0, S2 = 1, S3 = 2, S4 = 3;
+
+// number of servos
+static const uint8_t SERVOS = 4;
+
+// motor numbers
+static const uint8_t M1 = 1, M2 = 2, M3 = 4, M4 = 8;
+
+// number of motors
+static const uint8_t MOTORS = 4;
+
+// enumeration of motor numbers
+static const uint8_t M[ MOTORS ] = { M1, M2, M3, M4 };
+
+// flags, i.e. used in getState
+static const uint8_t ISMOVING = 1, ENDSTOP = 2, EMERCENCYSTOP = 4, HOMING = 8;
+
+// events, i.e. used in getEvents. M1..M4 are motion complete events of the motors
+static const uint8_t EVENT_ENDSTOP = 16, EVENT_EMS = 32, EVENT_QUEUEEMPTY = 64, EVENT_HOMED = 128;
+static const uint8_t NOEVENTPIN = 0xFF;
+
+// easing of servo moves
+static const uint8_t SERVO_LINEAR = 0, SERVO_EASEIN = 1, SERVO_EASEOUT = 2, SERVO_EASEINOUT = 3;
+
+// position triggers
+static const uint8_t MAXTRIGGER = 4;
+static const uint8_t TRIGGER_NONE = 0, TRIGGER_SERVO = 1, TRIGGER_ON = 2, TRIGGER_OFF = 3;
+
+// trace records, see setTrace
+static const uint8_t TRACE_STEP = 1, TRACE_MISSED = 2, TRACE_COMMAND = 4, TRACE_SERVO = 8;
+static const uint8_t TRACE_ALL = TRACE_STEP | TRACE_MISSED | TRACE_COMMAND | TRACE_SERVO;
+
+// opcodes per getCommandCounts
+static const uint8_t COMMANDCOUNTCHUNK = 16;
+
+// number of linear moves in the motion queue
+static const uint8_t MOTIONQUEUESIZE = 8;
+
+// number of samples in the stream buffer, samples sent in one I2C write
+static const uint8_t STREAMSIZE = 16;
+static const uint8_t STREAMFRAMESAMPLES = 3;
+
+// gears
+static const uint8_t Z10 = 10, Z12 = 12, Z15 = 15, Z20 = 20, Z30 = 30, Z40 = 40, Z58 = 58, WORMSCREW = 5;
+
+// state of the whole controller, see getSnapshot
+struct ftPwrDriveSnapshot {
+  uint8_t version;             // snapshot format version
+  uint8_t isMoving;            // mask of moving motors
+  uint8_t endStop;             // mask of motors with active end stop
+  uint8_t homing;              // mask of homing motors
+  bool    emergencyStop;       // EMS is active
+  bool    linearMove;          // a linear move is running
+  uint8_t queueFree;           // free slots in the motion queue
+  long    position[ MOTORS ];  // positions
+  long    stepsToGo[ MOTORS ]; // steps to go
+  long    speed[ MOTORS ];     // actual speed in steps/s
+  int     servo[ SERVOS ];     // servo positions
+};
+
+// record of the firmware trace buffer, see getTrace
+struct ftPwrDriveTrace {
+  uint8_t       type;          // TRACE_STEP, TRACE_MISSED, TRACE_COMMAND or TRACE_SERVO
+  uint8_t       data;          // stepped motors M1..M4, missed ticks, command or number of servo pulses
+  uint16_t      value;         // duration of the tick, command latency or duration of the servo frame in µs
+  unsigned long time;          // start of the traced event in µs of the firmware's clock
+};
+
+// bus statistics, see getBusStatistics
+struct ftPwrDriveBusStatistics {
+  long reads;                  // read requests served
+  long dropped;                // commands dropped, because the command FIFO was full
+  long oversized;              // v2 frames & batch chunks longer than 32 bytes, batches larger than 64 bytes
+  long malformed;              // empty writes, unknown commands
+  long watchdogTrips;          // motors stopped by the watchdog
+  long endStopStops;           // motors stopped by an end stop
+  long emsStops;               // motors stopped by EMS
+  long loopRate;               // main loop iterations/s, the rate commands are executed at
+};
+
+class ftPwrDrive {
+  public:
+
+    ftPwrDrive( ftPwrDriveBus &bus, uint8_t myI2CAddress = 32 );
+      // constructor, all devices on one bus share the bus object. Negotiates protocol v2 with the device,
+      // call setProtocol again for a device powered on later.
+
+    void Watchdog( long w );
+      // set watchog timer
+
+    void setMicrostepMode( uint8_t mode );
+      // set microstep mode
+      // FULLSTEP, HALFSTEP, QUARTERSTEP, EIGTHSTEP, SIXTEENTHSTEP
+
+    uint8_t getMicrostepMode( void );
+      // get microstep mode
+      // FULLSTEP, HALFSTEP, QUARTERSTEP, EIGTHSTEP, SIXTEENTHSTEP
+
+    void setRelDistance( uint8_t motor, long distance );
+      // set a distance to go, relative to actual position
+
+    void setRelDistanceAll( long d1, long d2, long d3, long d4 );
+      // set a absolute distance to go for all motors
+
+    void setAbsDistance( uint8_t motor, long distance );
+      // set a absolute distance to go
+
+    void setAbsDistanceAll( long d1, long d2, long d3, long d4 );
+      // set a absolute distance to go for all motors
+
+    long getStepsToGo( uint8_t motor );
+    std::future<long> getStepsToGoAsync( uint8_t motor );
+      // number of needed steps to go to distance
+
+    void setMaxSpeed( uint8_t motor, long speed );
+      // set a max speed
+
+    long getMaxSpeed( uint8_t motor);
+      // get max speed
+
+    float getEffectiveSpeed( uint8_t motor );
+      // get the effective max speed in steps/s, the firmware reproduces it exactly on average
+      // speeds are limited to 0..10000 steps/s
+
+    void startMoving( uint8_t motor, bool disableOnStop = true );
+      // start motor moving, disableOnStop disables the motor driver at the end of the movement
+
+    void startMovingAll( uint8_t maskMotor, uint8_t maskDisableOnStop = M1|M2|M3|M4 );
+      // same as StartMoving, but using uint8_t masks
+
+    void stopMoving( uint8_t motor );
+      // stop motor moving immediately
+
+    void stopMovingAll( uint8_t maskMotor = M1|M2|M3|M4 );
+      // same as stopMoving, but using uint8_t masks
+
+    bool isMoving( uint8_t motor );
+      // check, if a motor is moving
+
+    uint8_t isMovingAll( void );
+    std::future<uint8_t> isMovingAllAsync( void );
+      // return value is uint8_tmask, flag 1 is motor#1, flag2 is motor#2, ...
+
+    void wait( uint8_t motor_mask, uint16_t interval = 100 );
+      // wait until all motors in motor_mask completed their work
+
+    uint8_t getState( uint8_t motor );
+    std::future<uint8_t> getStateAsync( uint8_t motor );
+      // 8754321  - flag 1 motor is running, flag 2 endstop, flag 3 EMS, flag 4 homing
+
+    bool endStopActive( uint8_t motor );
+      // check, if end stop is pressed
+
+    bool emergencyStopActive( void );
+      // check, if emergeny stop is pressed
+
+    void setPosition( uint8_t motor, long position );
+      // set position
+
+    void setPositionAll( long p1, long p2, long p3, long p4 );
+      // set position of all motors
+
+    long getPosition( uint8_t motor );
+    std::future<long> getPositionAsync( uint8_t motor );
+      // get position
+
+    void getPositionAll( long &p1, long &p2, long &p3, long &p4 );
+      // get position of all motors
+
+    void setAcceleration( uint8_t motor, long acceleration );
+      // set acceleration in steps/s², 0 runs without ramps
+
+    void setAccelerationAll( long a1, long a2, long a3, long a4 );
+      // set accelerationof all motors
+
+    long getAcceleration( uint8_t motor );
+      // get acceleration
+
+    void getAccelerationAll( long &a1, long &a2, long &a3, long &a4 );
+      // get acceleration of all motors
+
+    void setServo( uint8_t servo, long position );
+      // set servo position
+
+    long getServo( uint8_t servo );
+      // get servo position
+
+    void setServoAll( long p1, long p2, long p3, long p4 );
+      // set all servos positions
+
+    void getServoAll( long &p1, long &p2, long &p3, long &p4 );
+      // get all servo positions
+
+    void setServoOffset( uint8_t servo, long offset );
+      // set servo offset
+
+    long getServoOffset( uint8_t servo );
+      // get servo offset
+
+    void setServoOffsetAll( long o1, long o2, long o3, long o4 );
+      // set servo offset all
+
+    void getServoOffsetAll( long &o1, long &o2, long &o3, long &o4 );
+      // get all servo offset
+
+    void setServoOnOff( uint8_t servo, bool on );
+      // set servo pin On or Off without PWM
+
+    void moveServo( uint8_t servo, long position, long speed, uint8_t easing = SERVO_LINEAR );
+      // move a servo to position with speed units/s, the firmware steps the move every 20ms servo frame.
+      // easing: SERVO_LINEAR, SERVO_EASEIN, SERVO_EASEOUT or SERVO_EASEINOUT. setServo cancels a move.
+
+    void moveServoTimed( uint8_t servo, long position, long duration, uint8_t easing = SERVO_LINEAR );
+      // move a servo to position in duration ms
+
+    void moveServoAll( long p1, long p2, long p3, long p4, long duration, uint8_t easing = SERVO_LINEAR );
+      // move all servos in duration ms, they start in the same frame and finish together
+
+    uint8_t getServoMoving( void );
+      // mask of moving servos, bit 0..3 = S1..S4
+
+    void homing( uint8_t motor, long maxDistance, bool disableOnStop = true );
+      // homing of motor using end stop: fast seek, back off, slow re-approach, slow release, homingOffset
+
+    void homingAll( long d1, long d2, long d3, long d4, uint8_t disableOnStopMask = M1 | M2 | M3 | M4 );
+      // homing of all motors with distance != 0 in parallel. EVENT_HOMED is latched, if all of them are done
+
+    void setHomingSpeed( uint8_t motor, long fast, long slow );
+      // homing speeds in steps/s for seeking and re-approaching the end stop, 0 = maxSpeed and maxSpeed/10
+
+    bool isHoming( uint8_t motor );
+      // check, homing is active
+
+    void homingOffset( uint8_t motor, long offset );
+      // set Offset to run in homing, after endstop is free again
+
+    float setGearFactor( uint8_t motor, long gear1, long gear2 );
+      // Sets the gear factor. Please read setRelDistanceR for details.
+
+    float setGearFactor( uint8_t motor, float gear1, float gear2 );
+      // Sets the gear factor. Please read setRelDistanceR for details.
+
+    void setRelDistanceR( uint8_t motor, float distance );
+      // Sets the relative distance in R - real units, see the ftDuino library for examples.
+
+    void setAbsDistanceR( uint8_t motor, float distance );
+      // Sets the absolute distance in R - real units. Please read setRelDistanceR for details.
+
+    void setInSync( uint8_t motor1, uint8_t motor2, bool OnOff );
+      // set two motors running in sync
+
+    void setGearing( uint8_t follower, uint8_t leader, long numerator, long denominator = 1 );
+      // electronic gearing: follower runs numerator/denominator steps per step of leader, a negative
+      // numerator reverses the direction, |numerator| > denominator is ignored. setGearing( follower, 0, 0 ) disengages.
+
+    void stream( uint16_t ticks, int s1, int s2, int s3, int s4 );
+      // add a sample to the stream: steps of M1..M4, spread evenly over ticks stepper ticks (100µs, max. 32767).
+      // Samples are collected and sent with STREAMFRAMESAMPLES (protocol v2: 2) in one write, flushStream sends the rest.
+
+    void flushStream( void );
+      // send all collected samples
+
+    void startStream( uint8_t motorMask, uint8_t lowWater = 4, bool disableOnStop = true );
+      // run the stream buffer on all motors in motorMask, EVENT_QUEUEEMPTY is latched, if only lowWater samples are left
+
+    void stopStream( void );
+      // stop all streaming motors at once and discard all samples
+
+    uint8_t getStreamFree( void );
+    std::future<uint8_t> getStreamFreeAsync( void );
+      // number of free slots in the stream buffer, STREAMSIZE if it's empty
+
+    void setTrigger( uint8_t trigger, uint8_t motor, long position, uint8_t action, uint8_t servo, long value = 0 );
+      // arm position trigger 0..MAXTRIGGER-1, see the ftDuino library. TRIGGER_NONE disarms it.
+
+    uint8_t getTriggers( void );
+      // mask of armed triggers, bit 0 = trigger 0
+
+    void moveLinear( long d1, long d2, long d3, long d4, long feedrate, bool disableOnStop = true );
+      // coordinated relative move of all motors on a straight line: all motors start and stop together.
+      // feedrate is the speed of the longest axis in steps/s, it is reduced if a motor would exceed its maxSpeed.
+
+    void queueLinear( long d1, long d2, long d3, long d4, long feedrate, bool disableOnStop = true );
+      // same as moveLinear, but the move is added to the motion queue. The move is ignored, if the queue is full.
+
+    void flushQueue( void );
+      // discard all queued moves, the running move isn't stopped
+
+    uint8_t getQueueFree( void );
+    std::future<uint8_t> getQueueFreeAsync( void );
+      // number of free slots in the motion queue, MOTIONQUEUESIZE if it's empty
+
+    void waitQueue( uint16_t interval = 100 );
+      // wait until all queued moves are done
+
+    bool getSnapshot( ftPwrDriveSnapshot &snapshot );
+      // get the state of all motors and servos in one snapshot, all values are taken in the same stepper tick.
+      // Arrays are indexed 0..3 for M1..M4 and S1..S4. Returns false, if the firmware sends an unknown format.
+
+    void setEventMask( uint8_t mask, uint8_t servo = NOEVENTPIN );
+      // events are latched until getEvents is called, the servo output S1..S4 is used as event pin
+
+    uint8_t getEvents( void );
+    std::future<uint8_t> getEventsAsync( void );
+      // get the latched events and clear them
+
+    uint8_t waitEvent( uint8_t mask, uint16_t interval, unsigned long timeout );
+      // poll the event register every interval ms until an event in mask is latched.
+      // Returns the latched events or 0 after timeout ms, 0 waits forever.
+
+    void beginBatch( void );
+      // collect all following commands in a batch, nothing is sent until commitBatch.
+      // Don't use functions returning values inside a batch.
+
+    void commitBatch( void );
+      // send the batch, the commands are executed back-to-back without any other command in between.
+
+    void setTimerStatistics( bool on );
+      // start/stop measuring the stepper timer, starting resets all values
+
+    void getTimerStatistics( long &rate, long &nominalRate, long &worstDuration, long &avgDuration );
+      // get achieved and nominal stepper timer ticks/s, worst and average duration of a tick in µs
+
+    void setTrace( uint8_t flags = TRACE_ALL );
+      // start tracing the records in flags, 0 stops. The firmware needs to be compiled with TRACEBUFFER.
+
+    uint8_t getTrace( ftPwrDriveTrace records[], uint8_t maxRecords );
+      // read up to maxRecords records and remove them from the trace buffer, returns the number of records read
+
+    void getTraceStatistics( long &missedTicks, long &worstLatency, long &avgLatency, long &lostRecords );
+      // get missed stepper ticks, worst and average command latency in µs and the records lost
+
+    void getBusStatistics( ftPwrDriveBusStatistics &statistics );
+      // get the counters of the bus & command handling since power on or resetBusStatistics
+
+    void getCommandCounts( uint8_t first, uint16_t counts[ COMMANDCOUNTCHUNK ] );
+      // get the number of received commands of opcode first..first+15, counts wrap around at 65535
+
+    void resetBusStatistics( void );
+      // reset all bus statistics
+
+    uint8_t setProtocol( uint8_t version = 2 );
+      // negotiate the protocol with the device. Returns the version used: the lower one of
+      // version and the highest version of the firmware. Commands get up to 28 bytes in protocol v2.
+      // setProtocol( 1 ) forces protocol v1: a getter sent while the device is still busy with earlier
+      // commands reads the reply before, v2 waits for the right one.
+
+    uint8_t getProtocol( void );
+      // protocol version in use
+
+    void getProtocolStatistics( long &retries, long &errors );
+      // protocol v2 frames sent or read again and failed transfers, counted for all devices on the bus
+
+    void sync( void );
+      // wait until all commands sent before reached the device
+
+  private:
+
+    ftPwrDriveBus &bus;
+
+    uint8_t i2cAddress = 32;
+
+    float gearFactor[ MOTORS ] = { 1,1,1,1 };
+
+    uint8_t motorIndex( uint8_t motor );
+     // returns the index (0..3) of a motor
+
+    template <typename... T> void sendData( uint8_t cmd, T... v );
+      // send a command, while batching it's appended to the batch
+
+    template <typename... T> std::future<ftPwrDriveReply> queryData( uint8_t replyBytes, uint8_t cmd, T... v );
+      // queue a getter and its reply of replyBytes bytes
+
+    void sendBatch( void );
+      // send a chunk of the batch
+
+    bool    batching = false;
+    uint8_t batch[32];
+    uint8_t batchLen = 0;
+      // commands collected between beginBatch and commitBatch
+
+    uint8_t streamFrame[ 2 + STREAMFRAMESAMPLES * 10 ];
+    uint8_t streamSamples = 0;
+      // samples collected by stream, not sent yet
+
+};
+
+#endif
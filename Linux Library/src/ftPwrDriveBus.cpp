@@ -0,0 +1,361 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// I2C bus with a background I/O thread, shared by all ftPwrDrive on the bus
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#include "ftPwrDriveBus.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// requests of the I/O thread
+#define REQUEST_SEND     0
+#define REQUEST_QUERY    1
+#define REQUEST_SYNC     2
+#define REQUEST_PROTOCOL 3
+
+// protocol v2 frames, see ftPwrDriveFW.ino
+//   write: FRAME2, len, seq, cmd[len], crc of the whole frame
+//   read:  status, seq, len, crc of the header, data[len], crc of the whole frame
+#define CMD_GETREPLY    68
+#define FRAME2          0xF2
+#define FRAME2MAXCMD    28
+#define FRAME2MAXDATA   27
+#define FRAME2RETRIES   5
+#define STATUS_OK       0
+#define STATUS_PENDING  1
+#define STATUS_BUSY     4
+
+static uint8_t crc8( uint8_t crc, const uint8_t *data, uint8_t len ) {
+  // CRC-8 with polynomial x^8 + x^2 + x + 1
+
+  while ( len-- ) {
+    crc ^= *data++;
+    for (uint8_t i=0; i<8; i++ ) {
+      crc = ( crc & 0x80 ) ? ( crc << 1 ) ^ 0x07 : crc << 1;
+    }
+  }
+
+  return crc;
+}
+
+ftPwrDriveBus::ftPwrDriveBus( i2cTransport &transport ) : transport( transport ) {
+  // constructor, starts the I/O thread
+
+  for (uint8_t i=0; i<128; i++ ) {
+    protocol[i].store( 1 );
+  }
+
+  io = std::thread( &ftPwrDriveBus::run, this );
+}
+
+ftPwrDriveBus::~ftPwrDriveBus( void ) {
+  // sends all queued commands and stops the I/O thread
+
+  running = false;
+  {
+    std::lock_guard<std::mutex> lock( sleepLock );
+    wakeup.notify_one();
+  }
+  io.join();
+}
+
+void ftPwrDriveBus::send( uint8_t address, const uint8_t *cmd, uint8_t bytes ) {
+  // queue a command and return at once
+
+  request *r = new request;
+  r->kind    = REQUEST_SEND;
+  r->address = address;
+  r->bytes   = std::min( bytes, (uint8_t) sizeof( r->cmd ) );
+  memcpy( r->cmd, cmd, r->bytes );
+
+  submit( r );
+}
+
+std::future<ftPwrDriveReply> ftPwrDriveBus::query( uint8_t address, const uint8_t *cmd, uint8_t bytes, uint8_t replyBytes ) {
+  // queue a getter, the future gets the reply
+
+  request *r    = new request;
+  r->kind       = REQUEST_QUERY;
+  r->address    = address;
+  r->bytes      = std::min( bytes, (uint8_t) sizeof( r->cmd ) );
+  r->replyBytes = replyBytes;
+  memcpy( r->cmd, cmd, r->bytes );
+
+  std::future<ftPwrDriveReply> reply = r->reply.get_future();
+  submit( r );
+  return reply;
+}
+
+void ftPwrDriveBus::sync( void ) {
+  // wait until all commands queued before are sent
+
+  request *r = new request;
+  r->kind    = REQUEST_SYNC;
+
+  std::future<ftPwrDriveReply> done = r->reply.get_future();
+  submit( r );
+  done.wait();
+}
+
+void ftPwrDriveBus::setProtocol( uint8_t address, uint8_t version ) {
+  // protocol version used with a device, queued like a command
+
+  request *r = new request;
+  r->kind    = REQUEST_PROTOCOL;
+  r->address = address;
+  r->bytes   = version;
+
+  submit( r );
+}
+
+uint8_t ftPwrDriveBus::getProtocol( uint8_t address ) {
+  // protocol version used with a device
+  return protocol[ address & 0x7F ].load();
+}
+
+uint8_t ftPwrDriveBus::maxCommand( uint8_t address ) {
+  // max. length of a command sent to a device
+  return ( getProtocol( address ) < 2 ) ? 32 : FRAME2MAXCMD;
+}
+
+void ftPwrDriveBus::submit( request *r ) {
+  // queue a request and wake up the I/O thread
+
+  while ( !queue.push( r ) ) {
+    // the I/O thread is behind, wait for a free slot
+    std::this_thread::yield();
+  }
+
+  // pairs with the fence in run: either the I/O thread sees the request or we see it sleeping
+  std::atomic_thread_fence( std::memory_order_seq_cst );
+  if ( sleeping.load() ) {
+    std::lock_guard<std::mutex> lock( sleepLock );
+    wakeup.notify_one();
+  }
+}
+
+void ftPwrDriveBus::run( void ) {
+  // I/O thread: execute all requests in order
+
+  request *r;
+
+  for (;;) {
+
+    if ( queue.pop( r ) ) {
+      execute( r );
+      continue;
+    }
+
+    if ( !running ) {
+      break;
+    }
+
+    std::unique_lock<std::mutex> lock( sleepLock );
+    sleeping = true;
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    wakeup.wait( lock, [this] { return !queue.empty() || !running; } );
+    sleeping = false;
+
+  }
+}
+
+void ftPwrDriveBus::execute( request *r ) {
+  // execute a request in the I/O thread
+
+  switch ( r->kind ) {
+
+    case REQUEST_SEND:
+      transmit( r->address, r->cmd, r->bytes );
+      break;
+
+    case REQUEST_QUERY: {
+      ftPwrDriveReply reply( r->replyBytes, 0 );
+      transceive( r->address, r->cmd, r->bytes, reply );
+      r->reply.set_value( reply );
+      break;
+    }
+
+    case REQUEST_SYNC:
+      r->reply.set_value( ftPwrDriveReply() );
+      break;
+
+    case REQUEST_PROTOCOL:
+      protocol[ r->address & 0x7F ].store( ( r->bytes >= 2 ) ? 2 : 1 );
+      break;
+
+  }
+
+  delete r;
+}
+
+void ftPwrDriveBus::transmit( uint8_t address, const uint8_t *cmd, uint8_t bytes ) {
+  // send a command, as v2 frame if the device talks protocol v2
+
+  if ( getProtocol( address ) < 2 ) {
+    if ( !transport.transfer( address, cmd, bytes, nullptr, 0 ) ) {
+      errors++;
+    }
+    return;
+  }
+
+  ftPwrDriveReply none;
+
+  buildFrame2( cmd, bytes );
+  if ( sendFrame2( address, 0, none ) < 0 ) {
+    errors++;
+  }
+}
+
+void ftPwrDriveBus::transceive( uint8_t address, const uint8_t *cmd, uint8_t bytes, ftPwrDriveReply &reply ) {
+  // send a getter and read its reply in one transaction, the device stretches the clock until the reply is ready
+
+  uint8_t quantity = reply.size();
+
+  if ( getProtocol( address ) < 2 ) {
+    if ( !transport.transfer( address, cmd, bytes, reply.data(), quantity ) ) {
+      std::fill( reply.begin(), reply.end(), 0 );
+      errors++;
+    }
+    return;
+  }
+
+  uint8_t part = std::min( quantity, (uint8_t) FRAME2MAXDATA );
+  int     got;
+
+  // the first part of the reply comes with the status, read the rest or a pending reply separately
+  buildFrame2( cmd, bytes );
+  got = sendFrame2( address, part, reply );
+  if ( got < 0 ) {
+    errors++;
+  } else if ( ( frame2Status == STATUS_PENDING ) || ( ( got == part ) && ( got < quantity ) ) ) {
+    receiveFrame2( address, reply, got );
+  }
+}
+
+void ftPwrDriveBus::buildFrame2( const uint8_t *cmd, uint8_t bytes ) {
+  // pack a command into frame2 with the next sequence number
+
+  bytes = std::min( bytes, (uint8_t) FRAME2MAXCMD );
+
+  frame2[0] = FRAME2;
+  frame2[1] = bytes;
+  frame2[2] = ++seq;
+  memcpy( &frame2[3], cmd, bytes );
+  frame2[ 3 + bytes ] = crc8( 0, frame2, 3 + bytes );
+  frame2Len = 4 + bytes;
+}
+
+int ftPwrDriveBus::sendFrame2( uint8_t address, uint8_t part, ftPwrDriveReply &reply ) {
+  // send frame2 until the device accepts it. Sending an accepted frame again is safe,
+  // the device executes a frame with the same sequence number & crc once.
+  // The status is read in the same transaction, with part > 0 the first part bytes of the reply, too.
+  // Returns the number of reply bytes received or -1, if the device didn't accept the frame.
+
+  uint8_t r[32];
+  uint8_t n = ( part > 0 ) ? 5 + part : 4;
+
+  for (uint8_t i=0; i<FRAME2RETRIES; i++ ) {
+
+    if ( i > 0 ) {
+      retries++;
+    }
+
+    if ( !transport.transfer( address, frame2, frame2Len, r, n ) ) {
+      continue;
+    }
+
+    if ( crc8( 0, r, 3 ) != r[3] ) {
+      continue;
+    }
+
+    // command FIFO full, give the device some time. Checked before the seq, older firmware
+    // answers a busy frame with the seq of the last accepted one
+    if ( r[0] == STATUS_BUSY ) {
+      std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+      continue;
+    }
+
+    if ( r[1] != seq ) {
+      continue;
+    }
+
+    frame2Status = r[0];
+
+    if ( ( r[0] == STATUS_PENDING ) || ( ( r[0] == STATUS_OK ) && ( part == 0 ) ) ) {
+      return 0;
+    }
+
+    if ( ( r[0] == STATUS_OK ) && ( r[2] <= part ) && ( crc8( 0, r, 4 + r[2] ) == r[ 4 + r[2] ] ) ) {
+      memcpy( reply.data(), &r[4], r[2] );
+      return r[2];
+    }
+
+  }
+
+  return -1;
+}
+
+void ftPwrDriveBus::receiveFrame2( uint8_t address, ftPwrDriveReply &reply, uint8_t offset ) {
+  // read the reply of the last v2 frame behind offset. Replies longer than FRAME2MAXDATA are read in parts,
+  // CMD_GETREPLY sets the offset of the next part and is sent in the same transaction as reading it.
+
+  uint8_t r[32];
+  uint8_t quantity = reply.size();
+
+  while ( offset < quantity ) {
+
+    uint8_t part = std::min( (uint8_t)( quantity - offset ), (uint8_t) FRAME2MAXDATA );
+    uint8_t i;
+
+    // same sequence number, it's still the reply of the last frame
+    uint8_t cmd[6] = { FRAME2, 2, seq, CMD_GETREPLY, offset, 0 };
+    cmd[5] = crc8( 0, cmd, 5 );
+
+    for (i=0; i<FRAME2RETRIES; i++ ) {
+
+      if ( i > 0 ) {
+        retries++;
+      }
+
+      // sending CMD_GETREPLY again is harmless
+      if ( !transport.transfer( address, cmd, ( offset > 0 ) ? 6 : 0, r, 5 + part ) ) {
+        continue;
+      }
+
+      if ( ( crc8( 0, r, 3 ) != r[3] ) || ( r[1] != seq ) || ( r[2] > part ) ) {
+        continue;
+      }
+
+      // the getter waits in the command FIFO of the device
+      if ( r[0] == STATUS_PENDING ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+        continue;
+      }
+
+      if ( ( r[0] == STATUS_OK ) && ( crc8( 0, r, 4 + r[2] ) == r[ 4 + r[2] ] ) ) {
+        break;
+      }
+
+    }
+
+    if ( i == FRAME2RETRIES ) {
+      errors++;
+      return;
+    }
+
+    memcpy( &reply[offset], &r[4], r[2] );
+    offset += r[2];
+
+    // the reply is shorter than expected
+    if ( r[2] < part ) {
+      return;
+    }
+
+  }
+}
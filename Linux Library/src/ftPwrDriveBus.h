@@ -0,0 +1,129 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// I2C bus with a background I/O thread, shared by all ftPwrDrive on the bus
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#ifndef ftPwrDriveBus_h
+#define ftPwrDriveBus_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "lockFreeQueue.h"
+
+// reply of a getter
+typedef std::vector<uint8_t> ftPwrDriveReply;
+
+class i2cTransport {
+  // access to the physical bus, see i2cDev and ftPwrDriveFake
+  public:
+
+    virtual ~i2cTransport( void ) {}
+
+    virtual bool transfer( uint8_t address, const uint8_t *write, uint8_t writeBytes, uint8_t *read, uint8_t readBytes ) = 0;
+      // write writeBytes and read readBytes in one transaction, the read follows the write with a repeated start.
+      // writeBytes or readBytes may be 0. Returns false, if the device didn't acknowledge.
+};
+
+class ftPwrDriveBus {
+  public:
+
+    ftPwrDriveBus( i2cTransport &transport );
+      // constructor, starts the I/O thread. All transfers of all devices on the bus are done in this thread.
+
+    ~ftPwrDriveBus( void );
+      // sends all queued commands and stops the I/O thread
+
+    void send( uint8_t address, const uint8_t *cmd, uint8_t bytes );
+      // queue a command and return at once. Commands are sent in the order they are queued, from all threads.
+
+    std::future<ftPwrDriveReply> query( uint8_t address, const uint8_t *cmd, uint8_t bytes, uint8_t replyBytes );
+      // queue a getter, the future gets the reply of replyBytes bytes. Bytes the device didn't send are 0.
+
+    void sync( void );
+      // wait until all commands queued before are sent
+
+    void setProtocol( uint8_t address, uint8_t version );
+      // protocol version used with a device, 1 or 2. It's queued, commands queued before use the old version.
+
+    uint8_t getProtocol( uint8_t address );
+      // protocol version used with a device
+
+    uint8_t maxCommand( uint8_t address );
+      // max. length of a command sent to a device
+
+    std::atomic<unsigned long> retries { 0 };
+      // protocol v2 frames sent or read again
+
+    std::atomic<unsigned long> errors { 0 };
+      // transfers not acknowledged, protocol v2 frames failed after all retries
+
+  private:
+
+    struct request {
+      uint8_t kind;
+      uint8_t address;
+      uint8_t cmd[32];
+      uint8_t bytes;
+      uint8_t replyBytes;
+      std::promise<ftPwrDriveReply> reply;
+    };
+
+    void submit( request *r );
+      // queue a request and wake up the I/O thread, waits while the queue is full
+
+    void run( void );
+      // I/O thread: execute all requests in order, sleep while there are none
+
+    void execute( request *r );
+      // execute a request in the I/O thread
+
+    void transmit( uint8_t address, const uint8_t *cmd, uint8_t bytes );
+      // send a command, as v2 frame if the device talks protocol v2
+
+    void transceive( uint8_t address, const uint8_t *cmd, uint8_t bytes, ftPwrDriveReply &reply );
+      // send a getter and read its reply in one transaction
+
+    void buildFrame2( const uint8_t *cmd, uint8_t bytes );
+      // pack a command into frame2 with the next sequence number
+
+    int sendFrame2( uint8_t address, uint8_t part, ftPwrDriveReply &reply );
+      // send frame2 until the device accepts it, read status & part bytes of the reply. Returns the bytes read or -1.
+
+    void receiveFrame2( uint8_t address, ftPwrDriveReply &reply, uint8_t offset );
+      // read the reply of the last v2 frame behind offset
+
+    i2cTransport &transport;
+
+    lockFreeQueue<request *, 256> queue;
+      // requests of all threads, only the I/O thread takes them
+
+    std::atomic<uint8_t> protocol[128];
+      // protocol version per address, changed by the I/O thread only
+
+    uint8_t frame2[32];
+    uint8_t frame2Len = 0;
+    uint8_t frame2Status = 0;
+    uint8_t seq = 0;
+      // last v2 frame, its sequence number and status, used by the I/O thread only
+
+    std::atomic<bool> running { true };
+    std::atomic<bool> sleeping { false };
+    std::mutex sleepLock;
+    std::condition_variable wakeup;
+      // the I/O thread sleeps while the queue is empty, submit only locks to wake it up
+
+    std::thread io;
+
+};
+
+#endif
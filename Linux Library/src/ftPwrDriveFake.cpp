@@ -0,0 +1,544 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// In-process fake of ftPwrDrive devices
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#include "ftPwrDriveFake.h"
+#include <algorithm>
+#include <cstring>
+
+// commands, see ftPwrDriveFW.ino
+#define CMD_SETWATCHDOG         0
+#define CMD_SETMICROSTEPMODE    1
+#define CMD_GETMICROSTEPMODE    2
+#define CMD_SETRELDISTANCE      3
+#define CMD_SETABSDISTANCE      5
+#define CMD_GETSTEPSTOGO        7
+#define CMD_SETMAXSPEED         8
+#define CMD_GETMAXSPEED         9
+#define CMD_STARTMOVING        10
+#define CMD_STARTMOVINGALL     11
+#define CMD_ISMOVING           12
+#define CMD_ISMOVINGALL        13
+#define CMD_GETSTATE           14
+#define CMD_SETPOSITION        15
+#define CMD_SETPOSITIONALL     16
+#define CMD_GETPOSITION        17
+#define CMD_GETPOSITIONALL     18
+#define CMD_SETACCELERATION    19
+#define CMD_GETACCELERATION    20
+#define CMD_SETACCELERATIONALL 21
+#define CMD_GETACCELERATIONALL 22
+#define CMD_SETSERVO           23
+#define CMD_GETSERVO           24
+#define CMD_SETSERVOALL        25
+#define CMD_GETSERVOALL        26
+#define CMD_SETSERVOOFFSET     27
+#define CMD_GETSERVOOFFSET     28
+#define CMD_SETSERVOOFFSETALL  29
+#define CMD_GETSERVOOFFSETALL  30
+#define CMD_SETSERVOONOFF      31
+#define CMD_HOMING             32
+#define CMD_STOPMOVING         33
+#define CMD_STOPMOVINGALL      34
+#define CMD_SETINSYNC          35
+#define CMD_HOMINGOFFSET       36
+#define CMD_SETTIMERSTATISTICS 37
+#define CMD_GETTIMERSTATISTICS 38
+#define CMD_MOVELINEAR         39
+#define CMD_QUEUELINEAR        40
+#define CMD_FLUSHQUEUE         41
+#define CMD_GETQUEUEFREE       42
+#define CMD_GETSNAPSHOT        43
+#define CMD_SETEVENTMASK       44
+#define CMD_GETEVENTS          45
+#define CMD_BATCH              46
+#define CMD_GETEFFECTIVESPEED  47
+#define CMD_MOVESERVO          48
+#define CMD_MOVESERVOTIMED     49
+#define CMD_MOVESERVOALL       50
+#define CMD_GETSERVOMOVING     51
+#define CMD_SETGEARING         52
+#define CMD_SETHOMINGSPEED     53
+#define CMD_HOMINGALL          54
+#define CMD_SETTRIGGER         55
+#define CMD_GETTRIGGERS        56
+#define CMD_STREAM             57
+#define CMD_STARTSTREAM        58
+#define CMD_STOPSTREAM         59
+#define CMD_GETSTREAMFREE      60
+#define CMD_SETTRACE           61
+#define CMD_GETTRACE           62
+#define CMD_GETTRACESTATISTICS 63
+#define CMD_GETBUSSTATISTICS   64
+#define CMD_GETCOMMANDCOUNTS   65
+#define CMD_RESETBUSSTATISTICS 66
+#define CMD_GETPROTOCOL        67
+#define CMD_GETREPLY           68
+#define CMDCOUNTERS            72
+
+#define BATCH_BEGIN            1
+#define BATCH_COMMIT           2
+
+#define EVENT_QUEUEEMPTY       64
+#define EVENT_HOMED            128
+
+#define FRAME2                 0xF2
+#define FRAME2MAXDATA          27
+#define STATUS_OK              0
+#define STATUS_CRC             2
+#define STATUS_LENGTH          3
+#define STATUS_BUSY            4
+
+static uint8_t crc8( uint8_t crc, const uint8_t *data, uint8_t len ) {
+  // CRC-8 with polynomial x^8 + x^2 + x + 1
+
+  while ( len-- ) {
+    crc ^= *data++;
+    for (uint8_t i=0; i<8; i++ ) {
+      crc = ( crc & 0x80 ) ? ( crc << 1 ) ^ 0x07 : crc << 1;
+    }
+  }
+
+  return crc;
+}
+
+static long getLong( const uint8_t *p ) {
+  // long of the firmware, 4 bytes little endian
+  return (int32_t)( p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t) p[3] << 24 ) );
+}
+
+static void putLong( uint8_t *p, long v ) {
+  // long of the firmware, 4 bytes little endian
+  for (uint8_t i=0; i<4; i++ ) {
+    p[i] = ( v >> ( i * 8 ) ) & 0xFF;
+  }
+}
+
+static uint8_t motorIndex( uint8_t motor ) {
+  // index 0..3 of motor M1..M4
+  switch ( motor ) {
+    case 2:  return 1;
+    case 4:  return 2;
+    case 8:  return 3;
+    default: return 0;
+  }
+}
+
+void ftPwrDriveFake::addDevice( uint8_t address, uint8_t protocol ) {
+  // add a device at address
+
+  std::lock_guard<std::mutex> guard( lock );
+  devices[ address ] = device();
+  devices[ address ].protocol = protocol;
+}
+
+void ftPwrDriveFake::setFaults( unsigned int every ) {
+  // corrupt every n-th protocol v2 transfer or answer it busy
+
+  std::lock_guard<std::mutex> guard( lock );
+  faults = every;
+}
+
+long ftPwrDriveFake::getPosition( uint8_t address, uint8_t motor ) {
+  // position of motor M1..M4 of a device
+
+  std::lock_guard<std::mutex> guard( lock );
+  return devices[ address ].position[ motorIndex( motor ) ];
+}
+
+unsigned long ftPwrDriveFake::getTransfers( void ) {
+  // number of transfers of all devices
+
+  std::lock_guard<std::mutex> guard( lock );
+  return transfers;
+}
+
+bool ftPwrDriveFake::transfer( uint8_t address, const uint8_t *write, uint8_t writeBytes, uint8_t *read, uint8_t readBytes ) {
+  // transfer like a device on the bus
+
+  std::lock_guard<std::mutex> guard( lock );
+
+  auto it = devices.find( address );
+  if ( it == devices.end() ) {
+    return false;
+  }
+
+  device &d = it->second;
+  uint8_t frame[64];
+  bool    corruptRead = false;
+  bool    busy = false;
+
+  transfers++;
+
+  // fault injection in turn: the write is corrupted, the read is corrupted, the command FIFO is full
+  memcpy( frame, write, std::min( writeBytes, (uint8_t) sizeof( frame ) ) );
+  if ( ( faults > 0 ) && ( ( d.frame2 ) || ( ( writeBytes > 0 ) && ( write[0] == FRAME2 ) ) ) && ( ++v2Transfers % faults == 0 ) ) {
+    unsigned int fault = ( v2Transfers / faults ) % 3;
+    if ( ( fault == 0 ) && ( writeBytes > 1 ) ) {
+      frame[ writeBytes / 2 ] ^= 0x10;
+    } else if ( ( fault == 2 ) && ( writeBytes > 4 ) && ( write[0] == FRAME2 ) && ( write[3] != CMD_GETREPLY ) ) {
+      busy = true;
+    } else {
+      corruptRead = ( readBytes > 0 );
+    }
+  }
+
+  if ( busy ) {
+    // the frame is discarded, the status carries its seq like the firmware
+    d.frame2 = true;
+    d.seq    = frame[2];
+    d.status = STATUS_BUSY;
+  } else if ( writeBytes > 0 ) {
+    receive( d, frame, writeBytes );
+  }
+
+  if ( readBytes > 0 ) {
+    request( d, read, readBytes );
+    if ( corruptRead ) {
+      read[ readBytes - 1 ] ^= 0x01;
+    }
+  }
+
+  return true;
+}
+
+void ftPwrDriveFake::receive( device &d, const uint8_t *frame, uint8_t bytes ) {
+  // a write to the device
+
+  if ( ( frame[0] != FRAME2 ) || ( d.protocol < 2 ) ) {
+    // a v1 host or a host negotiating the protocol, forget the last v2 frame
+    d.frame2   = false;
+    d.accepted = false;
+    d.status   = 0xFF;
+    execute( d, frame, bytes );
+    return;
+  }
+
+  d.frame2 = true;
+  d.seq    = ( bytes > 2 ) ? frame[2] : 0;
+
+  if ( ( bytes < 5 ) || ( frame[1] + 4 != bytes ) ) {
+    d.status = STATUS_LENGTH;
+    return;
+  }
+
+  if ( crc8( 0, frame, bytes - 1 ) != frame[ bytes - 1 ] ) {
+    d.status = STATUS_CRC;
+    return;
+  }
+
+  d.status = STATUS_OK;
+
+  // the next part of the last reply
+  if ( ( frame[3] == CMD_GETREPLY ) && ( frame[1] == 2 ) ) {
+    d.offset = frame[4];
+    d.getter = true;
+    return;
+  }
+
+  // a retry of the accepted frame is executed once
+  if ( d.accepted && ( d.seq == d.lastSeq ) && ( frame[ bytes - 1 ] == d.lastCrc ) ) {
+    return;
+  }
+
+  d.accepted = true;
+  d.lastSeq  = d.seq;
+  d.lastCrc  = frame[ bytes - 1 ];
+  d.offset   = 0;
+  d.getter   = execute( d, &frame[3], frame[1] );
+}
+
+void ftPwrDriveFake::request( device &d, uint8_t *read, uint8_t bytes ) {
+  // a read of the device
+
+  uint8_t frame[64];
+  uint8_t len = 0;
+
+  d.reads++;
+
+  // v1: the reply, the bus reads 0xFF behind it
+  if ( !d.frame2 ) {
+    memset( read, 0xFF, bytes );
+    memcpy( read, d.reply, std::min( bytes, d.replyBytes ) );
+    return;
+  }
+
+  if ( ( d.status == STATUS_OK ) && d.getter && ( d.replyBytes > d.offset ) ) {
+    len = std::min( d.replyBytes - d.offset, FRAME2MAXDATA );
+  }
+
+  frame[0] = d.status;
+  frame[1] = d.seq;
+  frame[2] = len;
+  frame[3] = crc8( 0, frame, 3 );
+  memcpy( &frame[4], &d.reply[ d.offset ], len );
+  frame[ 4 + len ] = crc8( 0, frame, 4 + len );
+
+  memset( read, 0xFF, bytes );
+  memcpy( read, frame, std::min( bytes, (uint8_t)( 5 + len ) ) );
+}
+
+void ftPwrDriveFake::move( device &d, uint8_t index ) {
+  // a motor runs its steps to go at once
+
+  if ( d.stepsToGo[ index ] != 0 ) {
+    d.position[ index ] += d.stepsToGo[ index ];
+    d.stepsToGo[ index ] = 0;
+  }
+  d.events |= 1 << index;
+}
+
+bool ftPwrDriveFake::execute( device &d, const uint8_t *cmd, uint8_t len ) {
+  // execute a command, returns true for getters
+
+  uint8_t *r = d.reply;
+  uint8_t  m = motorIndex( cmd[1] );
+  uint8_t  s = cmd[1] & 3;
+  uint8_t  i;
+
+  if ( len == 0 ) {
+    d.malformed++;
+    return false;
+  }
+
+  if ( cmd[0] < CMDCOUNTERS ) {
+    d.commands[ cmd[0] ]++;
+  }
+
+  switch ( cmd[0] ) {
+
+    case CMD_SETWATCHDOG:        d.watchdog = getLong( &cmd[1] ); return false;
+    case CMD_SETMICROSTEPMODE:   d.microstepMode = cmd[1]; return false;
+    case CMD_SETRELDISTANCE:     d.stepsToGo[m] = getLong( &cmd[2] ); return false;
+    case CMD_SETABSDISTANCE:     d.stepsToGo[m] = getLong( &cmd[2] ) - d.position[m]; return false;
+    case CMD_SETMAXSPEED:        d.maxSpeed[m] = getLong( &cmd[2] ); return false;
+    case CMD_STARTMOVING:        move( d, m ); return false;
+    case CMD_SETPOSITION:        d.position[m] = getLong( &cmd[2] ); return false;
+    case CMD_SETACCELERATION:    d.acceleration[m] = getLong( &cmd[2] ); return false;
+    case CMD_SETSERVO:           d.servo[s] = getLong( &cmd[2] ); return false;
+    case CMD_SETSERVOOFFSET:     d.servoOffset[s] = getLong( &cmd[2] ); return false;
+    case CMD_MOVESERVO:          d.servo[s] = getLong( &cmd[2] ); return false;
+    case CMD_MOVESERVOTIMED:     d.servo[s] = getLong( &cmd[2] ); return false;
+    case CMD_SETEVENTMASK:       d.eventMask = cmd[1]; return false;
+
+    case CMD_STARTMOVINGALL:
+      for (i=0; i<4; i++ ) {
+        if ( cmd[1] & ( 1 << i ) ) {
+          move( d, i );
+        }
+      }
+      return false;
+
+    case CMD_STOPMOVING:
+      d.stepsToGo[m] = 0;
+      return false;
+
+    case CMD_STOPMOVINGALL:
+      for (i=0; i<4; i++ ) {
+        if ( cmd[1] & ( 1 << i ) ) {
+          d.stepsToGo[i] = 0;
+        }
+      }
+      return false;
+
+    case CMD_SETPOSITIONALL:
+    case CMD_SETACCELERATIONALL:
+    case CMD_SETSERVOALL:
+    case CMD_SETSERVOOFFSETALL:
+    case CMD_MOVESERVOALL: {
+      long *v = ( cmd[0] == CMD_SETPOSITIONALL ) ? d.position : ( cmd[0] == CMD_SETACCELERATIONALL ) ? d.acceleration :
+                ( cmd[0] == CMD_SETSERVOOFFSETALL ) ? d.servoOffset : d.servo;
+      for (i=0; i<4; i++ ) {
+        v[i] = getLong( &cmd[ 1 + i * 4 ] );
+      }
+      return false;
+    }
+
+    case CMD_HOMING:
+      d.position[m]  = 0;
+      d.stepsToGo[m] = 0;
+      d.events |= ( 1 << m ) | EVENT_HOMED;
+      return false;
+
+    case CMD_HOMINGALL:
+      for (i=0; i<4; i++ ) {
+        if ( getLong( &cmd[ 1 + i * 4 ] ) != 0 ) {
+          d.position[i]  = 0;
+          d.stepsToGo[i] = 0;
+        }
+      }
+      d.events |= EVENT_HOMED;
+      return false;
+
+    case CMD_MOVELINEAR:
+    case CMD_QUEUELINEAR:
+      for (i=0; i<4; i++ ) {
+        d.stepsToGo[i] = getLong( &cmd[ 1 + i * 4 ] );
+        move( d, i );
+      }
+      d.events |= EVENT_QUEUEEMPTY;
+      return false;
+
+    case CMD_SETTRIGGER:
+      if ( cmd[3 + 4] != 0 ) {
+        d.triggers |= 1 << ( cmd[1] & 3 );
+      } else {
+        d.triggers &= ~( 1 << ( cmd[1] & 3 ) );
+      }
+      return false;
+
+    case CMD_STREAM:
+      for (i=0; ( i < cmd[1] ) && ( d.streamFree > 0 ); i++ ) {
+        for (uint8_t j=0; j<4; j++ ) {
+          d.stream[j] += (int16_t)( cmd[ 4 + i * 10 + j * 2 ] | ( cmd[ 5 + i * 10 + j * 2 ] << 8 ) );
+        }
+        d.streamFree--;
+      }
+      return false;
+
+    case CMD_STARTSTREAM:
+      for (i=0; i<4; i++ ) {
+        if ( cmd[1] & ( 1 << i ) ) {
+          d.position[i] += d.stream[i];
+        }
+        d.stream[i] = 0;
+      }
+      d.streamFree = 16;
+      d.events |= EVENT_QUEUEEMPTY;
+      return false;
+
+    case CMD_STOPSTREAM:
+      memset( d.stream, 0, sizeof( d.stream ) );
+      d.streamFree = 16;
+      return false;
+
+    case CMD_BATCH:
+      if ( cmd[1] & BATCH_BEGIN ) {
+        d.batchLen = 0;
+      }
+      if ( d.batchLen + len - 2 <= (int) sizeof( d.batch ) ) {
+        memcpy( &d.batch[ d.batchLen ], &cmd[2], len - 2 );
+        d.batchLen += len - 2;
+      }
+      if ( cmd[1] & BATCH_COMMIT ) {
+        for (i=0; i<d.batchLen; i+=1+d.batch[i] ) {
+          execute( d, &d.batch[ i + 1 ], d.batch[i] );
+        }
+        d.batchLen = 0;
+      }
+      return false;
+
+    case CMD_RESETBUSSTATISTICS:
+      d.reads     = 0;
+      d.malformed = 0;
+      memset( d.commands, 0, sizeof( d.commands ) );
+      return false;
+
+    case CMD_SETSERVOONOFF:
+    case CMD_SETINSYNC:
+    case CMD_HOMINGOFFSET:
+    case CMD_SETTIMERSTATISTICS:
+    case CMD_FLUSHQUEUE:
+    case CMD_SETGEARING:
+    case CMD_SETHOMINGSPEED:
+    case CMD_SETTRACE:
+      return false;
+
+    // getters
+    case CMD_GETMICROSTEPMODE:   r[0] = d.microstepMode; d.replyBytes = 1; return true;
+    case CMD_ISMOVING:           r[0] = 0; d.replyBytes = 1; return true;
+    case CMD_ISMOVINGALL:        r[0] = 0; d.replyBytes = 1; return true;
+    case CMD_GETSTATE:           r[0] = 0; d.replyBytes = 1; return true;
+    case CMD_GETSERVOMOVING:     r[0] = 0; d.replyBytes = 1; return true;
+    case CMD_GETQUEUEFREE:       r[0] = 8; d.replyBytes = 1; return true;
+    case CMD_GETTRIGGERS:        r[0] = d.triggers; d.replyBytes = 1; return true;
+    case CMD_GETSTREAMFREE:      r[0] = d.streamFree; d.replyBytes = 1; return true;
+    case CMD_GETEVENTS:          r[0] = d.events; d.events = 0; d.replyBytes = 1; return true;
+    case CMD_GETTRACE:           r[0] = 0; d.replyBytes = 1; return true;
+    case CMD_GETSTEPSTOGO:       putLong( r, d.stepsToGo[m] ); d.replyBytes = 4; return true;
+    case CMD_GETMAXSPEED:        putLong( r, d.maxSpeed[m] ); d.replyBytes = 4; return true;
+    case CMD_GETPOSITION:        putLong( r, d.position[m] ); d.replyBytes = 4; return true;
+    case CMD_GETACCELERATION:    putLong( r, d.acceleration[m] ); d.replyBytes = 4; return true;
+    case CMD_GETSERVO:           putLong( r, d.servo[s] ); d.replyBytes = 4; return true;
+    case CMD_GETSERVOOFFSET:     putLong( r, d.servoOffset[s] ); d.replyBytes = 4; return true;
+    case CMD_GETEFFECTIVESPEED:  putLong( r, d.maxSpeed[m] * 1000 ); d.replyBytes = 4; return true;
+
+    case CMD_GETPOSITIONALL:
+    case CMD_GETACCELERATIONALL:
+    case CMD_GETSERVOALL:
+    case CMD_GETSERVOOFFSETALL: {
+      long *v = ( cmd[0] == CMD_GETPOSITIONALL ) ? d.position : ( cmd[0] == CMD_GETACCELERATIONALL ) ? d.acceleration :
+                ( cmd[0] == CMD_GETSERVOOFFSETALL ) ? d.servoOffset : d.servo;
+      for (i=0; i<4; i++ ) {
+        putLong( &r[ i * 4 ], v[i] );
+      }
+      d.replyBytes = 16;
+      return true;
+    }
+
+    case CMD_GETTIMERSTATISTICS:
+      putLong( &r[0], 10000 );
+      putLong( &r[4], 10000 );
+      putLong( &r[8], 0 );
+      putLong( &r[12], 0 );
+      d.replyBytes = 16;
+      return true;
+
+    case CMD_GETTRACESTATISTICS:
+      memset( r, 0, 16 );
+      d.replyBytes = 16;
+      return true;
+
+    case CMD_GETSNAPSHOT: {
+      uint8_t snapshot[62] = { 1, 0, 0, 0, 0, 8 };
+      for (i=0; i<4; i++ ) {
+        putLong( &snapshot[ 6 + i * 4 ], d.position[i] );
+        putLong( &snapshot[ 22 + i * 4 ], d.stepsToGo[i] );
+        putLong( &snapshot[ 38 + i * 4 ], 0 );
+        snapshot[ 54 + i * 2 ] = d.servo[i] & 0xFF;
+        snapshot[ 55 + i * 2 ] = ( d.servo[i] >> 8 ) & 0xFF;
+      }
+      d.replyBytes = ( cmd[1] == 0 ) ? 32 : 30;
+      memcpy( r, &snapshot[ ( cmd[1] == 0 ) ? 0 : 32 ], d.replyBytes );
+      return true;
+    }
+
+    case CMD_GETBUSSTATISTICS:
+      memset( r, 0, 32 );
+      putLong( &r[0], d.reads );
+      putLong( &r[12], d.malformed );
+      d.replyBytes = 32;
+      return true;
+
+    case CMD_GETCOMMANDCOUNTS:
+      for (i=0; i<16; i++ ) {
+        uint16_t c = ( cmd[1] + i < CMDCOUNTERS ) ? d.commands[ cmd[1] + i ] : 0;
+        r[ i * 2 ]     = c & 0xFF;
+        r[ i * 2 + 1 ] = c >> 8;
+      }
+      d.replyBytes = 32;
+      return true;
+
+    case CMD_GETPROTOCOL:
+      // older firmware doesn't know the command
+      if ( d.protocol < 2 ) {
+        d.malformed++;
+        return false;
+      }
+      r[0] = d.protocol;
+      r[1] = ~d.protocol;
+      d.replyBytes = 2;
+      return true;
+
+    default:
+      d.malformed++;
+      return false;
+
+  }
+}
@@ -0,0 +1,102 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// In-process fake of ftPwrDrive devices, to run programs using the library
+// without hardware. It talks protocol v1 & v2 like the firmware, including
+// frame checks, retries, busy frames and long replies. Moves finish at once: the position
+// is at the target, when the next command arrives. Faults can be injected
+// into protocol v2 transfers to exercise the retries.
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#ifndef ftPwrDriveFake_h
+#define ftPwrDriveFake_h
+
+#include <map>
+#include <mutex>
+#include "ftPwrDriveBus.h"
+
+class ftPwrDriveFake : public i2cTransport {
+  public:
+
+    void addDevice( uint8_t address, uint8_t protocol = 2 );
+      // add a device at address, protocol is the highest version its firmware talks
+
+    bool transfer( uint8_t address, const uint8_t *write, uint8_t writeBytes, uint8_t *read, uint8_t readBytes ) override;
+      // transfer like a device on the bus, addresses without a device don't acknowledge
+
+    void setFaults( unsigned int every );
+      // corrupt every n-th protocol v2 transfer, in turn the write, the read or a full command FIFO. 0 = never.
+
+    long getPosition( uint8_t address, uint8_t motor );
+      // position of motor M1..M4 of a device, to check the commands reached it
+
+    unsigned long getTransfers( void );
+      // number of transfers of all devices
+
+  private:
+
+    struct device {
+      uint8_t protocol = 2;
+
+      // reply of the last getter
+      uint8_t reply[64];
+      uint8_t replyBytes = 0;
+
+      // protocol v2 state, see receiveFrame2 in ftPwrDriveFW.ino
+      bool    frame2 = false;
+      bool    accepted = false;
+      bool    getter = false;
+      uint8_t status = 0xFF;
+      uint8_t seq = 0;
+      uint8_t lastSeq = 0;
+      uint8_t lastCrc = 0;
+      uint8_t offset = 0;
+
+      // controller state
+      uint8_t  microstepMode = 0;
+      long     watchdog = 0;
+      long     position[4] = { 0 };
+      long     stepsToGo[4] = { 0 };
+      long     maxSpeed[4] = { 0 };
+      long     acceleration[4] = { 0 };
+      long     servo[4] = { 0 };
+      long     servoOffset[4] = { 0 };
+      long     stream[4] = { 0 };
+      uint8_t  streamFree = 16;
+      uint8_t  events = 0;
+      uint8_t  eventMask = 0;
+      uint8_t  triggers = 0;
+      uint8_t  batch[64];
+      uint8_t  batchLen = 0;
+      long     reads = 0;
+      long     malformed = 0;
+      uint16_t commands[72] = { 0 };
+    };
+
+    void receive( device &d, const uint8_t *frame, uint8_t bytes );
+      // a write to the device, v1 commands or v2 frames
+
+    void request( device &d, uint8_t *read, uint8_t bytes );
+      // a read of the device: the reply or the status frame
+
+    bool execute( device &d, const uint8_t *cmd, uint8_t len );
+      // execute a command, returns true for getters
+
+    void move( device &d, uint8_t index );
+      // a motor runs its steps to go at once
+
+    std::map<uint8_t, device> devices;
+    std::mutex lock;
+      // devices by address, the test program may look at them while the I/O thread transfers
+
+    unsigned int  faults = 0;
+    unsigned long v2Transfers = 0;
+    unsigned long transfers = 0;
+
+};
+
+#endif
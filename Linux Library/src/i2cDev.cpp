@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// I2C transport using the Linux i2c-dev driver
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#include "i2cDev.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+i2cDev::i2cDev( const std::string &device ) {
+  // constructor, opens the bus device
+
+  unsigned long funcs = 0;
+
+  fd = open( device.c_str(), O_RDWR );
+
+  // the adapter needs to support plain I2C messages, SMBus only adapters like i2c-stub don't
+  if ( ( fd >= 0 ) && ( ( ioctl( fd, I2C_FUNCS, &funcs ) < 0 ) || !( funcs & I2C_FUNC_I2C ) ) ) {
+    close( fd );
+    fd = -1;
+  }
+}
+
+i2cDev::~i2cDev( void ) {
+  // closes the bus device
+
+  if ( fd >= 0 ) {
+    close( fd );
+  }
+}
+
+bool i2cDev::isOpen( void ) {
+  // the bus device is open and supports plain I2C transfers
+  return fd >= 0;
+}
+
+bool i2cDev::transfer( uint8_t address, const uint8_t *write, uint8_t writeBytes, uint8_t *read, uint8_t readBytes ) {
+  // write & read with one I2C_RDWR ioctl
+
+  struct i2c_msg             msg[2];
+  struct i2c_rdwr_ioctl_data rdwr;
+
+  rdwr.msgs  = msg;
+  rdwr.nmsgs = 0;
+
+  if ( writeBytes > 0 ) {
+    msg[ rdwr.nmsgs ].addr  = address;
+    msg[ rdwr.nmsgs ].flags = 0;
+    msg[ rdwr.nmsgs ].len   = writeBytes;
+    msg[ rdwr.nmsgs ].buf   = (uint8_t *) write;
+    rdwr.nmsgs++;
+  }
+
+  if ( readBytes > 0 ) {
+    msg[ rdwr.nmsgs ].addr  = address;
+    msg[ rdwr.nmsgs ].flags = I2C_M_RD;
+    msg[ rdwr.nmsgs ].len   = readBytes;
+    msg[ rdwr.nmsgs ].buf   = read;
+    rdwr.nmsgs++;
+  }
+
+  if ( ( fd < 0 ) || ( rdwr.nmsgs == 0 ) ) {
+    return false;
+  }
+
+  return ioctl( fd, I2C_RDWR, &rdwr ) == (int) rdwr.nmsgs;
+}
@@ -0,0 +1,37 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// I2C transport using the Linux i2c-dev driver
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#ifndef i2cDev_h
+#define i2cDev_h
+
+#include <string>
+#include "ftPwrDriveBus.h"
+
+class i2cDev : public i2cTransport {
+  public:
+
+    i2cDev( const std::string &device = "/dev/i2c-1" );
+      // constructor, opens the bus device, e.g. /dev/i2c-1 on a Raspberry Pi. Check isOpen.
+
+    ~i2cDev( void );
+      // closes the bus device
+
+    bool isOpen( void );
+      // the bus device is open and supports plain I2C transfers
+
+    bool transfer( uint8_t address, const uint8_t *write, uint8_t writeBytes, uint8_t *read, uint8_t readBytes ) override;
+      // write & read with one I2C_RDWR ioctl, the read follows the write with a repeated start
+
+  private:
+    int fd = -1;
+
+};
+
+#endif
@@ -0,0 +1,102 @@
+////////////////////////////////////////////////////
+//
+// ftPwrDrive Linux Interface
+//
+// lock-free queue of the bus I/O thread
+//
+// (C) 2022 Christian Bergschneider & Stefan Fuss
+//
+///////////////////////////////////////////////////
+
+#ifndef lockFreeQueue_h
+#define lockFreeQueue_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+template <typename T, size_t SIZE> class lockFreeQueue {
+  // bounded queue for many producers and consumers, push and pop never block and never take a lock.
+  // Every cell carries a sequence number: it's free for the producer of round n if it equals the
+  // position, it's filled for the consumer if it equals position + 1.
+
+  static_assert( ( SIZE >= 2 ) && ( ( SIZE & ( SIZE - 1 ) ) == 0 ), "SIZE needs to be a power of 2" );
+
+  public:
+
+    lockFreeQueue( void ) {
+      for (size_t i=0; i<SIZE; i++ ) {
+        cell[i].seq.store( i, std::memory_order_relaxed );
+      }
+    }
+
+    bool push( const T &value ) {
+      // add value, returns false if the queue is full
+      size_t pos = head.load( std::memory_order_relaxed );
+
+      for (;;) {
+        cell_t  &c    = cell[ pos & ( SIZE - 1 ) ];
+        intptr_t diff = (intptr_t) c.seq.load( std::memory_order_acquire ) - (intptr_t) pos;
+
+        if ( diff == 0 ) {
+          // free, try to reserve it
+          if ( head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+            c.value = value;
+            c.seq.store( pos + 1, std::memory_order_release );
+            return true;
+          }
+        } else if ( diff < 0 ) {
+          // the consumer didn't take the value of the last round
+          return false;
+        } else {
+          // another producer was faster
+          pos = head.load( std::memory_order_relaxed );
+        }
+      }
+    }
+
+    bool pop( T &value ) {
+      // take the oldest value, returns false if the queue is empty
+      size_t pos = tail.load( std::memory_order_relaxed );
+
+      for (;;) {
+        cell_t  &c    = cell[ pos & ( SIZE - 1 ) ];
+        intptr_t diff = (intptr_t) c.seq.load( std::memory_order_acquire ) - (intptr_t)( pos + 1 );
+
+        if ( diff == 0 ) {
+          // filled, try to take it
+          if ( tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+            value = c.value;
+            c.seq.store( pos + SIZE, std::memory_order_release );
+            return true;
+          }
+        } else if ( diff < 0 ) {
+          // empty or the producer is still writing the value
+          return false;
+        } else {
+          // another consumer was faster
+          pos = tail.load( std::memory_order_relaxed );
+        }
+      }
+    }
+
+    bool empty( void ) const {
+      // no value reserved, a value being written counts as there
+      return head.load( std::memory_order_acquire ) == tail.load( std::memory_order_acquire );
+    }
+
+  private:
+
+    struct cell_t {
+      std::atomic<size_t> seq;
+      T                   value;
+    };
+
+    cell_t cell[ SIZE ];
+    alignas( 64 ) std::atomic<size_t> head { 0 };
+    alignas( 64 ) std::atomic<size_t> tail { 0 };
+      // next position to push & pop, on separate cache lines
+
+};
+
+#endif
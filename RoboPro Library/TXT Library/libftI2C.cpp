@@ -4,26 +4,225 @@
 //
 // Send and Receive complex I2C Cmds with less bugs with fischertechnik TX/TXT Controller
 //
-// Version 1.00
+// Version 1.10: protocol v2 with sequence numbers, CRC-8 and automatic retries
+// Version 1.11: I2CTransceive writes a command and reads its reply in one transfer (repeated start)
+// Version 1.12: protocol v2 is negotiated with the first transfer to a device
 //
 // (C) 2019 Christian Bergschneider & Stefan Fuss - elektrofuzzis
 //
 // compile to libftI2C.so and copy it as User ROBOPRO to /opt/knobloch
 //
+// The libftI2C.so and ftPwrDrive.rpp next to this file are still version 1.0x: they don't
+// export or call setProtocol, getProtocol, getRetries, getErrors and I2CTransceive yet.
+// Rebuild the .so with the TXT toolchain before adding these functions to the .rpp.
+//
 /////////////////////////////////////////////////////////////////////////////////////////
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <KeLibTxtDl.h>          // TXT Lib
 #include <FtShmem.h>             // TXT Transfer Area
 
-#define VERSION   1
+#define VERSION   3
 #define MAXBUFFER 255
 
+// protocol v2 frames, see ftPwrDriveFW.ino
+//   write: FRAME2, len, seq, cmd[len], crc of the whole frame
+//   read:  status, seq, len, crc of the header, data[len], crc of the whole frame
+#define CMD_GETPROTOCOL 67
+#define CMD_GETREPLY    68
+#define FRAME2          0xF2
+#define FRAME2MAXCMD    28
+#define FRAME2MAXDATA   27
+#define FRAME2RETRIES   5
+#define STATUS_OK       0
+#define STATUS_PENDING  1
+#define STATUS_BUSY     4
+
 uint8_t  buffer[MAXBUFFER];
 uint8_t  bufferPtr  = -1;
 uint16_t i2cAddress = 0x20; 
 uint16_t i2cSpeed   = I2C_SPEED_400_KHZ;
+uint8_t  protocol   = 0;     // 0 = not negotiated yet
+uint8_t  seq        = 0;
+short    retries    = 0;     // protocol v2 frames sent or read again
+short    errors     = 0;     // protocol v2 frames failed after all retries
+uint8_t  status2    = 0;     // status of the last v2 frame
+
+uint8_t crc8( uint8_t crc, const uint8_t *data, uint8_t len )
+// CRC-8 with polynomial x^8 + x^2 + x + 1
+{
+	while ( len-- ) {
+	  crc ^= *data++;
+	  for (uint8_t i=0; i<8; i++ ) {
+	    crc = ( crc & 0x80 ) ? ( crc << 1 ) ^ 0x07 : crc << 1;
+	  }
+	}
+
+	return crc;
+}
+
+int sendFrame2( uint8_t *frame, uint8_t len, uint8_t part )
+// sends a v2 frame until the device accepts it, the device executes a retry once.
+// The status and part bytes of the reply are read in the same transfer, a complete reply is
+// stored in buffer. Returns the number of bytes stored or -1.
+{
+	uint8_t r[32];
+	uint8_t n = ( part > 0 ) ? 5 + part : 4;
+
+	for (int i=0; i<FRAME2RETRIES; i++ ) {
+
+	  if ( i > 0 ) {
+	    retries++;
+	  }
+
+	  if ( KeLibI2cTransfer(i2cAddress, len, frame, n, r, i2cSpeed) != 0 ) {
+	    continue;
+	  }
+
+	  if ( crc8( 0, r, 3 ) != r[3] ) {
+	    continue;
+	  }
+
+	  // command FIFO full, give the device some time. Checked before the seq, older firmware
+	  // answers a busy frame with the seq of the last accepted one
+	  if ( r[0] == STATUS_BUSY ) {
+	    usleep( 1000 );
+	    continue;
+	  }
+
+	  if ( r[1] != frame[2] ) {
+	    continue;
+	  }
+
+	  status2 = r[0];
+
+	  if ( ( r[0] == STATUS_PENDING ) || ( ( r[0] == STATUS_OK ) && ( part == 0 ) ) ) {
+	    return 0;
+	  }
+
+	  if ( ( r[0] == STATUS_OK ) && ( r[2] <= part ) && ( crc8( 0, r, 4 + r[2] ) == r[ 4 + r[2] ] ) ) {
+	    memcpy( buffer, &r[4], r[2] );
+	    return r[2];
+	  }
+
+	}
+
+	errors++;
+	return -1;
+}
+
+int negotiate( short version )
+// asks the device in protocol v1 for its highest protocol version, every firmware understands it,
+// and uses the lower one of both. A device not answering is asked again with the next transfer.
+{
+	uint8_t cmd   = CMD_GETPROTOCOL;
+	uint8_t reply[2];
+
+	protocol = 1;
+	if ( version < 2 ) {
+	  return 0;
+	}
+
+	if ( KeLibI2cTransfer(i2cAddress, 1, &cmd, 2, reply, i2cSpeed) != 0 ) {
+	  protocol = 0;
+	  return -1;
+	}
+
+	// older firmware doesn't reply
+	if ( ( reply[1] == (uint8_t) ~reply[0] ) && ( reply[0] >= 2 ) ) {
+	  protocol = 2;
+	}
+
+	return 0;
+}
+
+uint8_t useProtocol( void )
+// the protocol used with the device, negotiated with the first transfer.
+// In v1 a getter sent while the device is busy with earlier commands reads the reply before.
+{
+	if ( protocol == 0 ) {
+	  negotiate( 2 );
+	}
+
+	return ( protocol == 0 ) ? 1 : protocol;
+}
+
+int buildFrame2( uint8_t *frame, uint8_t len )
+// packs the command of len bytes in buffer into a v2 frame, returns the frame length or -1
+{
+	if ( len > FRAME2MAXCMD ) {
+	  return -1;
+	}
+
+	frame[0] = FRAME2;
+	frame[1] = len;
+	frame[2] = ++seq;
+	memcpy( &frame[3], buffer, len );
+	frame[ 3 + len ] = crc8( 0, frame, 3 + len );
+
+	return 4 + len;
+}
+
+int receiveFrame2( uint8_t bytes, uint8_t offset )
+// reads the reply of the last v2 frame into buffer behind offset, long replies in parts
+{
+	uint8_t r[32];
+
+	while ( offset < bytes ) {
+
+	  uint8_t part = ( bytes - offset < FRAME2MAXDATA ) ? bytes - offset : FRAME2MAXDATA;
+	  int     i;
+
+	  // same sequence number, it's still the reply of the last frame
+	  uint8_t cmd[6] = { FRAME2, 2, seq, CMD_GETREPLY, offset, 0 };
+	  cmd[5] = crc8( 0, cmd, 5 );
+
+	  for (i=0; i<FRAME2RETRIES; i++ ) {
+
+	    if ( i > 0 ) {
+	      retries++;
+	    }
+
+	    // a further part is requested and read in one transfer, sending CMD_GETREPLY again is harmless
+	    if ( KeLibI2cTransfer(i2cAddress, ( offset > 0 ) ? 6 : 0, ( offset > 0 ) ? cmd : 0, 5 + part, r, i2cSpeed) != 0 ) {
+	      continue;
+	    }
+
+	    if ( ( crc8( 0, r, 3 ) != r[3] ) || ( r[1] != seq ) || ( r[2] > part ) ) {
+	      continue;
+	    }
+
+	    // the getter waits in the command FIFO of the device
+	    if ( r[0] == STATUS_PENDING ) {
+	      usleep( 1000 );
+	      continue;
+	    }
+
+	    if ( ( r[0] == STATUS_OK ) && ( crc8( 0, r, 4 + r[2] ) == r[ 4 + r[2] ] ) ) {
+	      break;
+	    }
+
+	  }
+
+	  if ( i == FRAME2RETRIES ) {
+	    errors++;
+	    return -1;
+	  }
+
+	  memcpy( &buffer[offset], &r[4], r[2] );
+	  offset += r[2];
+
+	  // the reply is shorter than expected
+	  if ( r[2] < part ) {
+	    break;
+	  }
+
+	}
+
+	return 0;
+}
 
 extern "C" {
 
@@ -40,6 +239,7 @@ extern "C" {
 	bufferPtr  = 0;
 	i2cAddress = 0x20;
 	i2cSpeed   = I2C_SPEED_400_KHZ;
+	protocol   = 0;
 	*t         = VERSION;
     return 0;
   }
@@ -48,6 +248,7 @@ extern "C" {
   // sets the I2CAddress
   {
 	  i2cAddress = address;
+	  protocol   = 0;      // another device, negotiate again
 	  
 	  return 0;
   }
@@ -76,6 +277,37 @@ extern "C" {
 	  return 0;
   }
   
+  int setProtocol(short version)
+  // negotiates the protocol with the device: uses the lower one of version and the highest version of the firmware.
+  // Version 1 forces protocol v1, without it v2 is negotiated with the first transfer.
+  {
+	  return negotiate( version );
+  }
+
+  int getProtocol(short *version)
+  // gets the protocol version in use
+  {
+	  *version = useProtocol();
+
+	  return 0;
+  }
+
+  int getRetries(short *v)
+  // gets the number of protocol v2 frames sent or read again
+  {
+	  *v = retries;
+
+	  return 0;
+  }
+
+  int getErrors(short *v)
+  // gets the number of protocol v2 frames failed after all retries
+  {
+	  *v = errors;
+
+	  return 0;
+  }
+
   int setBufferPointer(short ptr)
   // sets the bufferPtr
   {
@@ -164,13 +396,67 @@ extern "C" {
 
   int I2CSendBuffer(short ignore)
   {
-	  return KeLibI2cTransfer(i2cAddress, bufferPtr, buffer, 0, 0, i2cSpeed);  
+	  if ( useProtocol() < 2 ) {
+		  return KeLibI2cTransfer(i2cAddress, bufferPtr, buffer, 0, 0, i2cSpeed);  
+	  }
+
+	  // protocol v2: commands up to 28 bytes
+	  uint8_t frame[32];
+	  int     len = buildFrame2( frame, bufferPtr );
+
+	  if ( len < 0 ) {
+		  return -1;
+	  }
+
+	  return ( sendFrame2( frame, len, 0 ) < 0 ) ? -1 : 0;
   }
 
   int I2CReceiveBuffer(short bytes)
   {
 	  bufferPtr = 0;
-	  return KeLibI2cTransfer(i2cAddress, 0, 0, bytes, buffer, i2cSpeed);
+
+	  if ( useProtocol() < 2 ) {
+		  return KeLibI2cTransfer(i2cAddress, 0, 0, bytes, buffer, i2cSpeed);
+	  }
+
+	  memset( buffer, 0, bytes );
+	  return receiveFrame2( bytes, 0 );
+  }
+
+  int I2CTransceive(short bytes)
+  // sends the buffer and receives bytes in one transfer with a repeated start.
+  // The device prepares the reply meanwhile, no pause between sending and receiving is needed.
+  {
+	  uint8_t len = bufferPtr;
+
+	  bufferPtr = 0;
+
+	  if ( useProtocol() < 2 ) {
+		  uint8_t cmd[MAXBUFFER];
+		  memcpy( cmd, buffer, len );
+		  return KeLibI2cTransfer(i2cAddress, len, cmd, bytes, buffer, i2cSpeed);
+	  }
+
+	  // protocol v2: the first part of the reply comes with the status
+	  uint8_t frame[32];
+	  uint8_t part = ( bytes < FRAME2MAXDATA ) ? bytes : FRAME2MAXDATA;
+	  int     got  = buildFrame2( frame, len );
+
+	  if ( got < 0 ) {
+		  return -1;
+	  }
+
+	  memset( buffer, 0, bytes );
+	  got = sendFrame2( frame, got, part );
+	  if ( got < 0 ) {
+		  return -1;
+	  }
+
+	  if ( ( status2 == STATUS_PENDING ) || ( ( got == part ) && ( part < bytes ) ) ) {
+		  return receiveFrame2( bytes, got );
+	  }
+
+	  return 0;
   }
 
 } // extern "C"
\ No newline at end of file
@@ -63,6 +63,62 @@
 
 #define CMD_HOMINGOFFSET       36  // void homingOffset( unit8_t motor1, ulong offset )                 set offset to run during homing, after endstop is free again 
 
+#define CMD_SETTIMERSTATISTICS 37  // void setTimerStatistics( boolean on )                             start/stop measuring the stepper timer, starting resets all values
+#define CMD_GETTIMERSTATISTICS 38  // (long,long,long,long) getTimerStatistics( void )                   ticks/s achieved, ticks/s nominal, worst and average duration in µs
+
+#define CMD_MOVELINEAR         39  // void moveLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop ) coordinated relative move of all motors
+
+#define CMD_QUEUELINEAR        40  // void queueLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop ) add a linear move to the motion queue
+#define CMD_FLUSHQUEUE         41  // void flushQueue( void )                                           discard all queued linear moves
+#define CMD_GETQUEUEFREE       42  // uint8_t getQueueFree( void )                                      number of free slots in the motion queue
+
+#define CMD_GETSNAPSHOT        43  // (snapshot) getSnapshot( uint8_t chunk )                           32 bytes chunk of the packed controller state, chunk 0 takes a new snapshot
+
+#define CMD_SETEVENTMASK       44  // void setEventMask( uint8_t mask, uint8_t servo )                  events driving the event pin, servo output used as event pin or NOEVENTPIN
+#define CMD_GETEVENTS          45  // uint8_t getEvents( void )                                         latched events, reading clears them
+
+#define CMD_BATCH              46  // void batch( uint8_t flags, { uint8_t len, uint8_t cmd[len] } )    chunk of a batch: length prefixed commands, executed at BATCH_COMMIT
+
+#define CMD_GETEFFECTIVESPEED  47  // long getEffectiveSpeed( uint8_t motor )                           effective max speed in 1/1000 steps/s
+
+#define CMD_MOVESERVO          48  // void moveServo( uint8_t servo, long position, long speed, uint8_t easing )        move a servo with speed units/s
+#define CMD_MOVESERVOTIMED     49  // void moveServoTimed( uint8_t servo, long position, long duration, uint8_t easing ) move a servo in duration ms
+#define CMD_MOVESERVOALL       50  // void moveServoAll( long p1, long p2, long p3, long p4, long duration, uint8_t easing ) move all servos in duration ms
+#define CMD_GETSERVOMOVING     51  // uint8_t getServoMoving( void )                                    mask of moving servos
+
+#define CMD_SETGEARING         52  // void setGearing( uint8_t follower, uint8_t leader, long numerator, long denominator ) follower runs numerator/denominator steps per leader step, max. 1, numerator 0 disengages
+
+#define CMD_SETHOMINGSPEED     53  // void setHomingSpeed( uint8_t motor, long fast, long slow )         homing speeds in steps/s, 0 = maxSpeed and maxSpeed/10
+#define CMD_HOMINGALL          54  // void homingAll( long d1, long d2, long d3, long d4, uint8_t disableOnStopMask ) homing of all motors with distance != 0 in parallel, EVENT_HOMED if all are done
+
+#define CMD_SETTRIGGER         55  // void setTrigger( uint8_t trigger, uint8_t motor, long position, uint8_t action, uint8_t servo, long value ) arm a position trigger, TRIGGER_NONE disarms
+#define CMD_GETTRIGGERS        56  // uint8_t getTriggers( void )                                      mask of armed triggers, a trigger disarms when it fires
+
+#define CMD_STREAM             57  // void stream( uint8_t count, { uint16_t ticks, int s1, int s2, int s3, int s4 }[count] ) add up to 3 samples to the stream buffer
+#define CMD_STARTSTREAM        58  // void startStream( uint8_t motorMask, uint8_t lowWater, boolean disableOnStop ) run the samples, EVENT_QUEUEEMPTY at lowWater samples left
+#define CMD_STOPSTREAM         59  // void stopStream( void )                                           stop streaming motors at once and discard all samples
+#define CMD_GETSTREAMFREE      60  // uint8_t getStreamFree( void )                                     number of free slots in the stream buffer
+
+#define CMD_SETTRACE           61  // void setTrace( uint8_t flags )                                    start tracing the TRACE_* records in flags, 0 stops, starting resets all values
+#define CMD_GETTRACE           62  // (records) getTrace( void )                                        number of records and up to 3 records, reading removes them from the trace buffer
+#define CMD_GETTRACESTATISTICS 63  // (long,long,long,long) getTraceStatistics( void )                  missed stepper ticks, worst and average command latency in µs, lost records
+
+#define CMD_GETBUSSTATISTICS   64  // (long x8) getBusStatistics( void )                                 reads, dropped, oversized & malformed frames, watchdog trips, end stop & EMS stops, loop()/s
+#define CMD_GETCOMMANDCOUNTS   65  // (uint16_t x16) getCommandCounts( uint8_t first )                  received commands of opcode first..first+15
+#define CMD_RESETBUSSTATISTICS 66  // void resetBusStatistics( void )                                   reset all bus statistics
+
+#define CMD_GETPROTOCOL        67  // (uint8_t,uint8_t) getProtocol( void )                             highest protocol version and its complement
+#define CMD_GETREPLY           68  // void getReply( uint8_t offset )                                   protocol v2 only: the next reads send the reply of the last command from offset
+
+#define STREAMSAMPLESIZE       10
+
+#define TRACERECORDSIZE        8
+#define TRACECHUNK             3
+
+#define SNAPSHOTVERSION        1
+#define SNAPSHOTSIZE           62
+#define SNAPSHOTCHUNK          32
+
 
 i2cBuffer i2c;
 
@@ -130,7 +186,7 @@ long ftPwrDrive::getMaxSpeed( uint8_t motor ) {
 
 void ftPwrDrive::startMoving( uint8_t motor, boolean disableOnStop = true ) {
   // start motor moving, disableOnStop disables the motor driver at the end of the movement
-  i2c.sendData( i2cAddress, CMD_STARTMOVING, motor, disableOnStop );
+  i2c.sendData( i2cAddress, CMD_STARTMOVING, motor, (uint8_t) disableOnStop );
 }
 
 void ftPwrDrive::startMovingAll( uint8_t maskMotor, uint8_t maskDisableOnStop = M1|M2|M3|M4  ) {
@@ -258,12 +314,42 @@ void ftPwrDrive::getServoOffsetAll( long &o1, long &o2, long &o3, long &o4 ) {
 
 void ftPwrDrive::setServoOnOff( uint8_t servo, boolean on ) {
   // set servo pin On or Off without PWM
-  i2c.sendData( i2cAddress, CMD_SETSERVOONOFF, servo, on );
+  i2c.sendData( i2cAddress, CMD_SETSERVOONOFF, servo, (uint8_t) on );
+}
+
+void ftPwrDrive::moveServo( uint8_t servo, long position, long speed, uint8_t easing ) {
+  // move a servo with speed units/s
+  i2c.sendData( i2cAddress, CMD_MOVESERVO, servo, position, speed, easing );
+}
+
+void ftPwrDrive::moveServoTimed( uint8_t servo, long position, long duration, uint8_t easing ) {
+  // move a servo in duration ms
+  i2c.sendData( i2cAddress, CMD_MOVESERVOTIMED, servo, position, duration, easing );
+}
+
+void ftPwrDrive::moveServoAll( long p1, long p2, long p3, long p4, long duration, uint8_t easing ) {
+  // move all servos in duration ms
+  i2c.sendData( i2cAddress, CMD_MOVESERVOALL, p1, p2, p3, p4, duration, easing );
+}
+
+uint8_t ftPwrDrive::getServoMoving( void ) {
+  // mask of moving servos
+  return i2c.receiveuint8_t( i2cAddress, CMD_GETSERVOMOVING );
 }
 
 void ftPwrDrive::homing( uint8_t motor, long maxDistance, boolean disableOnStop = true ) {
   // homing of motor using end stop
-  i2c.sendData( i2cAddress, CMD_HOMING, motor, maxDistance, disableOnStop );
+  i2c.sendData( i2cAddress, CMD_HOMING, motor, maxDistance, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::homingAll( long d1, long d2, long d3, long d4, uint8_t disableOnStopMask ) {
+  // homing of all motors with distance != 0 in parallel
+  i2c.sendData( i2cAddress, CMD_HOMINGALL, d1, d2, d3, d4, disableOnStopMask );
+}
+
+void ftPwrDrive::setHomingSpeed( uint8_t motor, long fast, long slow ) {
+  // set the homing speeds in steps/s
+  i2c.sendData( i2cAddress, CMD_SETHOMINGSPEED, motor, fast, slow );
 }
 
 boolean ftPwrDrive::isHoming( uint8_t motor ) {
@@ -323,7 +409,295 @@ void ftPwrDrive::setAbsDistanceR( uint8_t motor, float distance ) {
 void ftPwrDrive::setInSync( uint8_t motor1, uint8_t motor2, boolean OnOff) {
   // set two motors running in sync
 
-  i2c.sendData( i2cAddress, CMD_SETINSYNC, motor1, motor2, OnOff);
+  i2c.sendData( i2cAddress, CMD_SETINSYNC, motor1, motor2, (uint8_t) OnOff);
+}
+
+void ftPwrDrive::setTimerStatistics( boolean on ) {
+  // start/stop measuring the stepper timer, starting resets all values
+  i2c.sendData( i2cAddress, CMD_SETTIMERSTATISTICS, (uint8_t) on );
+}
+
+void ftPwrDrive::getTimerStatistics( long &rate, long &nominalRate, long &worstDuration, long &avgDuration ) {
+  // get achieved and nominal stepper timer ticks/s, worst and average duration of a tick in µs
+  i2c.receive4Long( i2cAddress, CMD_GETTIMERSTATISTICS, rate, nominalRate, worstDuration, avgDuration );
+}
+
+void ftPwrDrive::setTrace( uint8_t flags ) {
+  // start tracing the records in flags, 0 stops
+  i2c.sendData( i2cAddress, CMD_SETTRACE, flags );
+}
+
+uint8_t ftPwrDrive::getTrace( ftPwrDriveTrace records[], uint8_t maxRecords ) {
+  // read and remove up to maxRecords records from the trace buffer
+
+  uint8_t count = 0;
+
+  while ( maxRecords - count >= TRACECHUNK ) {
+
+    i2c.receiveData( i2cAddress, CMD_GETTRACE, 1 + TRACECHUNK * TRACERECORDSIZE );
+
+    uint8_t n = i2c.data[0];
+    if ( ( n == 0 ) || ( n > TRACECHUNK ) ) {
+      break;
+    }
+
+    for (uint8_t i=0; i<n; i++ ) {
+      uint8_t *r = &i2c.data[ 1 + i * TRACERECORDSIZE ];
+      records[count].type  = r[0];
+      records[count].data  = r[1];
+      records[count].value = r[2] | ( r[3] << 8 );
+      memcpy( &records[count].time, &r[4], 4 );
+      count++;
+    }
+
+  }
+
+  return count;
+
+}
+
+void ftPwrDrive::getTraceStatistics( long &missedTicks, long &worstLatency, long &avgLatency, long &lostRecords ) {
+  // get missed stepper ticks, worst and average command latency in µs and lost records
+  i2c.receive4Long( i2cAddress, CMD_GETTRACESTATISTICS, missedTicks, worstLatency, avgLatency, lostRecords );
+}
+
+void ftPwrDrive::getBusStatistics( ftPwrDriveBusStatistics &statistics ) {
+  // get the bus statistics
+
+  i2c.receiveData( i2cAddress, CMD_GETBUSSTATISTICS, 32 );
+
+  statistics.reads         = i2c.popLong( 0 );
+  statistics.dropped       = i2c.popLong( 4 );
+  statistics.oversized     = i2c.popLong( 8 );
+  statistics.malformed     = i2c.popLong( 12 );
+  statistics.watchdogTrips = i2c.popLong( 16 );
+  statistics.endStopStops  = i2c.popLong( 20 );
+  statistics.emsStops      = i2c.popLong( 24 );
+  statistics.loopRate      = i2c.popLong( 28 );
+
+}
+
+void ftPwrDrive::getCommandCounts( uint8_t first, uint16_t counts[ COMMANDCOUNTCHUNK ] ) {
+  // get the received commands of opcode first..first+COMMANDCOUNTCHUNK-1
+
+  i2c.receiveData( i2cAddress, CMD_GETCOMMANDCOUNTS, first, COMMANDCOUNTCHUNK * 2 );
+
+  for (uint8_t i=0; i<COMMANDCOUNTCHUNK; i++ ) {
+    counts[i] = i2c.data[ i * 2 ] | ( i2c.data[ i * 2 + 1 ] << 8 );
+  }
+
+}
+
+void ftPwrDrive::resetBusStatistics( void ) {
+  // reset all bus statistics
+  i2c.sendData( i2cAddress, CMD_RESETBUSSTATISTICS );
+}
+
+uint8_t ftPwrDrive::setProtocol( uint8_t version ) {
+  // negotiate the protocol version
+  return i2c.negotiate( i2cAddress, version );
+}
+
+uint8_t ftPwrDrive::getProtocol( void ) {
+  // protocol version in use
+  return i2c.getProtocol( i2cAddress );
+}
+
+void ftPwrDrive::getProtocolStatistics( long &retries, long &errors ) {
+  // frames sent again and frames failed after all retries
+  retries = i2c.retries;
+  errors  = i2c.errors;
+}
+
+void ftPwrDrive::setGearing( uint8_t follower, uint8_t leader, long numerator, long denominator ) {
+  // gear follower to leader with the ratio numerator/denominator
+  i2c.sendData( i2cAddress, CMD_SETGEARING, follower, leader, numerator, denominator );
+}
+
+void ftPwrDrive::setTrigger( uint8_t trigger, uint8_t motor, long position, uint8_t action, uint8_t servo, long value ) {
+  // arm a position trigger
+  i2c.sendData( i2cAddress, CMD_SETTRIGGER, trigger, motor, position, action, servo, value );
+}
+
+uint8_t ftPwrDrive::getTriggers( void ) {
+  // mask of armed triggers
+  return i2c.receiveuint8_t( i2cAddress, CMD_GETTRIGGERS );
+}
+
+void ftPwrDrive::stream( uint16_t ticks, int s1, int s2, int s3, int s4 ) {
+  // add a sample, full frames are sent at once
+  int steps[ MOTORS ] = { s1, s2, s3, s4 };
+  uint8_t p = 2 + streamSamples * STREAMSAMPLESIZE;
+
+  streamFrame[p++] = ticks & 0xFF;
+  streamFrame[p++] = ticks >> 8;
+  for (uint8_t i=0; i<MOTORS; i++ ) {
+    streamFrame[p++] = steps[i] & 0xFF;
+    streamFrame[p++] = ( steps[i] >> 8 ) & 0xFF;
+  }
+
+  // send, if the next sample doesn't fit into the frame
+  streamSamples++;
+  if ( 2 + ( streamSamples + 1 ) * STREAMSAMPLESIZE > i2c.maxCommand( i2cAddress ) ) {
+    flushStream();
+  }
+}
+
+void ftPwrDrive::flushStream( void ) {
+  // send all collected samples
+  if ( streamSamples == 0 ) {
+    return;
+  }
+  i2c.len = 0;
+  i2c.push( (uint8_t) CMD_STREAM );
+  i2c.push( streamSamples );
+  for (uint8_t i=0; i<streamSamples * STREAMSAMPLESIZE; i++ ) {
+    i2c.push( streamFrame[ 2 + i ] );
+  }
+  i2c.sendBuffer( i2cAddress );
+  streamSamples = 0;
+}
+
+void ftPwrDrive::startStream( uint8_t motorMask, uint8_t lowWater, boolean disableOnStop ) {
+  // run the samples of the stream buffer
+  flushStream();
+  i2c.sendData( i2cAddress, CMD_STARTSTREAM, motorMask, lowWater, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::stopStream( void ) {
+  // stop all streaming motors at once
+  streamSamples = 0;
+  i2c.sendData( i2cAddress, CMD_STOPSTREAM );
+}
+
+uint8_t ftPwrDrive::getStreamFree( void ) {
+  // number of free slots in the stream buffer
+  return i2c.receiveuint8_t( i2cAddress, CMD_GETSTREAMFREE );
+}
+
+void ftPwrDrive::moveLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop ) {
+  // coordinated relative move of all motors on a straight line
+  i2c.sendData( i2cAddress, CMD_MOVELINEAR, d1, d2, d3, d4, feedrate, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::queueLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop ) {
+  // add a linear move to the motion queue
+  i2c.sendData( i2cAddress, CMD_QUEUELINEAR, d1, d2, d3, d4, feedrate, (uint8_t) disableOnStop );
+}
+
+void ftPwrDrive::flushQueue( void ) {
+  // discard all queued linear moves
+  i2c.sendData( i2cAddress, CMD_FLUSHQUEUE );
+}
+
+uint8_t ftPwrDrive::getQueueFree( void ) {
+  // number of free slots in the motion queue
+  return i2c.receiveuint8_t( i2cAddress, CMD_GETQUEUEFREE );
+}
+
+void ftPwrDrive::waitQueue( uint16_t interval ) {
+  // wait until all queued moves are done
+
+  while ( ( getQueueFree() < MOTIONQUEUESIZE ) || isMovingAll() ) {
+    delay( interval );
+  }
+
+}
+
+boolean ftPwrDrive::getSnapshot( ftPwrDriveSnapshot &snapshot ) {
+  // get the state of all motors and servos in one snapshot
+
+  uint8_t buffer[SNAPSHOTSIZE];
+  uint8_t i;
+
+  // read all chunks, chunk 0 takes the snapshot
+  for (uint8_t chunk=0; chunk * SNAPSHOTCHUNK < SNAPSHOTSIZE; chunk++ ) {
+    uint8_t quantity = min( SNAPSHOTSIZE - chunk * SNAPSHOTCHUNK, SNAPSHOTCHUNK );
+    i2c.receiveData( i2cAddress, CMD_GETSNAPSHOT, chunk, quantity );
+    memcpy( &buffer[ chunk * SNAPSHOTCHUNK ], i2c.data, quantity );
+  }
+
+  snapshot.version = buffer[0];
+  if ( snapshot.version != SNAPSHOTVERSION ) {
+    return false;
+  }
+
+  snapshot.isMoving      = buffer[1];
+  snapshot.endStop       = buffer[2];
+  snapshot.homing        = buffer[3];
+  snapshot.emergencyStop = buffer[4] & 1;
+  snapshot.linearMove    = ( buffer[4] >> 1 ) & 1;
+  snapshot.queueFree     = buffer[5];
+
+  for (i=0; i<MOTORS; i++ ) {
+    memcpy( &snapshot.position[i],  &buffer[ 6 + i * 4 ], 4 );
+    memcpy( &snapshot.stepsToGo[i], &buffer[ 22 + i * 4 ], 4 );
+    memcpy( &snapshot.speed[i],     &buffer[ 38 + i * 4 ], 4 );
+  }
+
+  for (i=0; i<SERVOS; i++ ) {
+    snapshot.servo[i] = (int16_t)( buffer[ 54 + i * 2 ] | ( buffer[ 55 + i * 2 ] << 8 ) );
+  }
+
+  return true;
+
+}
+
+void ftPwrDrive::setEventMask( uint8_t mask, uint8_t servo ) {
+  // set the events driving the event pin
+  i2c.sendData( i2cAddress, CMD_SETEVENTMASK, mask, servo );
+}
+
+uint8_t ftPwrDrive::getEvents( void ) {
+  // get the latched events and clear them
+  return i2c.receiveuint8_t( i2cAddress, CMD_GETEVENTS );
+}
+
+uint8_t ftPwrDrive::waitEvent( uint8_t pin, unsigned long timeout ) {
+  // wait on the event pin without any bus traffic
+
+  unsigned long start = millis();
+
+  while ( digitalRead( pin ) == LOW ) {
+    if ( ( timeout > 0 ) && ( millis() - start >= timeout ) ) {
+      return 0;
+    }
+  }
+
+  return getEvents();
+
+}
+
+uint8_t ftPwrDrive::waitEvent( uint8_t mask, uint16_t interval, unsigned long timeout ) {
+  // wait on events without event pin, polling the event register
+
+  unsigned long start = millis();
+  uint8_t       e;
+
+  while ( ( ( e = getEvents() ) & mask ) == 0 ) {
+    if ( ( timeout > 0 ) && ( millis() - start >= timeout ) ) {
+      return 0;
+    }
+    delay( interval );
+  }
+
+  return e;
+
+}
+
+void ftPwrDrive::beginBatch( void ) {
+  // collect all following commands in a batch
+  i2c.beginBatch( i2cAddress, CMD_BATCH );
+}
+
+void ftPwrDrive::commitBatch( void ) {
+  // send the batch, all commands are executed together
+  i2c.commitBatch();
+}
+
+float ftPwrDrive::getEffectiveSpeed( uint8_t motor ) {
+  // get the effective max speed in steps/s
+  return (float) i2c.receiveLong( i2cAddress, CMD_GETEFFECTIVESPEED, motor ) / 1000;
 }
 
 uint8_t ftPwrDrive::motorIndex( uint8_t motor ) {
@@ -41,6 +41,31 @@ static const uint8_t M[ MOTORS ] = { M1, M2, M3, M4 };
 // flags, i.e. used in getState
 static const uint8_t ISMOVING = 1, ENDSTOP = 2, EMERCENCYSTOP = 4, HOMING = 8;
 
+// events, i.e. used in getEvents. M1..M4 are motion complete events of the motors
+static const uint8_t EVENT_ENDSTOP = 16, EVENT_EMS = 32, EVENT_QUEUEEMPTY = 64, EVENT_HOMED = 128;
+static const uint8_t NOEVENTPIN = 0xFF;
+
+// easing of servo moves
+static const uint8_t SERVO_LINEAR = 0, SERVO_EASEIN = 1, SERVO_EASEOUT = 2, SERVO_EASEINOUT = 3;
+
+// position triggers
+static const uint8_t MAXTRIGGER = 4;
+static const uint8_t TRIGGER_NONE = 0, TRIGGER_SERVO = 1, TRIGGER_ON = 2, TRIGGER_OFF = 3;
+
+// trace records, see setTrace
+static const uint8_t TRACE_STEP = 1, TRACE_MISSED = 2, TRACE_COMMAND = 4, TRACE_SERVO = 8;
+static const uint8_t TRACE_ALL = TRACE_STEP | TRACE_MISSED | TRACE_COMMAND | TRACE_SERVO;
+
+// opcodes per getCommandCounts
+static const uint8_t COMMANDCOUNTCHUNK = 16;
+
+// number of linear moves in the motion queue
+static const uint8_t MOTIONQUEUESIZE = 8;
+
+// number of samples in the stream buffer, samples sent in one I2C write
+static const uint8_t STREAMSIZE = 16;
+static const uint8_t STREAMFRAMESAMPLES = 3;
+
 // gears
 static const uint8_t Z10 = 10, Z12 = 12, Z15 = 15, Z20 = 20, Z30 = 30, Z40 = 40, Z58 = 58, WORMSCREW = 5;
 
@@ -53,6 +78,41 @@ static const uint8_t FTPWRDRIVE_MOTORS = MOTORS;
 static const uint8_t FTPWRDRIVE_M[ MOTORS ] = { M1, M2, M3, M4 }; 
 static const uint8_t FTPWRDRIVE_ISMOVING = ISMOVING, FTPWRDRIVE_ENDSTOP = ENDSTOP, FTPWRDRIVE_EMERCENCYSTOP = EMERCENCYSTOP, FTPWRDRIVE_HOMING = HOMING;
 
+// state of the whole controller, see getSnapshot
+struct ftPwrDriveSnapshot {
+  uint8_t version;             // snapshot format version
+  uint8_t isMoving;            // mask of moving motors
+  uint8_t endStop;             // mask of motors with active end stop
+  uint8_t homing;              // mask of homing motors
+  boolean emergencyStop;       // EMS is active
+  boolean linearMove;          // a linear move is running
+  uint8_t queueFree;           // free slots in the motion queue
+  long    position[ MOTORS ];  // positions
+  long    stepsToGo[ MOTORS ]; // steps to go
+  long    speed[ MOTORS ];     // actual speed in steps/s
+  int     servo[ SERVOS ];     // servo positions
+};
+
+// record of the firmware trace buffer, see getTrace
+struct ftPwrDriveTrace {
+  uint8_t       type;          // TRACE_STEP, TRACE_MISSED, TRACE_COMMAND or TRACE_SERVO
+  uint8_t       data;          // stepped motors M1..M4, missed ticks, command or number of servo pulses
+  uint16_t      value;         // duration of the tick, command latency or duration of the servo frame in µs
+  unsigned long time;          // start of the traced event in µs of the firmware's clock
+};
+
+// bus statistics, see getBusStatistics
+struct ftPwrDriveBusStatistics {
+  long reads;                  // read requests served
+  long dropped;                // commands dropped, because the command FIFO was full
+  long oversized;              // v2 frames & batch chunks longer than 32 bytes, batches larger than 64 bytes
+  long malformed;              // empty writes, unknown commands
+  long watchdogTrips;          // motors stopped by the watchdog
+  long endStopStops;           // motors stopped by an end stop
+  long emsStops;               // motors stopped by EMS
+  long loopRate;               // main loop iterations/s, the rate commands are executed at
+};
+
 class ftPwrDrive {
   public:
     
@@ -90,6 +150,10 @@ class ftPwrDrive {
       
     long getMaxSpeed( uint8_t motor);
       // get max speed
+
+    float getEffectiveSpeed( uint8_t motor );
+      // get the effective max speed in steps/s, the firmware reproduces it exactly on average
+      // speeds are limited to 0..10000 steps/s
       
     void startMoving( uint8_t motor, boolean disableOnStop = true );
       // start motor moving, disableOnStop disables the motor driver at the end of the movement
@@ -133,10 +197,8 @@ class ftPwrDrive {
     void getPositionAll( long &p1, long &p2, long &p3, long &p4 );
       // get position of all motors
 
-    // don't use acceleration yet - just stub implementation
-      
     void setAcceleration( uint8_t motor, long acceleration );
-      // set acceleration
+      // set acceleration in steps/s², 0 runs without ramps
       
     void setAccelerationAll( long a1, long a2, long a3, long a4 );
       // set accelerationof all motors
@@ -174,8 +236,28 @@ class ftPwrDrive {
     void setServoOnOff( uint8_t servo, boolean on );
       // set servo pin On or Off without PWM
 
+    void moveServo( uint8_t servo, long position, long speed, uint8_t easing = SERVO_LINEAR );
+      // move a servo to position with speed units/s, the firmware steps the move every 20ms servo frame.
+      // easing: SERVO_LINEAR, SERVO_EASEIN, SERVO_EASEOUT or SERVO_EASEINOUT. setServo cancels a move.
+
+    void moveServoTimed( uint8_t servo, long position, long duration, uint8_t easing = SERVO_LINEAR );
+      // move a servo to position in duration ms
+
+    void moveServoAll( long p1, long p2, long p3, long p4, long duration, uint8_t easing = SERVO_LINEAR );
+      // move all servos in duration ms, they start in the same frame and finish together
+
+    uint8_t getServoMoving( void );
+      // mask of moving servos, bit 0..3 = S1..S4
+
     void homing( uint8_t motor, long maxDistance, boolean disableOnStop = true );
-      // homing of motor using end stop
+      // homing of motor using end stop: fast seek, back off, slow re-approach, slow release, homingOffset
+
+    void homingAll( long d1, long d2, long d3, long d4, uint8_t disableOnStopMask = M1 | M2 | M3 | M4 );
+      // homing of all motors with distance != 0 in parallel. EVENT_HOMED is latched, if all of them are done:
+      // homingAll( -10000, -10000, 0, 0 ); waitEvent( EVENT_HOMED, 100, 0 );
+
+    void setHomingSpeed( uint8_t motor, long fast, long slow );
+      // homing speeds in steps/s for seeking and re-approaching the end stop, 0 = maxSpeed and maxSpeed/10
 
     boolean isHoming( uint8_t motor );
       // check, homing is active
@@ -207,6 +289,140 @@ class ftPwrDrive {
     void setInSync( uint8_t motor1, uint8_t motor2, boolean OnOff);
       // set two motors running in sync
 
+    void setGearing( uint8_t follower, uint8_t leader, long numerator, long denominator = 1 );
+      // electronic gearing: follower runs numerator/denominator steps per step of leader, a negative
+      // numerator reverses the direction. |numerator| > denominator is ignored, the follower does max. one
+      // step per tick like the leader. The follower stays synchronized under acceleration and
+      // linear moves, it can't be moved by itself. Stop the leader before changing the gearing.
+      // An end stop of the follower stops the leader. setGearing( follower, 0, 0 ) disengages.
+
+    void stream( uint16_t ticks, int s1, int s2, int s3, int s4 );
+      // add a sample to the stream: steps of M1..M4, spread evenly over ticks stepper ticks (100µs, max. 32767).
+      // Max. one step per tick. The host computes the trajectory, e.g. PVT segments, as steps per interval.
+      // Samples are collected and sent with STREAMFRAMESAMPLES (protocol v2: 2) in one write, flushStream sends the rest.
+      // Samples not fitting into the buffer are discarded - keep track of getStreamFree.
+
+    void flushStream( void );
+      // send all collected samples
+
+    void startStream( uint8_t motorMask, uint8_t lowWater = 4, boolean disableOnStop = true );
+      // run the stream buffer on all motors in motorMask, stream some samples before. The motors follow the
+      // samples without stopping in between; the stream ends, when all samples are done.
+      // EVENT_QUEUEEMPTY is latched, if only lowWater samples are left: time to stream the next ones.
+
+    void stopStream( void );
+      // stop all streaming motors at once and discard all samples
+
+    uint8_t getStreamFree( void );
+      // number of free slots in the stream buffer, STREAMSIZE if it's empty
+
+    void setTrigger( uint8_t trigger, uint8_t motor, long position, uint8_t action, uint8_t servo, long value = 0 );
+      // arm position trigger 0..MAXTRIGGER-1: when motor reaches position, the firmware sets servo to value (TRIGGER_SERVO)
+      // or switches the servo pin HIGH or LOW without PWM (TRIGGER_ON, TRIGGER_OFF) in the same stepper tick.
+      // A trigger fires once, reaching position from either side. TRIGGER_NONE disarms it.
+
+    uint8_t getTriggers( void );
+      // mask of armed triggers, bit 0 = trigger 0
+
+    void moveLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop = true );
+      // coordinated relative move of all motors on a straight line: all motors start and stop together.
+      // feedrate is the speed of the motor with the longest distance in steps/s, all motors share one
+      // ramp, which doesn't exceed any motors acceleration. The feedrate is reduced, if a motor would exceed
+      // its maxSpeed. Use wait( M1|M2|M3|M4 ) to wait for the end.
+
+    void queueLinear( long d1, long d2, long d3, long d4, long feedrate, boolean disableOnStop = true );
+      // same as moveLinear, but the move is added to the motion queue. It starts in the same stepper tick,
+      // the move before ends. The move is ignored, if the queue is full - check getQueueFree first.
+      // Queued moves in similar directions blend without stopping, the junction speeds are limited by
+      // maxSpeed and acceleration of all motors. A move queued behind the running one blends, if that one
+      // isn't decelerating yet - queue some moves in advance to get the best blending. Motors without
+      // distance in a move stay enabled until the queue runs empty.
+      // An end stop, EMS, moveLinear or stopping a motor of the running move discard all queued moves.
+
+    void flushQueue( void );
+      // discard all queued moves, the running move isn't stopped
+
+    uint8_t getQueueFree( void );
+      // number of free slots in the motion queue, MOTIONQUEUESIZE if it's empty
+
+    void waitQueue( uint16_t interval = 100 );
+      // wait until all queued moves are done
+
+    boolean getSnapshot( ftPwrDriveSnapshot &snapshot );
+      // get the state of all motors and servos in one snapshot, all values are taken in the same stepper tick.
+      // Arrays are indexed 0..3 for M1..M4 and S1..S4. Returns false, if the firmware sends an unknown format.
+
+    void setEventMask( uint8_t mask, uint8_t servo = NOEVENTPIN );
+      // events are latched until getEvents is called: M1..M4 - motor stopped, EVENT_ENDSTOP, EVENT_EMS, EVENT_QUEUEEMPTY.
+      // The servo output S1..S4 is used as event pin: it's HIGH as long as an event in mask is latched.
+
+    uint8_t getEvents( void );
+      // get the latched events and clear them
+
+    uint8_t waitEvent( uint8_t pin, unsigned long timeout = 0 );
+      // wait until the event pin, connected to pin, gets HIGH. There's no bus traffic while waiting.
+      // Returns the latched events or 0 after timeout ms, 0 waits forever.
+
+    uint8_t waitEvent( uint8_t mask, uint16_t interval, unsigned long timeout );
+      // same without event pin: poll the event register every interval ms until an event in mask is latched
+
+    void beginBatch( void );
+      // collect all following commands in a batch, nothing is sent until commitBatch.
+      // Don't use functions returning values inside a batch.
+
+    void commitBatch( void );
+      // send the batch, the commands are executed back-to-back without any other command in between.
+      // Large batches are sent in several I2C writes, a batch larger than 64 bytes is discarded.
+      // Example: setMaxSpeed x4, setRelDistance x4, startMovingAll in 3 instead of 9 writes.
+
+    void setTimerStatistics( boolean on );
+      // start/stop measuring the stepper timer, starting resets all values
+
+    void getTimerStatistics( long &rate, long &nominalRate, long &worstDuration, long &avgDuration );
+      // get achieved and nominal stepper timer ticks/s, worst and average duration of a tick in µs
+      // values are updated once per second while statistics are on
+
+    void setTrace( uint8_t flags = TRACE_ALL );
+      // start tracing the records in flags, 0 stops. Starting resets the trace and starts the timer statistics.
+      // The firmware needs to be compiled with TRACEBUFFER, otherwise there are never any records.
+      // TRACE_STEP: stepper ticks with step pulses, TRACE_MISSED: missed stepper ticks,
+      // TRACE_COMMAND: delay from the I2C receive to the execution of a command, TRACE_SERVO: servo frames.
+      // The trace buffer keeps 16 records only, so trace fewer records or read them often.
+
+    uint8_t getTrace( ftPwrDriveTrace records[], uint8_t maxRecords );
+      // read up to maxRecords records and remove them from the trace buffer, returns the number of records read.
+      // Records are read 3 at once, so maxRecords should be 3 or more.
+
+    void getTraceStatistics( long &missedTicks, long &worstLatency, long &avgLatency, long &lostRecords );
+      // get missed stepper ticks, worst and average command latency in µs and the records lost
+      // because the trace buffer was full. Use getTimerStatistics for the duration of the stepper ticks.
+
+    void getBusStatistics( ftPwrDriveBusStatistics &statistics );
+      // get the counters of the bus & command handling since power on or resetBusStatistics.
+      // Growing dropped counts mean, commands are sent faster than the firmware executes them.
+
+    void getCommandCounts( uint8_t first, uint16_t counts[ COMMANDCOUNTCHUNK ] );
+      // get the number of received commands of opcode first..first+15, counts wrap around at 65535.
+      // Each command of the library is one opcode, a batch counts as one command.
+
+    void resetBusStatistics( void );
+      // reset all bus statistics
+
+    uint8_t setProtocol( uint8_t version = 2 );
+      // negotiate the protocol with the device. Returns the version used: the lower one of version and the
+      // highest version of the firmware. The library negotiates v2 with the first command to a device by itself,
+      // setProtocol( 1 ) forces protocol v1. In v1, a getter sent while the device is still busy with earlier
+      // commands reads the reply before, v2 waits for the right one.
+      // Protocol v2 frames have a length, a sequence number and a CRC-8, the device acknowledges every frame
+      // with a status. Corrupted or dropped frames are sent again, a retry is executed once by the device.
+      // Use it on long cables and high bus clocks. Commands get up to 28 bytes, so batches use smaller chunks.
+
+    uint8_t getProtocol( void );
+      // protocol version in use
+
+    void getProtocolStatistics( long &retries, long &errors );
+      // protocol v2 frames sent or read again and frames failed after all retries, counted for all devices
+
   private:
     uint8_t i2cAddress = 32;
 
@@ -215,6 +431,10 @@ class ftPwrDrive {
     uint8_t motorIndex( uint8_t motor );
      // returns the index (0..3) of a motor
 
+    uint8_t streamFrame[ 2 + STREAMFRAMESAMPLES * 10 ];
+    uint8_t streamSamples = 0;
+      // samples collected by stream, not sent yet
+
 };
 
 
@@ -1,8 +1,43 @@
 #include "i2cBuffer.h"
 #include <Wire.h>
 
+// flags of a batch chunk
+#define BATCH_BEGIN  1
+#define BATCH_COMMIT 2
+
+// protocol v2 frames, see ftPwrDriveFW.ino
+//   write: FRAME2, len, seq, cmd[len], crc of the whole frame
+//   read:  status, seq, len, crc of the header, data[len], crc of the whole frame
+#define CMD_GETPROTOCOL 67
+#define CMD_GETREPLY    68
+#define FRAME2          0xF2
+#define FRAME2MAXCMD    28
+#define FRAME2MAXDATA   27
+#define FRAME2RETRIES   5
+#define STATUS_OK       0
+#define STATUS_PENDING  1
+#define STATUS_BUSY     4
+
+uint8_t crc8( uint8_t crc, const uint8_t *data, uint8_t len ) {
+  // CRC-8 with polynomial x^8 + x^2 + x + 1
+
+  while ( len-- ) {
+    crc ^= *data++;
+    for (uint8_t i=0; i<8; i++ ) {
+      crc = ( crc & 0x80 ) ? ( crc << 1 ) ^ 0x07 : crc << 1;
+    }
+  }
+
+  return crc;
+}
+
 void i2cBuffer::sendBuffer( uint8_t address  ) {
-  // send data
+  // send data, while batching data is appended to the batch
+
+  if ( batching ) {
+    appendBatch();
+    return;
+  }
 
   #ifdef DEBUG_COM
     Serial.print("sendBuffer "); Serial.print( address ); Serial.print(" ");
@@ -14,10 +49,303 @@ void i2cBuffer::sendBuffer( uint8_t address  ) {
   
     Serial.println();
   #endif
- 
+
+  transmit( address, data, len );
+}
+
+void i2cBuffer::transmit( uint8_t address, uint8_t *buffer, uint8_t bytes ) {
+  // send a command, as v2 frame if the device talks protocol v2
+
+  if ( getProtocol( address ) < 2 ) {
+    Wire.beginTransmission( address );
+    Wire.write( buffer, bytes );
+    Wire.endTransmission();
+    return;
+  }
+
+  buildFrame2( buffer, bytes );
+
+  if ( !sendFrame2( address, 0 ) ) {
+    errors++;
+  }
+}
+
+void i2cBuffer::transceive( uint8_t address, uint8_t quantity ) {
+  // send data and receive quantity bytes in one transaction. The read follows the write as repeated start,
+  // the device stretches the clock until its reply is ready. No guard delay is needed between both.
+
+  #ifdef DEBUG_COM
+    Serial.print( "transceive( " ); Serial.print( address ), Serial.print(","); Serial.print( quantity ); Serial.println(")");
+  #endif
+
+  if ( getProtocol( address ) < 2 ) {
+
+    Wire.beginTransmission( address );
+    Wire.write( data, len );
+    Wire.endTransmission( false );
+
+    len = 0;
+    Wire.requestFrom( address, quantity );
+    while ( Wire.available() ) {
+      data[len++] = Wire.read();
+    }
+
+  } else {
+
+    uint8_t part = min( quantity, FRAME2MAXDATA );
+
+    buildFrame2( data, len );
+    len = 0;
+
+    // the first part of the reply comes with the status, read the rest or a pending reply separately
+    if ( !sendFrame2( address, part ) ) {
+      errors++;
+    } else if ( ( frame2Status == STATUS_PENDING ) || ( ( len == part ) && ( len < quantity ) ) ) {
+      receiveFrame2( address, quantity );
+    }
+
+  }
+
+  // fillup buffer
+  for (uint8_t i=len;i<16;i++) {
+    data[i] = 0;
+  }
+
+}
+
+void i2cBuffer::buildFrame2( uint8_t *buffer, uint8_t bytes ) {
+  // pack a command into frame2 with the next sequence number
+
+  frame2[0] = FRAME2;
+  frame2[1] = bytes;
+  frame2[2] = ++seq;
+  memcpy( &frame2[3], buffer, bytes );
+  frame2[ 3 + bytes ] = crc8( 0, frame2, 3 + bytes );
+  frame2Len = 4 + bytes;
+}
+
+boolean i2cBuffer::sendFrame2( uint8_t address, uint8_t part ) {
+  // send frame2 until the device accepts it. Sending an accepted frame again is safe,
+  // the device executes a frame with the same sequence number & crc once.
+  // The status is read with a repeated start in the same transaction, with part > 0 the
+  // first part bytes of the reply, too. A complete reply is stored in data.
+
+  uint8_t r[32];
+  uint8_t n = ( part > 0 ) ? 5 + part : 4;
+
+  for (uint8_t i=0; i<FRAME2RETRIES; i++ ) {
+
+    if ( i > 0 ) {
+      retries++;
+    }
+
+    Wire.beginTransmission( address );
+    Wire.write( frame2, frame2Len );
+    if ( Wire.endTransmission( false ) != 0 ) {
+      continue;
+    }
+
+    // read the status
+    if ( Wire.requestFrom( address, n ) != n ) {
+      continue;
+    }
+    for (uint8_t j=0; j<n; j++ ) {
+      r[j] = Wire.read();
+    }
+
+    if ( crc8( 0, r, 3 ) != r[3] ) {
+      continue;
+    }
+
+    // command FIFO full, give the device some time. Checked before the seq, older firmware
+    // answers a busy frame with the seq of the last accepted one
+    if ( r[0] == STATUS_BUSY ) {
+      delay( 1 );
+      continue;
+    }
+
+    if ( r[1] != seq ) {
+      continue;
+    }
+
+    frame2Status = r[0];
+
+    if ( ( r[0] == STATUS_PENDING ) || ( ( r[0] == STATUS_OK ) && ( part == 0 ) ) ) {
+      return true;
+    }
+
+    if ( ( r[0] == STATUS_OK ) && ( r[2] <= part ) && ( crc8( 0, r, 4 + r[2] ) == r[ 4 + r[2] ] ) ) {
+      memcpy( &data[len], &r[4], r[2] );
+      len += r[2];
+      return true;
+    }
+
+  }
+
+  return false;
+}
+
+void i2cBuffer::receiveFrame2( uint8_t address, uint8_t quantity ) {
+  // read the reply of the last v2 frame into data, starting behind the len bytes already read.
+  // Replies longer than FRAME2MAXDATA are read in parts, CMD_GETREPLY sets the offset of the next part.
+
+  uint8_t r[32];
+  uint8_t offset = len;
+
+  while ( offset < quantity ) {
+
+    uint8_t part = min( quantity - offset, FRAME2MAXDATA );
+    uint8_t got  = 0;
+    uint8_t i;
+
+    if ( offset > 0 ) {
+      // same sequence number, it's still the reply of the last frame
+      uint8_t cmd[6] = { FRAME2, 2, seq, CMD_GETREPLY, offset, 0 };
+      cmd[5] = crc8( 0, cmd, 5 );
+      Wire.beginTransmission( address );
+      Wire.write( cmd, 6 );
+      Wire.endTransmission( false );
+    }
+
+    for (i=0; i<FRAME2RETRIES; i++ ) {
+
+      if ( i > 0 ) {
+        retries++;
+      }
+
+      uint8_t n = Wire.requestFrom( address, (uint8_t)( 5 + part ) );
+      for (uint8_t j=0; j<n; j++ ) {
+        r[j] = Wire.read();
+      }
+
+      if ( ( n < 5 ) || ( crc8( 0, r, 3 ) != r[3] ) || ( r[1] != seq ) || ( r[2] > part ) ) {
+        continue;
+      }
+
+      // the getter waits in the command FIFO of the device
+      if ( r[0] == STATUS_PENDING ) {
+        delay( 1 );
+        continue;
+      }
+
+      if ( ( r[0] == STATUS_OK ) && ( crc8( 0, r, 4 + r[2] ) == r[ 4 + r[2] ] ) ) {
+        got = r[2];
+        break;
+      }
+
+    }
+
+    if ( i == FRAME2RETRIES ) {
+      errors++;
+      break;
+    }
+
+    memcpy( &data[len], &r[4], got );
+    len    += got;
+    offset += got;
+
+    // the reply is shorter than expected
+    if ( got < part ) {
+      break;
+    }
+
+  }
+}
+
+void i2cBuffer::setProtocol( uint8_t address, uint8_t version ) {
+  // protocol version used with a device, 1 or 2
+
+  negotiated[ address >> 3 ] |= 1 << ( address & 7 );
+
+  if ( version >= 2 ) {
+    protocol2[ address >> 3 ] |= 1 << ( address & 7 );
+  } else {
+    protocol2[ address >> 3 ] &= ~( 1 << ( address & 7 ) );
+  }
+}
+
+uint8_t i2cBuffer::getProtocol( uint8_t address ) {
+  // protocol version used with a device, negotiated with the first command sent to it
+
+  if ( !( negotiated[ address >> 3 ] & ( 1 << ( address & 7 ) ) ) ) {
+    negotiate( address, 2 );
+  }
+
+  return ( protocol2[ address >> 3 ] & ( 1 << ( address & 7 ) ) ) ? 2 : 1;
+}
+
+uint8_t i2cBuffer::negotiate( uint8_t address, uint8_t version ) {
+  // ask the device for its highest protocol version and use the lower one of both.
+  // Asks in protocol v1, every firmware understands it. It has its own buffers, so data may hold
+  // a command waiting to be sent. A device not answering is asked again with the next command.
+
+  uint8_t r[2];
+
+  if ( version < 2 ) {
+    setProtocol( address, 1 );
+    return 1;
+  }
+
   Wire.beginTransmission( address );
-  Wire.write( data, len );
-  Wire.endTransmission();
+  Wire.write( CMD_GETPROTOCOL );
+  if ( ( Wire.endTransmission( false ) != 0 ) || ( Wire.requestFrom( address, (uint8_t) 2 ) != 2 ) ) {
+    return 1;
+  }
+  r[0] = Wire.read();
+  r[1] = Wire.read();
+
+  // older firmware doesn't reply
+  uint8_t device = ( r[1] == (uint8_t) ~r[0] ) ? r[0] : 1;
+
+  version = max( min( version, device ), 1 );
+  setProtocol( address, version );
+
+  return version;
+}
+
+uint8_t i2cBuffer::maxCommand( uint8_t address ) {
+  // max. length of a command sent to a device
+  return ( getProtocol( address ) < 2 ) ? sizeof( data ) : FRAME2MAXCMD;
+}
+
+void i2cBuffer::beginBatch( uint8_t address, uint8_t cmd ) {
+  // collect all following commands in a batch, cmd is the devices batch command
+
+  batching     = true;
+  batchAddress = address;
+  batch[0]     = cmd;
+  batch[1]     = BATCH_BEGIN;
+  batchLen     = 2;
+}
+
+void i2cBuffer::appendBatch( void ) {
+  // append data to the batch, full chunks are sent
+
+  if ( batchLen + 1 + len > maxCommand( batchAddress ) ) {
+    sendBatch();
+  }
+
+  batch[batchLen++] = len;
+  memcpy( &batch[batchLen], data, len );
+  batchLen += len;
+}
+
+void i2cBuffer::commitBatch( void ) {
+  // send the last chunk, the device executes the whole batch
+
+  batch[1] |= BATCH_COMMIT;
+  sendBatch();
+  batching = false;
+}
+
+void i2cBuffer::sendBatch( void ) {
+  // send a chunk of the batch
+
+  transmit( batchAddress, batch, batchLen );
+
+  // next chunk
+  batch[1] = 0;
+  batchLen = 2;
 }
 
 void i2cBuffer::receiveBuffer( uint8_t address, uint8_t quantity ) {
@@ -33,20 +361,26 @@ void i2cBuffer::receiveBuffer( uint8_t address, uint8_t quantity ) {
 
   len = 0;
 
-  // request quantity uint8_ts
-  Wire.requestFrom( address, quantity);
+  if ( getProtocol( address ) >= 2 ) {
+    receiveFrame2( address, quantity );
+  } else {
+
+    // request quantity uint8_ts
+    Wire.requestFrom( address, quantity);
+
+    uint8_t x;
+    // receive data
+    while (Wire.available()) { 
+      x = Wire.read();
+      data[len++] = x;
+
+      #ifdef DEBUG_COM
+        Serial.print( x, HEX ); 
+        Serial.print( " " );
+      #endif
+      
+    }
 
-  uint8_t x;
-  // receive data
-  while (Wire.available()) { 
-    x = Wire.read();
-    data[len++] = x;
-
-    #ifdef DEBUG_COM
-      Serial.print( x, HEX ); 
-      Serial.print( " " );
-    #endif
-    
   }
 
   #ifdef DEBUG_COM
@@ -141,6 +475,82 @@ void i2cBuffer::sendData( uint8_t address, uint8_t cmd, uint8_t v1, long v2 ) {
   sendBuffer( address );
 }
 
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2 ) {
+  // send a command with 2 uint8_t
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  sendBuffer( address );
+}
+
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2, uint8_t v3 ) {
+  // send a command with 3 uint8_t
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  push( v3 );
+  sendBuffer( address );
+}
+
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd, uint8_t v1, long v2, long v3 ) {
+  // send a command with a uint8_t and two long values
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  push( v3 );
+  sendBuffer( address );
+}
+
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd, long v1, long v2, long v3, long v4, uint8_t v5 ) {
+  // send a command with 4 long values and a uint8_t
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  push( v3 );
+  push( v4 );
+  push( v5 );
+  sendBuffer( address );
+}
+
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd, uint8_t v1, long v2, long v3, uint8_t v4 ) {
+  // send a command with a uint8_t, two long values and another uint8_t
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  push( v3 );
+  push( v4 );
+  sendBuffer( address );
+}
+
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2, long v3, long v4 ) {
+  // send a command with two uint8_t and two long values
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  push( v3 );
+  push( v4 );
+  sendBuffer( address );
+}
+
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2, long v3, uint8_t v4, uint8_t v5, long v6 ) {
+  // send a command with two uint8_t, a long, two uint8_t and a long value
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  push( v3 );
+  push( v4 );
+  push( v5 );
+  push( v6 );
+  sendBuffer( address );
+}
+
 
 void i2cBuffer::sendData( uint8_t address, uint8_t cmd,long v1, long v2, long v3, long v4 ) {
   // send a command with 4 long values
@@ -155,31 +565,57 @@ void i2cBuffer::sendData( uint8_t address, uint8_t cmd,long v1, long v2, long v3
   sendBuffer( address );
 }
 
+void i2cBuffer::sendData( uint8_t address, uint8_t cmd,long v1, long v2, long v3, long v4, long v5, uint8_t v6 ) {
+  // send a command with 5 long values and a uint8_t
+  
+  len = 0;
+  push( cmd );
+  push( v1 );
+  push( v2 );
+  push( v3 );
+  push( v4 );
+  push( v5 );
+  push( v6 );
+
+  sendBuffer( address );
+}
+
+void i2cBuffer::receiveData( uint8_t address, uint8_t cmd, uint8_t quantity ) {
+  // send a command and receive quantity bytes in one transaction
+  len = 0;
+  push( cmd );
+  transceive( address, quantity );
+}
+
+void i2cBuffer::receiveData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t quantity ) {
+  // send a command with a uint8_t and receive quantity bytes in one transaction
+  len = 0;
+  push( cmd );
+  push( v1 );
+  transceive( address, quantity );
+}
+
 uint8_t i2cBuffer::receiveuint8_t( uint8_t address, uint8_t cmd ) {
   // receive a uint8_t value 
-  sendData( address, cmd );
-  receiveBuffer( address, 1 );
+  receiveData( address, cmd, 1 );
   return data[0];
 }
 
 uint8_t i2cBuffer::receiveuint8_t( uint8_t address, uint8_t cmd, uint8_t v1 ) {
   // receive a uint8_t value 
-  sendData( address, cmd, v1 );
-  receiveBuffer( address, 1 );
+  receiveData( address, cmd, v1, 1 );
   return data[0];
 }
 
 long i2cBuffer::receiveLong( uint8_t address, uint8_t cmd, uint8_t v1 ) {
   // receive a long value 
-  sendData( address, cmd, v1 );
-  receiveBuffer( address, 4 );
+  receiveData( address, cmd, v1, 4 );
   return popLong( 0 );
 }
 
 void i2cBuffer::receive4Long( uint8_t address, uint8_t cmd, long &v1, long &v2, long &v3, long &v4 ) {
   // receive 4 long values
-  sendData( address, cmd );
-  receiveBuffer( address, 16 );
+  receiveData( address, cmd, 16 );
   v1 = popLong( 0 );
   v2 = popLong( 4 );
   v3 = popLong( 8 );
@@ -188,15 +624,13 @@ void i2cBuffer::receive4Long( uint8_t address, uint8_t cmd, long &v1, long &v2,
 
 int i2cBuffer::receiveInt( uint8_t address, uint8_t cmd, uint8_t v1 ) {
   // receive an int value 
-  sendData( address, cmd, v1 );
-  receiveBuffer( address, 2 );
+  receiveData( address, cmd, v1, 2 );
   return popInt( 0 );
 }
 
 void i2cBuffer::receive4Int( uint8_t address, uint8_t cmd, int &v1, int &v2, int &v3, int &v4 ) {
   // receive 4 int values
-  sendData( address, cmd );
-  receiveBuffer( address, 16 );
+  receiveData( address, cmd, 16 );
   v1 = popInt( 0 );
   v2 = popInt( 2 );
   v3 = popInt( 4 );
@@ -29,8 +29,28 @@ class i2cBuffer {
       // send a command with a uint8_t, a long value and another uint8_t
     void sendData( uint8_t address, uint8_t cmd, uint8_t v1, long v2 );
       // send a command with a uint8_t and a long value
+    void sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2 );
+      // send a command with 2 uint8_t
+    void sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2, uint8_t v3 );
+      // send a command with 3 uint8_t
+    void sendData( uint8_t address, uint8_t cmd, uint8_t v1, long v2, long v3 );
+      // send a command with a uint8_t and two long values
+    void sendData( uint8_t address, uint8_t cmd, uint8_t v1, long v2, long v3, uint8_t v4 );
+      // send a command with a uint8_t, two long values and another uint8_t
+    void sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2, long v3, long v4 );
+      // send a command with two uint8_t and two long values
+    void sendData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t v2, long v3, uint8_t v4, uint8_t v5, long v6 );
+      // send a command with two uint8_t, a long, two uint8_t and a long value
     void sendData( uint8_t address, uint8_t cmd, long v1, long v2, long v3, long v4 );
       // send a command with 4 long values
+    void sendData( uint8_t address, uint8_t cmd, long v1, long v2, long v3, long v4, uint8_t v5 );
+      // send a command with 4 long values and a uint8_t
+    void sendData( uint8_t address, uint8_t cmd, long v1, long v2, long v3, long v4, long v5, uint8_t v6 );
+      // send a command with 5 long values and a uint8_t
+    void receiveData( uint8_t address, uint8_t cmd, uint8_t quantity );
+      // send a command and receive quantity bytes in one transaction
+    void receiveData( uint8_t address, uint8_t cmd, uint8_t v1, uint8_t quantity );
+      // send a command with a uint8_t and receive quantity bytes in one transaction
     uint8_t receiveuint8_t( uint8_t address, uint8_t cmd );
       // receive a uint8_t value 
     uint8_t receiveuint8_t( uint8_t address, uint8_t cmd, uint8_t v1 );
@@ -44,8 +64,53 @@ class i2cBuffer {
     void receive4Int( uint8_t address, uint8_t cmd, int &v1, int &v2, int &v3, int &v4 );
       // receive 4 int values
     void sendBuffer( uint8_t address );
-      // send data
+      // send data, while batching data is appended to the batch
+    void beginBatch( uint8_t address, uint8_t cmd );
+      // collect all following commands in a batch, cmd is the devices batch command
+    void appendBatch( void );
+      // append data to the batch, full chunks are sent
+    void commitBatch( void );
+      // send the last chunk, the device executes the whole batch
     void receiveBuffer( uint8_t address, uint8_t quantity );
+      // receive data after a separate write, prefer transceive
+    void transceive( uint8_t address, uint8_t quantity );
+      // send data and receive quantity bytes in one transaction (repeated start)
+    void setProtocol( uint8_t address, uint8_t version );
+      // protocol version used with a device, 1 or 2
+    uint8_t getProtocol( uint8_t address );
+      // protocol version used with a device, negotiated with the first command sent to it
+    uint8_t negotiate( uint8_t address, uint8_t version );
+      // ask the device for its protocol and use the lower one of version and the device's
+    uint8_t maxCommand( uint8_t address );
+      // max. length of a command sent to a device
+    uint8_t batch[32];
+    uint8_t batchLen = 0;
+    uint8_t batchAddress = 0;
+    boolean batching = false;
+    unsigned long retries = 0;
+      // protocol v2 frames sent or read again
+    unsigned long errors = 0;
+      // protocol v2 frames failed after all retries
+  private:
+    void sendBatch( void );
+      // send a chunk of the batch
+    void transmit( uint8_t address, uint8_t *buffer, uint8_t bytes );
+      // send a command, as v2 frame if the device talks protocol v2
+    void buildFrame2( uint8_t *buffer, uint8_t bytes );
+      // pack a command into frame2 with the next sequence number
+    boolean sendFrame2( uint8_t address, uint8_t part );
+      // send frame2 until the device accepts it, read status & part bytes of the reply
+    void receiveFrame2( uint8_t address, uint8_t quantity );
+      // read the reply of the last v2 frame into data
+    uint8_t protocol2[16] = { 0 };
+      // bit per address talking protocol v2
+    uint8_t negotiated[16] = { 0 };
+      // bit per address with a negotiated protocol
+    uint8_t frame2[32];
+    uint8_t frame2Len = 0;
+    uint8_t seq = 0;
+    uint8_t frame2Status = 0;
+      // last v2 frame, its sequence number and status
 };
 
 #endif